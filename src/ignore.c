@@ -10,6 +10,7 @@
 #include "log.h"
 #include "options.h"
 #include "scandir.h"
+#include "stats.h"
 #include "util.h"
 
 #ifdef _WIN32
@@ -20,6 +21,8 @@
 const int fnmatch_flags = FNM_PATHNAME;
 #endif
 
+__thread ignores *root_ignores = NULL;
+
 /* TODO: build a huge-ass list of files we want to ignore by default (build cache stuff, pyc files, etc) */
 
 const char *evil_hardcoded_ignore_files[] = {
@@ -347,6 +350,9 @@ static int path_ignore_search(const ignores *ig, const char *path, const char *f
 int filename_filter(const char *path, const struct dirent *dir, void *baton) {
     const char *filename = dir->d_name;
     if (!opts.search_hidden_files && filename[0] == '.') {
+        if (strcmp(filename, ".") != 0 && strcmp(filename, "..") != 0) {
+            stats_skip(STATS_SKIP_IGNORED);
+        }
         return 0;
     }
 
@@ -359,11 +365,13 @@ int filename_filter(const char *path, const struct dirent *dir, void *baton) {
 
     if (!opts.follow_symlinks && is_symlink(path, dir)) {
         log_debug("File %s ignored becaused it's a symlink", dir->d_name);
+        stats_skip(STATS_SKIP_SYMLINK);
         return 0;
     }
 
     if (is_named_pipe(path, dir)) {
         log_debug("%s ignored because it's a named pipe", path);
+        stats_skip(STATS_SKIP_IGNORED);
         return 0;
     }
 
@@ -411,11 +419,13 @@ int filename_filter(const char *path, const struct dirent *dir, void *baton) {
             int match_pos = binary_search(extension, ig->extensions, 0, ig->extensions_len);
             if (match_pos >= 0) {
                 log_debug("file %s ignored because name matches extension %s", filename, ig->extensions[match_pos]);
+                stats_skip(STATS_SKIP_IGNORED);
                 return 0;
             }
         }
 
         if (path_ignore_search(ig, path_start, filename)) {
+            stats_skip(STATS_SKIP_IGNORED);
             return 0;
         }
 
@@ -425,6 +435,7 @@ int filename_filter(const char *path, const struct dirent *dir, void *baton) {
             int rv = path_ignore_search(ig, path_start, temp);
             free(temp);
             if (rv) {
+                stats_skip(STATS_SKIP_IGNORED);
                 return 0;
             }
         }
@@ -31,7 +31,10 @@ struct ignores {
 };
 typedef struct ignores ignores;
 
-ignores *root_ignores;
+/* The ignores from options and the global ignore files, for the search this
+ * thread is setting up or walking
+ */
+extern __thread ignores *root_ignores;
 
 extern const char *evil_hardcoded_ignore_files[];
 extern const char *ignore_pattern_files[];
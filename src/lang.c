@@ -1,3 +1,4 @@
+#include <ctype.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -109,36 +110,219 @@ size_t get_lang_count() {
     return sizeof(langs) / sizeof(lang_spec_t);
 }
 
-char *make_lang_regex(char *ext_array, size_t num_exts) {
-    int regex_capacity = 100;
-    char *regex = ag_malloc(regex_capacity);
-    int regex_length = 3;
-    int subsequent = 0;
-    char *extension;
+static int compare_extensions(const void *a, const void *b) {
+    return strcmp((const char *)a, (const char *)b);
+}
+
+size_t sort_file_extensions(char *ext_array, size_t num_exts) {
     size_t i;
+    size_t len = 0;
+
+    qsort(ext_array, num_exts, SINGLE_EXT_LEN, &compare_extensions);
+    /* Languages share extensions (--cc and --cpp both have .h) */
+    for (i = 0; i < num_exts; i++) {
+        if (len > 0 && strcmp(ext_array + (len - 1) * SINGLE_EXT_LEN, ext_array + i * SINGLE_EXT_LEN) == 0) {
+            continue;
+        }
+        if (len != i) {
+            memcpy(ext_array + len * SINGLE_EXT_LEN, ext_array + i * SINGLE_EXT_LEN, SINGLE_EXT_LEN);
+        }
+        len++;
+    }
+    return len;
+}
 
-    strcpy(regex, "\\.(");
+int has_file_extension(const char *path, const char *ext_array, size_t num_exts) {
+    const char *name = strrchr(path, '/');
+    const char *dot;
 
-    for (i = 0; i < num_exts; ++i) {
-        extension = ext_array + i * SINGLE_EXT_LEN;
-        int extension_length = strlen(extension);
-        while (regex_length + extension_length + 3 + subsequent > regex_capacity) {
-            regex_capacity *= 2;
-            regex = ag_realloc(regex, regex_capacity);
+    name = name ? name + 1 : path;
+    /* Extensions can have dots in them, so try everything after each dot */
+    for (dot = strchr(name, '.'); dot != NULL; dot = strchr(dot + 1, '.')) {
+        if (strlen(dot + 1) < SINGLE_EXT_LEN &&
+            bsearch(dot + 1, ext_array, num_exts, SINGLE_EXT_LEN, &compare_extensions) != NULL) {
+            return 1;
         }
-        if (subsequent) {
-            regex[regex_length++] = '|';
+    }
+    return 0;
+}
+
+/* Interpreters and editor modes that aren't called what we call the type */
+static const char *lang_aliases[][2] = {
+    { "bash", "shell" },
+    { "c", "cc" },
+    { "c++", "cpp" },
+    { "dash", "shell" },
+    { "emacs-lisp", "elisp" },
+    { "escript", "erlang" },
+    { "javascript", "js" },
+    { "ksh", "shell" },
+    { "node", "js" },
+    { "nodejs", "js" },
+    { "rscript", "r" },
+    { "runhaskell", "haskell" },
+    { "sh", "shell" },
+    { "tclsh", "tcl" },
+    { "typescript", "ts" },
+    { "wish", "tcl" },
+    { "zsh", "shell" }
+};
+
+/* Find the type named word[0, len). Case and version numbers (python3.11) don't matter. */
+static int find_lang(const char *word, size_t len) {
+    char name[SINGLE_EXT_LEN];
+    const char *lang_name = name;
+    size_t i;
+
+    while (len > 0 && (isdigit((unsigned char)word[len - 1]) || word[len - 1] == '.')) {
+        len--;
+    }
+    if (len == 0 || len >= sizeof(name)) {
+        return -1;
+    }
+    for (i = 0; i < len; i++) {
+        name[i] = tolower((unsigned char)word[i]);
+    }
+    name[len] = '\0';
+
+    for (i = 0; i < sizeof(lang_aliases) / sizeof(lang_aliases[0]); i++) {
+        if (strcmp(lang_aliases[i][0], name) == 0) {
+            lang_name = lang_aliases[i][1];
+            break;
+        }
+    }
+    for (i = 0; i < get_lang_count(); i++) {
+        if (strcmp(langs[i].name, lang_name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Return the first whitespace-separated word in [*pos, end) and its length,
+ * advancing *pos past it. NULL if there isn't one.
+ */
+static const char *next_word(const char **pos, const char *end, size_t *len) {
+    const char *word;
+
+    while (*pos < end && isspace((unsigned char)**pos)) {
+        (*pos)++;
+    }
+    word = *pos;
+    while (*pos < end && !isspace((unsigned char)**pos)) {
+        (*pos)++;
+    }
+    *len = *pos - word;
+    return *len > 0 ? word : NULL;
+}
+
+/* Length of the mode or file type name at the start of pos */
+static size_t mode_len(const char *pos, const char *end) {
+    const char *start = pos;
+
+    while (pos < end && (isalnum((unsigned char)*pos) || *pos == '+' || *pos == '-' || *pos == '_' || *pos == '.')) {
+        pos++;
+    }
+    return pos - start;
+}
+
+static const char *find_str(const char *pos, const char *end, const char *needle) {
+    size_t needle_len = strlen(needle);
+
+    for (; pos + needle_len <= end; pos++) {
+        if (memcmp(pos, needle, needle_len) == 0) {
+            return pos;
+        }
+    }
+    return NULL;
+}
+
+/* #!/usr/bin/python, #!/usr/bin/env python3 or #!/usr/bin/env -S perl -w */
+static int sniff_shebang(const char *pos, const char *end) {
+    const char *interp;
+    const char *slash;
+    size_t len;
+
+    interp = next_word(&pos, end, &len);
+    if (interp == NULL) {
+        return -1;
+    }
+    for (slash = interp; slash < interp + len; slash++) {
+        if (*slash == '/') {
+            len -= slash + 1 - interp;
+            interp = slash + 1;
+        }
+    }
+    if (len == 3 && strncmp(interp, "env", 3) == 0) {
+        /* Skip env's flags and variable assignments */
+        while ((interp = next_word(&pos, end, &len)) != NULL &&
+               (interp[0] == '-' || memchr(interp, '=', len) != NULL)) {
+        }
+        if (interp == NULL) {
+            return -1;
+        }
+    }
+    return find_lang(interp, len);
+}
+
+/* -*- mode: python; -*-, -*- python -*- or vim: set ft=python: */
+static int sniff_modeline(const char *line, const char *end) {
+    const char *pos;
+    size_t len;
+
+    if ((pos = find_str(line, end, "-*-")) != NULL) {
+        const char *mode_end = find_str(pos + 3, end, "-*-");
+        const char *mode;
+        if (mode_end == NULL) {
+            return -1;
+        }
+        pos += 3;
+        if ((mode = find_str(pos, mode_end, "mode:")) != NULL) {
+            pos = mode + strlen("mode:");
+        }
+        while (pos < mode_end && isspace((unsigned char)*pos)) {
+            pos++;
+        }
+        return find_lang(pos, mode_len(pos, mode_end));
+    }
+
+    for (pos = line; (pos = find_str(pos, end, "vi")) != NULL; pos++) {
+        const char *ft;
+        if (pos > line && !isspace((unsigned char)pos[-1])) {
+            continue;
+        }
+        len = strncmp(pos, "vim:", 4) == 0 ? 4 : strncmp(pos, "vi:", 3) == 0 ? 3 : 0;
+        if (len == 0) {
+            continue;
+        }
+        if ((ft = find_str(pos + len, end, "ft=")) == NULL) {
+            ft = find_str(pos + len, end, "filetype=");
+            if (ft == NULL) {
+                return -1;
+            }
+            ft += strlen("filetype=");
         } else {
-            subsequent = 1;
+            ft += strlen("ft=");
         }
-        strcpy(regex + regex_length, extension);
-        regex_length += extension_length;
+        return find_lang(ft, mode_len(ft, end));
     }
+    return -1;
+}
+
+int sniff_file_type(const char *buf, size_t len) {
+    const char *line_end;
 
-    regex[regex_length++] = ')';
-    regex[regex_length++] = '$';
-    regex[regex_length++] = 0;
-    return regex;
+    if (len > MAX_SNIFF_LEN) {
+        len = MAX_SNIFF_LEN;
+    }
+    line_end = memchr(buf, '\n', len);
+    if (line_end == NULL) {
+        line_end = buf + len;
+    }
+    if (len >= 2 && buf[0] == '#' && buf[1] == '!') {
+        return sniff_shebang(buf + 2, line_end);
+    }
+    return sniff_modeline(buf, line_end);
 }
 
 size_t combine_file_extensions(size_t *extension_index, size_t len, char **exts) {
@@ -3,6 +3,8 @@
 
 #define MAX_EXTENSIONS 12
 #define SINGLE_EXT_LEN 20
+/* Only look this far into a file for a shebang or modeline */
+#define MAX_SNIFF_LEN 256
 
 typedef struct {
     const char *name;
@@ -17,13 +19,24 @@ extern lang_spec_t langs[];
 size_t get_lang_count(void);
 
 /**
-Convert a NULL-terminated array of language extensions
-into a regular expression of the form \.(extension1|extension2...)$
+Sort the extensions returned by combine_file_extensions() and remove
+duplicates, so that has_file_extension() can binary search them.
+The number of extensions left is returned.
+*/
+size_t sort_file_extensions(char *ext_array, size_t num_exts);
 
-Caller is responsible for freeing the returned string.
+/**
+Return 1 if the file name in path ends with a dot followed by one of the
+extensions in ext_array, which must have been sorted by sort_file_extensions().
 */
-char *make_lang_regex(char *ext_array, size_t num_exts);
+int has_file_extension(const char *path, const char *ext_array, size_t num_exts);
 
+/**
+Guess the type of an extensionless file from the shebang or an Emacs or Vim
+modeline on its first line. Returns an index into langs, or -1 if there's no
+telling.
+*/
+int sniff_file_type(const char *buf, size_t len);
 
 /**
 Combine multiple file type extensions into one array.
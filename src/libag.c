@@ -0,0 +1,551 @@
+#include <ctype.h>
+#include <pcre.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+#include "config.h"
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#include "libag.h"
+#include "log.h"
+#include "options.h"
+#include "queries.h"
+#include "search.h"
+#include "stats.h"
+#include "topology.h"
+#include "trace.h"
+#include "util.h"
+#include "watch.h"
+
+/* Each search keeps what its threads share in a search_t, and each thread has
+ * its own opts, out_fd and root_ignores. So searches in different threads run
+ * at the same time without meeting. Only parsing options takes turns, since
+ * getopt keeps its place in globals.
+ */
+static pthread_mutex_t getopt_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+struct ag_context {
+    cli_options opts; /* Without the query */
+    ignores *root_ignores;
+};
+
+struct ag_query {
+    pattern_t pattern; /* Owns its query, regex and skip lookups */
+    int pcre_opts;
+    int study_opts;
+};
+
+static void query_cleanup(ag_query_t *query) {
+    pattern_t *pattern = &query->pattern;
+
+    free(pattern->query);
+    if (pattern->re) {
+        pcre_free(pattern->re);
+    }
+    if (pattern->re_extra) {
+        /* Using pcre_free_study on pcre_extra* can segfault on some versions of PCRE */
+        pcre_free(pattern->re_extra);
+    }
+    free(pattern->alpha_skip_lookup);
+    free(pattern->find_skip_lookup);
+}
+
+/* Get pattern ready to search for with options' -Q, -i, -w, etc: lowercase
+ * it for a case-insensitive literal search, or compile it. Returns FALSE and
+ * sets error if the regex is invalid.
+ */
+static int compile_query(ag_query_t *query, const cli_options *options, const char *q, char **error) {
+    pattern_t *pattern = &query->pattern;
+    int pcre_opts = PCRE_MULTILINE;
+    int study_opts = 0;
+    char *c;
+
+    memset(query, 0, sizeof(ag_query_t));
+    pattern->query = ag_strdup(q);
+    pattern->query_len = strlen(q);
+    pattern->literal = options->literal || !is_regex(q);
+    pattern->casing = options->casing;
+    pattern->word_regexp = options->word_regexp;
+    pattern->invert_match = options->invert_match;
+
+#ifdef USE_PCRE_JIT
+    int has_jit = 0;
+    pcre_config(PCRE_CONFIG_JIT, &has_jit);
+    if (has_jit) {
+        study_opts |= PCRE_STUDY_JIT_COMPILE;
+#ifdef PCRE_STUDY_JIT_PARTIAL_HARD_COMPILE
+        /* Searching part of a big file uses partial matching */
+        if (options->split_size > 0) {
+            study_opts |= PCRE_STUDY_JIT_PARTIAL_HARD_COMPILE;
+        }
+#endif
+    }
+#endif
+
+    if (pattern->casing == CASE_SMART) {
+        pattern->casing = is_lowercase(pattern->query) ? CASE_INSENSITIVE : CASE_SENSITIVE;
+    }
+
+    if (pattern->literal) {
+        if (pattern->casing == CASE_INSENSITIVE) {
+            /* Search routine needs the query to be lowercase */
+            for (c = pattern->query; *c != '\0'; ++c) {
+                *c = (char)tolower(*c);
+            }
+        }
+        pattern->alpha_skip_lookup = ag_malloc(256 * sizeof(size_t));
+        generate_alpha_skip(pattern->query, pattern->query_len, pattern->alpha_skip_lookup, pattern->casing == CASE_SENSITIVE);
+        generate_find_skip(pattern->query, pattern->query_len, &pattern->find_skip_lookup, pattern->casing == CASE_SENSITIVE);
+        if (pattern->word_regexp) {
+            init_wordchar_table();
+            pattern->literal_starts_wordchar = is_wordchar(pattern->query[0]);
+            pattern->literal_ends_wordchar = is_wordchar(pattern->query[pattern->query_len - 1]);
+        }
+    } else {
+        if (pattern->casing == CASE_INSENSITIVE) {
+            pcre_opts |= PCRE_CASELESS;
+        }
+        if (pattern->word_regexp) {
+            char *word_regexp_query;
+            ag_asprintf(&word_regexp_query, "\\b(?:%s)\\b", pattern->query);
+            free(pattern->query);
+            pattern->query = word_regexp_query;
+            pattern->query_len = strlen(pattern->query);
+        }
+        if (!compile_study(&pattern->re, &pattern->re_extra, pattern->query, pcre_opts, study_opts, error)) {
+            query_cleanup(query);
+            return FALSE;
+        }
+    }
+    query->pcre_opts = pcre_opts;
+    query->study_opts = study_opts;
+    return TRUE;
+}
+
+/* Search paths for query with this thread's opts. Starts the workers, waits
+ * for them and writes out stats. Returns whether anything matched, or -1 and
+ * sets error if the search couldn't be started.
+ */
+static int run_search(const ag_query_t *query, char *base_paths[], char *paths[], char **error) {
+    search_t search;
+    int i;
+    worker_t *workers = NULL;
+    int workers_len;
+    int workers_started = 0;
+    int usable_cpus;
+    int nodes = 1;
+    cpu_topology_t topo;
+    int rv = 0;
+    int matched;
+
+    /* Size the pool from the CPUs we may run on and the time we're allowed
+     * on them, not from how many the machine has.
+     */
+    topology_detect(&topo);
+    usable_cpus = topology_usable_cpus(&topo);
+    workers_len = usable_cpus;
+    if (query->pattern.literal) {
+        workers_len--;
+    }
+    if (opts.workers) {
+        workers_len = opts.workers;
+    }
+    if (workers_len < 1) {
+        workers_len = 1;
+    }
+    opts.workers = workers_len;
+
+    if (opts.workers_auto) {
+        fprintf(stderr, "ag: using %i worker%s: %i CPU%s allowed on %i core%s and %i NUMA node%s",
+                workers_len, workers_len == 1 ? "" : "s",
+                topo.cpus_len, topo.cpus_len == 1 ? "" : "s",
+                topo.cores, topo.cores == 1 ? "" : "s",
+                topo.nodes, topo.nodes == 1 ? "" : "s");
+        if (topo.quota > 0) {
+            fprintf(stderr, ", CPU quota %.2f", topo.quota);
+        }
+        if (workers_len < usable_cpus) {
+            fprintf(stderr, ", one fewer for a literal search");
+        }
+        fprintf(stderr, "\n");
+    }
+    log_debug("Using %i workers", workers_len);
+    workers = ag_calloc(workers_len, sizeof(worker_t));
+    for (i = 0; i < workers_len; i++) {
+        workers[i].id = i;
+        workers[i].cpu = -1;
+        workers[i].node = 0;
+        workers[i].search = &search;
+    }
+#if defined(HAVE_PTHREAD_SETAFFINITY_NP) && defined(USE_CPU_SET)
+    if (opts.use_thread_affinity) {
+        /* topo.cpus puts separate cores (and nodes) before SMT siblings.
+         * Workers can only stay on their node's memory if they're pinned.
+         */
+        for (i = 0; i < workers_len; i++) {
+            workers[i].cpu = topo.cpus[i % topo.cpus_len].cpu;
+            workers[i].node = topo.cpus[i % topo.cpus_len].node;
+        }
+        /* The first workers cover every node if there are enough of them */
+        nodes = topo.nodes < workers_len ? topo.nodes : workers_len;
+    } else {
+        log_debug("Thread affinity disabled.");
+    }
+#else
+    log_debug("No CPU affinity support.");
+#endif
+    if (!search_init(&search, &query->pattern, nodes, query->pcre_opts, query->study_opts, error)) {
+        free(workers);
+        topology_cleanup(&topo);
+        return -1;
+    }
+
+    if (STATS_ENABLED) {
+        stats_init();
+    }
+    if (TRACE_ENABLED) {
+        trace_init();
+        trace_thread_name("walker", -1);
+    }
+
+    if (opts.search_stream) {
+        search_stream(stdin, "");
+    } else {
+        if (opts.prefetch_len > 0) {
+            rv = prefetch_start();
+        }
+        for (i = 0; i < workers_len && rv == 0; i++) {
+            /* Workers pin themselves as soon as they start */
+            rv = pthread_create(&(workers[i].thread), NULL, &search_file_worker, &(workers[i]));
+            if (rv == 0) {
+                workers_started++;
+            }
+        }
+
+        if (rv != 0) {
+            ag_asprintf(error, "Error in pthread_create(): %s", strerror(rv));
+            /* The workers that did start have nothing to do but stop */
+            search_set_done(TRUE);
+        } else {
+            for (i = 0; paths[i] != NULL; i++) {
+                log_debug("searching path %s for %s", paths[i], query->pattern.query);
+                search.symhash = NULL;
+                ignores *ig = init_ignore(root_ignores, "", 0);
+                struct stat s = {.st_dev = 0 };
+#ifndef _WIN32
+                /* The device is ignored if opts.one_dev is false, so it's fine
+                 * to leave it at the default 0
+                 */
+                if (opts.one_dev && lstat(paths[i], &s) == -1) {
+                    log_err("Failed to get device information for path %s. Skipping...", paths[i]);
+                }
+#endif
+                search_dir(ig, base_paths[i], paths[i], 0, s.st_dev);
+                /* --watch keeps it for files added later */
+                if (!opts.watch) {
+                    cleanup_ignore(ig);
+                }
+            }
+        }
+        work_queue_done_adding();
+        for (i = 0; i < workers_started; i++) {
+            if (pthread_join(workers[i].thread, NULL)) {
+                log_err("pthread_join failed!");
+            }
+        }
+        if (opts.prefetch_len > 0) {
+            prefetch_stop();
+        }
+#ifdef HAVE_SYS_INOTIFY_H
+        if (opts.watch && rv == 0) {
+            watch_run();
+            watch_cleanup();
+        }
+#endif
+    }
+
+    if (STATS_ENABLED) {
+        stats_merge();
+        if (opts.stats) {
+            stats_print(stdout);
+        }
+        if (opts.stats_json) {
+            FILE *stats_fp = strcmp(opts.stats_json, "-") == 0 ? stdout : fopen(opts.stats_json, "w");
+            if (stats_fp == NULL) {
+                log_err("Failed to open %s for --stats-json: %s", opts.stats_json, strerror(errno));
+            } else {
+                stats_print_json(stats_fp);
+                if (stats_fp != stdout) {
+                    fclose(stats_fp);
+                }
+            }
+        }
+        stats_cleanup();
+    }
+
+    if (TRACE_ENABLED) {
+        FILE *trace_fp = fopen(opts.trace, "w");
+        if (trace_fp == NULL) {
+            log_err("Failed to open %s for --trace: %s", opts.trace, strerror(errno));
+        } else {
+            trace_write(trace_fp);
+            fclose(trace_fp);
+        }
+        trace_cleanup();
+    }
+
+    matched = search.match_found;
+    search_cleanup(&search);
+    free(workers);
+    topology_cleanup(&topo);
+    return rv != 0 ? -1 : matched;
+}
+
+static void free_paths(char *base_paths[], char *paths[]) {
+    int i;
+
+    if (paths == NULL) {
+        return;
+    }
+    for (i = 0; paths[i] != NULL; i++) {
+        free(paths[i]);
+        free(base_paths[i]);
+    }
+    free(base_paths);
+    free(paths);
+}
+
+int ag_main(int argc, char **argv) {
+    char **base_paths = NULL;
+    char **paths = NULL;
+    char *error = NULL;
+    ag_query_t query;
+    int matched;
+
+    set_log_level(LOG_LEVEL_WARN);
+
+    root_ignores = init_ignore(NULL, "", 0);
+    out_fd = stdout;
+
+    switch (parse_options(argc, argv, &base_paths, &paths, &error)) {
+        case PARSE_SEARCH:
+            break;
+        case PARSE_HELP:
+            usage();
+            return 0;
+        case PARSE_VERSION:
+            print_version();
+            return 0;
+        case PARSE_LIST_FILE_TYPES:
+            print_file_types();
+            return 0;
+        case PARSE_USAGE:
+            if (error) {
+                log_err("%s", error);
+            }
+            usage();
+            return 1;
+        case PARSE_NO_QUERY:
+            log_err("%s", error);
+            return 1;
+        case PARSE_ERROR:
+            die("%s", error);
+    }
+
+    if (opts.pager) {
+        out_fd = popen(opts.pager, "w");
+        if (!out_fd) {
+            perror("Failed to run pager");
+            return 1;
+        }
+    }
+    log_debug("PCRE Version: %s", pcre_version());
+
+    if (!compile_query(&query, &opts, opts.query, &error)) {
+        die("%s", error);
+    }
+    if (opts.queries) {
+        /* Each query does its own smart case */
+        queries_load(opts.queries, opts.casing, query.study_opts);
+    }
+
+#ifdef HAVE_PLEDGE
+    if (pledge("stdio rpath", NULL) == -1) {
+        die("pledge: %s", strerror(errno));
+    }
+#endif
+    if (opts.packed) {
+        print_packed_header();
+    }
+    matched = run_search(&query, base_paths, paths, &error);
+    if (matched < 0) {
+        die("%s", error);
+    }
+
+    queries_cleanup();
+    print_packed_cleanup();
+    if (opts.pager) {
+        pclose(out_fd);
+    }
+    cleanup_options();
+    cleanup_ignore(root_ignores);
+    free_paths(base_paths, paths);
+    query_cleanup(&query);
+    return !matched;
+}
+
+/* The options that only make sense for ag itself, or NULL */
+static const char *cli_only_option(void) {
+    if (opts.watch) {
+        return "--watch";
+    }
+    if (opts.pager) {
+        return "--pager";
+    }
+    if (opts.queries) {
+        return "--queries";
+    }
+    if (STATS_ENABLED) {
+        return "--stats";
+    }
+    if (opts.trace) {
+        return "--trace";
+    }
+    if (opts.packed) {
+        return "--packed";
+    }
+    return NULL;
+}
+
+ag_context_t *ag_context_new(int argc, char **argv, char **error) {
+    ag_context_t *ctx = NULL;
+    char **args = ag_calloc(argc + 3, sizeof(char *));
+    char **base_paths = NULL;
+    char **paths = NULL;
+    enum parse_result result;
+    const char *option;
+    int i;
+
+    /* parse_options() wants a query and paths. Neither is kept. "." is a
+     * regex, so opts.literal is only set by -Q.
+     */
+    for (i = 0; i < argc; i++) {
+        args[i] = argv[i];
+    }
+    args[i++] = ".";
+    args[i++] = ".";
+
+    root_ignores = init_ignore(NULL, "", 0);
+    pthread_mutex_lock(&getopt_mtx);
+    /* getopt keeps its place in globals. Make it start over, and have it
+     * leave saying what's wrong to us.
+     */
+#ifdef __GLIBC__
+    optind = 0;
+#else
+    optind = 1;
+#endif
+    opterr = 0;
+    result = parse_options(i, args, &base_paths, &paths, error);
+    opterr = 1;
+    pthread_mutex_unlock(&getopt_mtx);
+    free(args);
+    free_paths(base_paths, paths);
+
+    if (result == PARSE_HELP || result == PARSE_VERSION || result == PARSE_LIST_FILE_TYPES) {
+        ag_asprintf(error, "--help, --version and --list-file-types only work from the command line");
+    } else if (result == PARSE_SEARCH && (option = cli_only_option()) != NULL) {
+        ag_asprintf(error, "%s only works from the command line", option);
+        result = PARSE_ERROR;
+    }
+
+    if (result == PARSE_SEARCH) {
+        free(opts.query);
+        opts.query = NULL;
+        opts.query_len = 0;
+        opts.paths_len = 0;
+        ctx = ag_calloc(1, sizeof(ag_context_t));
+        ctx->opts = opts;
+        ctx->root_ignores = root_ignores;
+    } else {
+        cleanup_options();
+        cleanup_ignore(root_ignores);
+    }
+    memset(&opts, 0, sizeof(opts));
+    root_ignores = NULL;
+    return ctx;
+}
+
+void ag_context_set_callback(ag_context_t *ctx, ag_result_cb cb, void *baton) {
+    ctx->opts.result_cb = cb;
+    ctx->opts.result_baton = baton;
+}
+
+void ag_context_free(ag_context_t *ctx) {
+    opts = ctx->opts;
+    cleanup_options();
+    memset(&opts, 0, sizeof(opts));
+    cleanup_ignore(ctx->root_ignores);
+    free(ctx);
+}
+
+ag_query_t *ag_query_compile(ag_context_t *ctx, const char *pattern, char **error) {
+    ag_query_t *query;
+
+    if (*pattern == '\0') {
+        ag_asprintf(error, "Error: No query. What do you want to search for?");
+        return NULL;
+    }
+
+    query = ag_malloc(sizeof(ag_query_t));
+    if (!compile_query(query, &ctx->opts, pattern, error)) {
+        free(query);
+        return NULL;
+    }
+    return query;
+}
+
+void ag_query_free(ag_query_t *query) {
+    if (query == NULL) {
+        return;
+    }
+    query_cleanup(query);
+    free(query);
+}
+
+int ag_search(ag_context_t *ctx, const ag_query_t *query, char *const paths[], const int paths_len, char **error) {
+    char **search_base_paths = NULL;
+    char **search_paths = NULL;
+    int matched;
+
+    resolve_paths(paths_len, paths, &search_base_paths, &search_paths);
+
+    opts = ctx->opts;
+    opts.query = query->pattern.query;
+    opts.query_len = query->pattern.query_len;
+    opts.literal = query->pattern.literal;
+    opts.casing = query->pattern.casing;
+    opts.paths_len = paths_len;
+    root_ignores = ctx->root_ignores;
+    out_fd = stdout;
+
+    matched = run_search(query, search_base_paths, search_paths, error);
+
+    /* Everything in opts belongs to ctx or query */
+    memset(&opts, 0, sizeof(opts));
+    root_ignores = NULL;
+    out_fd = NULL;
+
+    free_paths(search_base_paths, search_paths);
+    return matched;
+}
@@ -0,0 +1,70 @@
+#ifndef LIBAG_H
+#define LIBAG_H
+
+#include <stddef.h>
+
+/* Search from inside another program instead of running ag.
+ *
+ *   ag_context_t *ctx = ag_context_new(argc, argv, &error);   (options, as for ag)
+ *   ag_query_t *query = ag_query_compile(ctx, "foo.*bar", &error);
+ *   ag_context_set_callback(ctx, &got_result, baton);
+ *   ag_search(ctx, query, paths, paths_len, &error);
+ *   ag_query_free(query);
+ *   ag_context_free(ctx);
+ *
+ * Nothing here exits. Whatever goes wrong is returned in *error, which the
+ * caller frees.
+ *
+ * Contexts and queries can be used from any thread, and any number of them
+ * can exist at once. Searches in different threads run at the same time,
+ * even with the same context and query. Only ag_context_new() takes turns.
+ *
+ * Link with libag.a and the libraries ag itself uses (pcre, pthreads, and
+ * lzma and zlib if ag was built with them).
+ */
+
+/* One match. The pointers are only valid until the callback returns. */
+typedef struct {
+    const char *path;
+    size_t line_number; /* Counting from 1. 0 if this result is for the whole file (-l, -L, -c, -g or a binary file). */
+    const char *line;   /* The line the match starts on, without its newline. NULL if line_number is 0. */
+    size_t line_len;
+    size_t match_start; /* Where the match is in line. A multiline match can end past line_len. */
+    size_t match_end;
+    size_t matches; /* How many matches this result stands for. Only more than 1 for -c. */
+} ag_result_t;
+
+/* Called from the search's worker threads, but never more than once at a time
+ * for the same search. Don't call ag_search() from it.
+ */
+typedef void (*ag_result_cb)(const ag_result_t *result, void *baton);
+
+typedef struct ag_context ag_context_t;
+typedef struct ag_query ag_query_t;
+
+/* Run ag as if from the command line, printing results. Returns the exit status. */
+int ag_main(int argc, char **argv);
+
+/* argv holds options the same way ag takes them (argv[0] is ignored), but no
+ * pattern or paths. Returns NULL and sets *error if they're invalid, or are
+ * ones that only make sense for ag itself (--help, --pager, --watch, --stats,
+ * etc).
+ */
+ag_context_t *ag_context_new(int argc, char **argv, char **error);
+/* Results go to cb. Without a callback they're printed to stdout like ag does. */
+void ag_context_set_callback(ag_context_t *ctx, ag_result_cb cb, void *baton);
+void ag_context_free(ag_context_t *ctx);
+
+/* Compile pattern with ctx's options (-Q, -i, -w, etc). The query can be
+ * used with any context that has the same matching options. Returns NULL
+ * and sets *error (which the caller frees) if it isn't a valid regex.
+ */
+ag_query_t *ag_query_compile(ag_context_t *ctx, const char *pattern, char **error);
+void ag_query_free(ag_query_t *query);
+
+/* Search paths for query. Returns 1 if anything matched, 0 if not, or -1 and
+ * sets *error if the search couldn't be started.
+ */
+int ag_search(ag_context_t *ctx, const ag_query_t *query, char *const paths[], const int paths_len, char **error);
+
+#endif
@@ -6,8 +6,9 @@
 
 static enum log_level log_threshold = LOG_LEVEL_ERR;
 
+/* Any thread can log while another sets the level */
 void set_log_level(enum log_level threshold) {
-    log_threshold = threshold;
+    __atomic_store_n(&log_threshold, threshold, __ATOMIC_RELAXED);
 }
 
 void log_debug(const char *fmt, ...) {
@@ -39,11 +40,12 @@ void log_err(const char *fmt, ...) {
 }
 
 void vplog(const unsigned int level, const char *fmt, va_list args) {
-    if (level < log_threshold) {
+    if (level < __atomic_load_n(&log_threshold, __ATOMIC_RELAXED)) {
         return;
     }
 
-    FILE *stream = out_fd;
+    /* A thread that isn't searching has no out_fd of its own */
+    FILE *stream = out_fd ? out_fd : stdout;
 
     switch (level) {
         case LOG_LEVEL_DEBUG:
@@ -16,6 +16,8 @@
 #include "print.h"
 #include "util.h"
 
+__thread cli_options opts;
+
 const char *color_line_number = "\033[1;33m"; /* bold yellow */
 const char *color_match = "\033[30;43m";      /* black with yellow background */
 const char *color_path = "\033[1;32m";        /* bold green */
@@ -58,6 +60,8 @@ Output Options:\n\
   -C --context [LINES]    Print lines before and after matches (Default: 2)\n\
      --[no]group          Same as --[no]break --[no]heading\n\
   -g PATTERN              Print filenames matching PATTERN\n\
+     --json               Print one JSON object per line for each match, each\n\
+                          line of context and the start and end of each file\n\
   -l --files-with-matches Only print filenames that contain matches\n\
                           (don't print the matching lines)\n\
   -L --files-without-matches\n\
@@ -65,13 +69,24 @@ Output Options:\n\
      --[no]numbers        Print line numbers. Default is to omit line numbers\n\
                           when searching streams\n\
   -o --only-matching      Prints only the matching part of the lines\n\
+     --packed             Print matches in a compact binary format for other\n\
+                          programs to read (see packed.h)\n\
+     --packed-nolines     Like --packed, but without the text of each line\n\
+     --replace TEMPLATE   Print each match as TEMPLATE, with $1 to $99 (or ${1})\n\
+                          replaced by capture groups and $0 by the whole\n\
+                          match. Implies --only-matching\n\
      --print-long-lines   Print matches on very long lines (Default: >2k characters)\n\
      --passthrough        When searching a stream, print all lines even if they\n\
                           don't match\n\
+  -q --quiet              Don't print anything. Exit as soon as a match is found\n\
+                          (the exit status tells whether there was a match)\n\
      --silent             Suppress all log messages, including errors\n\
      --stats              Print stats (files scanned, time taken, etc.)\n\
      --stats-only         Print stats and nothing else.\n\
                           (Same as --count when searching a single file)\n\
+     --stats-json FILE    Write detailed stats as JSON to FILE ('-' for stdout)\n\
+     --trace FILE         Write a timeline of what every thread did to FILE\n\
+                          (Chrome trace event JSON)\n\
      --vimgrep            Print results like vim's :vimgrep /pattern/g would\n\
                           (it reports every match on the line)\n\
   -0 --null --print0      Separate filenames with null (for 'xargs -0')\n\
@@ -81,6 +96,10 @@ Search Options:\n\
                           or patterns from ignore files)\n\
   -D --debug              Ridiculous debugging (probably not useful)\n\
      --depth NUM          Search up to NUM directories deep (Default: 25)\n\
+     --dispatch-order ORDER\n\
+                          Search each directory's files in readdir, inode, size\n\
+                          (biggest first) or extent (on-disk) order\n\
+                          (Default: readdir)\n\
   -f --follow             Follow symlinks\n\
   -F --fixed-strings      Alias for --literal for compatibility with grep\n\
   -G --file-search-regex  PATTERN Limit search to filenames matching PATTERN\n\
@@ -89,23 +108,49 @@ Search Options:\n\
      --ignore PATTERN     Ignore files/directories matching PATTERN\n\
                           (literal file/directory names also allowed)\n\
      --ignore-dir NAME    Alias for --ignore for compatibility with ack.\n\
+     --io-uring           Open, stat and read files with io_uring (Linux only)\n\
+     --io-uring-depth NUM Keep NUM files in flight per worker with io_uring\n\
+                          (Default: 16, implies --io-uring)\n\
   -m --max-count NUM      Skip the rest of a file after NUM matches (Default: 10,000)\n\
+     --[no]mmap           Always (never) mmap files instead of reading them\n\
+                          (Default: mmap files of 1MB or more)\n\
+     --mmap-threshold NUM Read files smaller than NUM bytes, mmap the rest\n\
+     --max-total-count NUM\n\
+                          Stop searching after NUM matches in total\n\
+                          (or NUM files with -l, -L or -c)\n\
      --one-device         Don't follow links to other devices.\n\
   -p --path-to-agignore STRING\n\
                           Use .agignore file at STRING\n\
+     --prefetch NUM       Ask the OS to start reading the next NUM queued files\n\
+                          while searching the current one (Default: 0)\n\
+     --queries FILE       Search for every query in FILE at once, reading each\n\
+                          file only once. Lines are NAME [OPTIONS] PATTERN.\n\
+                          Results start with NAME: unless --queries-output\n\
+     --queries-output DIR Write each query's results to DIR/NAME\n\
   -Q --literal            Don't parse PATTERN as a regular expression\n\
   -s --case-sensitive     Match case sensitively\n\
   -S --smart-case         Match case insensitively unless PATTERN contains\n\
                           uppercase characters (Enabled by default)\n\
      --search-binary      Search binary files for matches\n\
+     --sniff-types        With file types, also search extensionless files whose\n\
+                          shebang or modeline names one of the types\n\
+     --split-size NUM     Search files of NUM bytes or more with several workers\n\
+                          at once. 0 disables this (Default: 64MB)\n\
+     --stream-window NUM  Search streams NUM bytes at a time, so that regexes\n\
+                          can match across lines. 0 searches a line at a time\n\
+                          (Default: 64KB)\n\
   -t --all-text           Search all text files (doesn't include hidden files)\n\
   -u --unrestricted       Search all files (ignore .agignore, .gitignore, etc.;\n\
                           searches binary and hidden files as well)\n\
   -U --skip-vcs-ignores   Ignore VCS ignore files\n\
                           (.gitignore, .hgignore, .svnignore; still obey .agignore)\n\
   -v --invert-match\n\
+     --watch              Keep following the files searched, and search lines\n\
+                          as they're added to them, like tail -F (Linux only)\n\
   -w --word-regexp        Only match whole words\n\
   -W --width NUM          Truncate match lines after NUM characters\n\
+     --workers NUM|auto   Search with NUM threads. auto picks a number from the\n\
+                          CPUs and CPU quota available and says what it picked\n\
   -z --search-zip         Search contents of compressed (e.g., gzip) files\n\
 \n");
     printf("File Types:\n\
@@ -121,6 +166,8 @@ void print_version(void) {
     char jit = '-';
     char lzma = '-';
     char zlib = '-';
+    char io_uring = '-';
+    char inotify = '-';
 
 #ifdef USE_PCRE_JIT
     jit = '+';
@@ -131,10 +178,31 @@ void print_version(void) {
 #ifdef HAVE_ZLIB_H
     zlib = '+';
 #endif
+#ifdef USE_IO_URING
+    io_uring = '+';
+#endif
+#ifdef HAVE_SYS_INOTIFY_H
+    inotify = '+';
+#endif
 
     printf("ag version %s\n\n", PACKAGE_VERSION);
     printf("Features:\n");
-    printf("  %cjit %clzma %czlib\n", jit, lzma, zlib);
+    printf("  %cjit %clzma %czlib %cio_uring %cinotify\n", jit, lzma, zlib, io_uring, inotify);
+}
+
+void print_file_types(void) {
+    size_t lang_count = get_lang_count();
+    size_t lang_index;
+    int j;
+
+    printf("The following file types are supported:\n");
+    for (lang_index = 0; lang_index < lang_count; lang_index++) {
+        printf("  --%s\n    ", langs[lang_index].name);
+        for (j = 0; j < MAX_EXTENSIONS && langs[lang_index].extensions[j]; j++) {
+            printf("  .%s", langs[lang_index].extensions[j]);
+        }
+        printf("\n\n");
+    }
 }
 
 void init_options(void) {
@@ -144,6 +212,9 @@ void init_options(void) {
     opts.color_win_ansi = FALSE;
     opts.max_matches_per_file = 0;
     opts.max_search_depth = DEFAULT_MAX_SEARCH_DEPTH;
+    opts.mmap_threshold = DEFAULT_MMAP_THRESHOLD;
+    opts.split_size = DEFAULT_SPLIT_SIZE;
+    opts.stream_window = DEFAULT_STREAM_WINDOW;
     opts.multiline = TRUE;
     opts.width = 0;
     opts.path_sep = '\n';
@@ -166,12 +237,6 @@ void cleanup_options(void) {
         free(opts.query);
     }
 
-    pcre_free(opts.re);
-    if (opts.re_extra) {
-        /* Using pcre_free_study on pcre_extra* can segfault on some versions of PCRE */
-        pcre_free(opts.re_extra);
-    }
-
     if (opts.ackmate_dir_filter) {
         pcre_free(opts.ackmate_dir_filter);
     }
@@ -185,12 +250,60 @@ void cleanup_options(void) {
     if (opts.file_search_regex_extra) {
         pcre_free(opts.file_search_regex_extra);
     }
+
+    free(opts.lang_exts);
+    free(opts.lang_selected);
 }
 
-void parse_options(int argc, char **argv, char **base_paths[], char **paths[]) {
-    int ch;
+/* Copy each path, minus any trailing slash, and find its real path. With no
+ * paths, search the current directory. Both lists end with NULL.
+ */
+void resolve_paths(const int argc, char *const argv[], char **base_paths[], char **paths[]) {
     size_t i;
     int path_len = 0;
+    char *path = NULL;
+#ifdef PATH_MAX
+    char *tmp = NULL;
+#endif
+    if (argc > 0) {
+        *paths = ag_calloc(sizeof(char *), argc + 1);
+        *base_paths = ag_calloc(sizeof(char *), argc + 1);
+        for (i = 0; i < (size_t)argc; i++) {
+            path = ag_strdup(argv[i]);
+            path_len = strlen(path);
+            /* kill trailing slash */
+            if (path_len > 1 && path[path_len - 1] == '/') {
+                path[path_len - 1] = '\0';
+            }
+            (*paths)[i] = path;
+#ifdef PATH_MAX
+            tmp = ag_malloc(PATH_MAX);
+            (*base_paths)[i] = realpath(path, tmp);
+#else
+            (*base_paths)[i] = realpath(path, NULL);
+#endif
+        }
+    } else {
+        path = ag_strdup(".");
+        *paths = ag_malloc(sizeof(char *) * 2);
+        *base_paths = ag_malloc(sizeof(char *) * 2);
+        (*paths)[0] = path;
+#ifdef PATH_MAX
+        tmp = ag_malloc(PATH_MAX);
+        (*base_paths)[0] = realpath(path, tmp);
+#else
+        (*base_paths)[0] = realpath(path, NULL);
+#endif
+        i = 1;
+    }
+    (*paths)[i] = NULL;
+    (*base_paths)[i] = NULL;
+}
+
+enum parse_result parse_options(int argc, char **argv, char **base_paths[], char **paths[], char **error) {
+    enum parse_result result = PARSE_SEARCH;
+    int ch;
+    size_t i;
     int useless = 0;
     int group = 1;
     int help = 0;
@@ -210,11 +323,9 @@ void parse_options(int argc, char **argv, char **base_paths[], char **paths[]) {
 
     size_t longopts_len, full_len;
     option_t *longopts;
-    char *lang_regex = NULL;
     size_t *ext_index = NULL;
-    char *extensions = NULL;
-    size_t num_exts = 0;
 
+    *error = NULL;
     init_options();
 
     option_t base_longopts[] = {
@@ -237,6 +348,7 @@ void parse_options(int argc, char **argv, char **base_paths[], char **paths[]) {
         { "count", no_argument, NULL, 'c' },
         { "debug", no_argument, NULL, 'D' },
         { "depth", required_argument, NULL, 0 },
+        { "dispatch-order", required_argument, NULL, 0 },
         { "filename", no_argument, NULL, 0 },
         { "file-search-regex", required_argument, NULL, 'G' },
         { "files-with-matches", no_argument, NULL, 'l' },
@@ -251,14 +363,21 @@ void parse_options(int argc, char **argv, char **base_paths[], char **paths[]) {
         { "ignore-case", no_argument, NULL, 'i' },
         { "ignore-dir", required_argument, NULL, 0 },
         { "invert-match", no_argument, NULL, 'v' },
+        { "io-uring", no_argument, NULL, 0 },
+        { "io-uring-depth", required_argument, NULL, 0 },
+        { "json", no_argument, &opts.json, 1 },
         /* deprecated for --numbers. Remove eventually. */
         { "line-numbers", no_argument, &opts.print_line_numbers, 2 },
         { "list-file-types", no_argument, &list_file_types, 1 },
         { "literal", no_argument, NULL, 'Q' },
         { "match", no_argument, &useless, 0 },
         { "max-count", required_argument, NULL, 'm' },
+        { "max-total-count", required_argument, NULL, 0 },
+        { "mmap", no_argument, NULL, 0 },
+        { "mmap-threshold", required_argument, NULL, 0 },
         { "multiline", no_argument, &opts.multiline, TRUE },
         /* "no-" is deprecated. Remove these eventually. */
+        { "no-mmap", no_argument, NULL, 0 },
         { "no-numbers", no_argument, &opts.print_line_numbers, FALSE },
         { "no-recurse", no_argument, NULL, 'n' },
         { "noaffinity", no_argument, &opts.use_thread_affinity, 0 },
@@ -268,6 +387,7 @@ void parse_options(int argc, char **argv, char **base_paths[], char **paths[]) {
         { "nofollow", no_argument, &opts.follow_symlinks, 0 },
         { "nogroup", no_argument, &group, 0 },
         { "noheading", no_argument, &opts.print_path, PATH_PRINT_EACH_LINE },
+        { "nommap", no_argument, NULL, 0 },
         { "nomultiline", no_argument, &opts.multiline, FALSE },
         { "nonumbers", no_argument, &opts.print_line_numbers, FALSE },
         { "nopager", no_argument, NULL, 0 },
@@ -276,25 +396,38 @@ void parse_options(int argc, char **argv, char **base_paths[], char **paths[]) {
         { "numbers", no_argument, &opts.print_line_numbers, 2 },
         { "only-matching", no_argument, NULL, 'o' },
         { "one-device", no_argument, &opts.one_dev, 1 },
+        { "packed", no_argument, NULL, 0 },
+        { "packed-nolines", no_argument, NULL, 0 },
         { "pager", required_argument, NULL, 0 },
         { "parallel", no_argument, &opts.parallel, 1 },
         { "passthrough", no_argument, &opts.passthrough, 1 },
         { "passthru", no_argument, &opts.passthrough, 1 },
         { "path-to-agignore", required_argument, NULL, 'p' },
         { "print0", no_argument, NULL, '0' },
+        { "prefetch", required_argument, NULL, 0 },
+        { "split-size", required_argument, NULL, 0 },
+        { "stream-window", required_argument, NULL, 0 },
         { "print-long-lines", no_argument, &opts.print_long_lines, 1 },
+        { "queries", required_argument, NULL, 0 },
+        { "queries-output", required_argument, NULL, 0 },
+        { "quiet", no_argument, NULL, 'q' },
         { "recurse", no_argument, NULL, 'r' },
+        { "replace", required_argument, NULL, 0 },
         { "search-binary", no_argument, &opts.search_binary_files, 1 },
         { "search-files", no_argument, &opts.search_stream, 0 },
         { "search-zip", no_argument, &opts.search_zip_files, 1 },
         { "silent", no_argument, NULL, 0 },
         { "skip-vcs-ignores", no_argument, NULL, 'U' },
         { "smart-case", no_argument, NULL, 'S' },
+        { "sniff-types", no_argument, &opts.sniff_types, 1 },
         { "stats", no_argument, &opts.stats, 1 },
         { "stats-only", no_argument, NULL, 0 },
+        { "stats-json", required_argument, NULL, 0 },
+        { "trace", required_argument, NULL, 0 },
         { "unrestricted", no_argument, NULL, 'u' },
         { "version", no_argument, &version, 1 },
         { "vimgrep", no_argument, &opts.vimgrep, 1 },
+        { "watch", no_argument, &opts.watch, 1 },
         { "width", required_argument, NULL, 'W' },
         { "word-regexp", no_argument, NULL, 'w' },
         { "workers", required_argument, NULL, 0 },
@@ -315,10 +448,9 @@ void parse_options(int argc, char **argv, char **base_paths[], char **paths[]) {
     longopts[full_len - 1] = (option_t){ NULL, 0, NULL, 0 };
 
     if (argc < 2) {
-        usage();
-        cleanup_ignore(root_ignores);
-        cleanup_options();
-        exit(1);
+        free(ext_index);
+        free(longopts);
+        return PARSE_USAGE;
     }
 
     rv = fstat(fileno(stdin), &statbuf);
@@ -339,13 +471,14 @@ void parse_options(int argc, char **argv, char **base_paths[], char **paths[]) {
         /* Don't search the file that stdout is redirected to */
         rv = fstat(fileno(stdout), &statbuf);
         if (rv != 0) {
-            die("Error fstat()ing stdout");
+            ag_asprintf(error, "Error fstat()ing stdout");
+            result = PARSE_ERROR;
         }
         opts.stdout_inode = statbuf.st_ino;
     }
 
     char *file_search_regex = NULL;
-    while ((ch = getopt_long(argc, argv, "A:aB:C:cDG:g:FfHhiLlm:nop:QRrSsvVtuUwW:z0", longopts, &opt_index)) != -1) {
+    while (result == PARSE_SEARCH && (ch = getopt_long(argc, argv, "A:aB:C:cDG:g:FfHhiLlm:nop:qQRrSsvVtuUwW:z0", longopts, &opt_index)) != -1) {
         switch (ch) {
             case 'A':
                 if (optarg) {
@@ -403,9 +536,9 @@ void parse_options(int argc, char **argv, char **base_paths[], char **paths[]) {
             /* Fall through so regex is built */
             case 'G':
                 if (file_search_regex) {
-                    log_err("File search regex (-g or -G) already specified.");
-                    usage();
-                    exit(1);
+                    ag_asprintf(error, "File search regex (-g or -G) already specified.");
+                    result = PARSE_USAGE;
+                    break;
                 }
                 file_search_regex = ag_strdup(optarg);
                 break;
@@ -437,6 +570,9 @@ void parse_options(int argc, char **argv, char **base_paths[], char **paths[]) {
             case 'o':
                 opts.only_matching = 1;
                 break;
+            case 'q':
+                opts.quiet = 1;
+                break;
             case 'F':
             case 'Q':
                 opts.literal = 1;
@@ -476,7 +612,8 @@ void parse_options(int argc, char **argv, char **base_paths[], char **paths[]) {
             case 'W':
                 opts.width = strtol(optarg, &num_end, 10);
                 if (num_end == optarg || *num_end != '\0' || errno == ERANGE) {
-                    die("Invalid width\n");
+                    ag_asprintf(error, "Invalid width\n");
+                    result = PARSE_ERROR;
                 }
                 break;
             case 'z':
@@ -487,11 +624,91 @@ void parse_options(int argc, char **argv, char **base_paths[], char **paths[]) {
                 break;
             case 0: /* Long option */
                 if (strcmp(longopts[opt_index].name, "ackmate-dir-filter") == 0) {
-                    compile_study(&opts.ackmate_dir_filter, &opts.ackmate_dir_filter_extra, optarg, 0, 0);
+                    if (!compile_study(&opts.ackmate_dir_filter, &opts.ackmate_dir_filter_extra, optarg, 0, 0, error)) {
+                        result = PARSE_ERROR;
+                    }
                     break;
                 } else if (strcmp(longopts[opt_index].name, "depth") == 0) {
                     opts.max_search_depth = atoi(optarg);
                     break;
+                } else if (strcmp(longopts[opt_index].name, "dispatch-order") == 0) {
+                    if (strcmp(optarg, "readdir") == 0) {
+                        opts.dispatch_order = DISPATCH_READDIR;
+                    } else if (strcmp(optarg, "inode") == 0) {
+                        opts.dispatch_order = DISPATCH_INODE;
+                    } else if (strcmp(optarg, "size") == 0) {
+                        opts.dispatch_order = DISPATCH_SIZE;
+                    } else if (strcmp(optarg, "extent") == 0) {
+                        opts.dispatch_order = DISPATCH_EXTENT;
+                    } else {
+                        ag_asprintf(error, "Invalid dispatch order '%s'. Must be readdir, inode, size or extent.\n", optarg);
+                        result = PARSE_ERROR;
+                    }
+                    break;
+                } else if (strcmp(longopts[opt_index].name, "io-uring") == 0) {
+                    if (opts.io_uring_depth == 0) {
+                        opts.io_uring_depth = DEFAULT_IO_URING_DEPTH;
+                    }
+                    break;
+                } else if (strcmp(longopts[opt_index].name, "io-uring-depth") == 0) {
+                    opts.io_uring_depth = strtol(optarg, &num_end, 10);
+                    if (num_end == optarg || *num_end != '\0' || opts.io_uring_depth <= 0 || opts.io_uring_depth > 4096) {
+                        ag_asprintf(error, "Invalid io_uring depth\n");
+                        result = PARSE_ERROR;
+                    }
+                    break;
+                } else if (strcmp(longopts[opt_index].name, "prefetch") == 0) {
+                    long prefetch_len = strtol(optarg, &num_end, 10);
+                    if (num_end == optarg || *num_end != '\0' || prefetch_len < 0 || prefetch_len > MAX_PREFETCH_LEN) {
+                        ag_asprintf(error, "Invalid prefetch count. Must be between 0 and %i\n", MAX_PREFETCH_LEN);
+                        result = PARSE_ERROR;
+                    }
+                    opts.prefetch_len = prefetch_len;
+                    break;
+                } else if (strcmp(longopts[opt_index].name, "split-size") == 0) {
+                    errno = 0;
+                    opts.split_size = strtol(optarg, &num_end, 10);
+                    if (num_end == optarg || *num_end != '\0' || errno == ERANGE || opts.split_size < 0) {
+                        ag_asprintf(error, "Invalid split size\n");
+                        result = PARSE_ERROR;
+                    }
+                    break;
+                } else if (strcmp(longopts[opt_index].name, "stream-window") == 0) {
+                    long stream_window;
+                    errno = 0;
+                    stream_window = strtol(optarg, &num_end, 10);
+                    if (num_end == optarg || *num_end != '\0' || errno == ERANGE || stream_window < 0) {
+                        ag_asprintf(error, "Invalid stream window\n");
+                        result = PARSE_ERROR;
+                    }
+                    opts.stream_window = stream_window;
+                    break;
+                } else if (strcmp(longopts[opt_index].name, "max-total-count") == 0) {
+                    long max_total_matches;
+                    errno = 0;
+                    max_total_matches = strtol(optarg, &num_end, 10);
+                    /* 0 is the default, no limit */
+                    if (num_end == optarg || *num_end != '\0' || errno == ERANGE || max_total_matches < 0) {
+                        ag_asprintf(error, "Invalid max total count\n");
+                        result = PARSE_ERROR;
+                    }
+                    opts.max_total_matches = max_total_matches;
+                    break;
+                } else if (strcmp(longopts[opt_index].name, "mmap") == 0) {
+                    opts.mmap_threshold = 0;
+                    break;
+                } else if (strcmp(longopts[opt_index].name, "mmap-threshold") == 0) {
+                    errno = 0;
+                    opts.mmap_threshold = strtol(optarg, &num_end, 10);
+                    if (num_end == optarg || *num_end != '\0' || errno == ERANGE || opts.mmap_threshold < 0) {
+                        ag_asprintf(error, "Invalid mmap threshold\n");
+                        result = PARSE_ERROR;
+                    }
+                    break;
+                } else if (strcmp(longopts[opt_index].name, "nommap") == 0 ||
+                           strcmp(longopts[opt_index].name, "no-mmap") == 0) {
+                    opts.mmap_threshold = -1;
+                    break;
                 } else if (strcmp(longopts[opt_index].name, "filename") == 0) {
                     opts.print_path = PATH_PRINT_DEFAULT;
                     opts.print_line_numbers = TRUE;
@@ -514,7 +731,12 @@ void parse_options(int argc, char **argv, char **base_paths[], char **paths[]) {
                     opts.pager = optarg;
                     break;
                 } else if (strcmp(longopts[opt_index].name, "workers") == 0) {
-                    opts.workers = atoi(optarg);
+                    if (strcmp(optarg, "auto") == 0) {
+                        opts.workers_auto = TRUE;
+                        opts.workers = 0;
+                    } else {
+                        opts.workers = atoi(optarg);
+                    }
                     break;
                 } else if (strcmp(longopts[opt_index].name, "color-line-number") == 0) {
                     free(opts.color_line_number);
@@ -536,6 +758,30 @@ void parse_options(int argc, char **argv, char **base_paths[], char **paths[]) {
                     opts.print_path = PATH_PRINT_NOTHING;
                     opts.stats = 1;
                     break;
+                } else if (strcmp(longopts[opt_index].name, "stats-json") == 0) {
+                    opts.stats_json = optarg;
+                    break;
+                } else if (strcmp(longopts[opt_index].name, "trace") == 0) {
+                    opts.trace = optarg;
+                    break;
+                } else if (strcmp(longopts[opt_index].name, "queries") == 0) {
+                    opts.queries = optarg;
+                    needs_query = accepts_query = 0;
+                    break;
+                } else if (strcmp(longopts[opt_index].name, "queries-output") == 0) {
+                    opts.queries_output = optarg;
+                    break;
+                } else if (strcmp(longopts[opt_index].name, "replace") == 0) {
+                    opts.replace = optarg;
+                    break;
+                } else if (strcmp(longopts[opt_index].name, "packed") == 0) {
+                    opts.packed = 1;
+                    opts.packed_lines = 1;
+                    break;
+                } else if (strcmp(longopts[opt_index].name, "packed-nolines") == 0) {
+                    opts.packed = 1;
+                    opts.packed_lines = 0;
+                    break;
                 }
 
                 /* Continue to usage if we don't recognize the option */
@@ -554,17 +800,48 @@ void parse_options(int argc, char **argv, char **base_paths[], char **paths[]) {
                     break;
                 }
 
-                log_err("option %s does not take a value", longopts[opt_index].name);
+                ag_asprintf(error, "option %s does not take a value", longopts[opt_index].name);
+                result = PARSE_USAGE;
+                break;
             default:
-                usage();
-                exit(1);
+                /* getopt has said what's wrong, unless it was told not to */
+                if (!opterr) {
+                    if (optopt) {
+                        ag_asprintf(error, "Unknown option or missing argument: -%c", optopt);
+                    } else {
+                        ag_asprintf(error, "Unknown option or missing argument: %s", argv[optind - 1]);
+                    }
+                }
+                result = PARSE_USAGE;
+                break;
         }
     }
 
+    if (result != PARSE_SEARCH) {
+        free(file_search_regex);
+        free(ext_index);
+        free(longopts);
+        return result;
+    }
+
     if (opts.casing == CASE_DEFAULT) {
         opts.casing = CASE_SMART;
     }
 
+#ifndef HAVE_LINUX_FIEMAP_H
+    if (opts.dispatch_order == DISPATCH_EXTENT) {
+        log_err("This build of ag can't get file extents. Using inode order instead.");
+        opts.dispatch_order = DISPATCH_INODE;
+    }
+#endif
+
+#ifndef USE_IO_URING
+    if (opts.io_uring_depth > 0) {
+        log_err("This build of ag doesn't support io_uring. Reading files normally.");
+        opts.io_uring_depth = 0;
+    }
+#endif
+
     if (file_search_regex) {
         int pcre_opts = 0;
         if (opts.casing == CASE_INSENSITIVE || (opts.casing == CASE_SMART && is_lowercase(file_search_regex))) {
@@ -575,71 +852,56 @@ void parse_options(int argc, char **argv, char **base_paths[], char **paths[]) {
             ag_asprintf(&file_search_regex, "\\b%s\\b", file_search_regex);
             free(old_file_search_regex);
         }
-        compile_study(&opts.file_search_regex, &opts.file_search_regex_extra, file_search_regex, pcre_opts, 0);
+        if (!compile_study(&opts.file_search_regex, &opts.file_search_regex_extra, file_search_regex, pcre_opts, 0, error)) {
+            result = PARSE_ERROR;
+        }
         free(file_search_regex);
     }
 
     if (has_filetype) {
-        num_exts = combine_file_extensions(ext_index, lang_num, &extensions);
-        lang_regex = make_lang_regex(extensions, num_exts);
-        compile_study(&opts.file_search_regex, &opts.file_search_regex_extra, lang_regex, 0, 0);
+        opts.lang_exts_len = combine_file_extensions(ext_index, lang_num, &opts.lang_exts);
+        opts.lang_exts_len = sort_file_extensions(opts.lang_exts, opts.lang_exts_len);
+        if (opts.sniff_types) {
+            opts.lang_selected = ag_calloc(lang_count, sizeof(char));
+            for (i = 0; i < lang_num; i++) {
+                opts.lang_selected[ext_index[i]] = TRUE;
+            }
+        }
     }
 
-    if (extensions) {
-        free(extensions);
-    }
     free(ext_index);
-    if (lang_regex) {
-        free(lang_regex);
-    }
     free(longopts);
+    if (result != PARSE_SEARCH) {
+        return result;
+    }
 
     argc -= optind;
     argv += optind;
 
-    if (opts.pager) {
-        out_fd = popen(opts.pager, "w");
-        if (!out_fd) {
-            perror("Failed to run pager");
-            exit(1);
-        }
-    }
-
 #ifdef HAVE_PLEDGE
     if (opts.skip_vcs_ignores) {
         if (pledge("stdio rpath proc", NULL) == -1) {
-            die("pledge: %s", strerror(errno));
+            ag_asprintf(error, "pledge: %s", strerror(errno));
+            return PARSE_ERROR;
         }
     }
 #endif
 
     if (help) {
-        usage();
-        exit(0);
+        return PARSE_HELP;
     }
 
     if (version) {
-        print_version();
-        exit(0);
+        return PARSE_VERSION;
     }
 
     if (list_file_types) {
-        size_t lang_index;
-        printf("The following file types are supported:\n");
-        for (lang_index = 0; lang_index < lang_count; lang_index++) {
-            printf("  --%s\n    ", langs[lang_index].name);
-            int j;
-            for (j = 0; j < MAX_EXTENSIONS && langs[lang_index].extensions[j]; j++) {
-                printf("  .%s", langs[lang_index].extensions[j]);
-            }
-            printf("\n\n");
-        }
-        exit(0);
+        return PARSE_LIST_FILE_TYPES;
     }
 
     if (needs_query && argc == 0) {
-        log_err("What do you want to search for?");
-        exit(1);
+        ag_asprintf(error, "What do you want to search for?");
+        return PARSE_NO_QUERY;
     }
 
     if (home_dir && !opts.search_all_files) {
@@ -683,7 +945,8 @@ void parse_options(int argc, char **argv, char **base_paths[], char **paths[]) {
 
 #ifdef HAVE_PLEDGE
     if (pledge("stdio rpath proc", NULL) == -1) {
-        die("pledge: %s", strerror(errno));
+        ag_asprintf(error, "pledge: %s", strerror(errno));
+        return PARSE_ERROR;
     }
 #endif
 
@@ -707,10 +970,54 @@ void parse_options(int argc, char **argv, char **base_paths[], char **paths[]) {
         opts.print_path = PATH_PRINT_NOTHING;
     }
 
+    if (opts.json) {
+        opts.color = 0;
+    }
+
+    if (opts.replace) {
+        int max_group = replace_max_group(opts.replace);
+        if (max_group < 0) {
+            ag_asprintf(error, "Invalid --replace. Use $N or ${N} for capture group N (up to %d) and $$ for $.", MAX_REPLACE_GROUP);
+            return PARSE_ERROR;
+        }
+        opts.replace_captures = max_group;
+        opts.only_matching = 1;
+        /* Chunks of a split file don't keep their captures */
+        opts.split_size = 0;
+    }
+
+    if (opts.packed) {
+        if (opts.queries) {
+            ag_asprintf(error, "--packed can't be used with --queries");
+            return PARSE_ERROR;
+        }
+        opts.color = 0;
+        opts.json = 0;
+    }
+
     if (opts.parallel) {
         opts.search_stream = 0;
     }
 
+    if (opts.watch) {
+#ifndef HAVE_SYS_INOTIFY_H
+        ag_asprintf(error, "This build of ag can't watch files for changes.");
+        return PARSE_ERROR;
+#endif
+        if (opts.print_filename_only || opts.match_files) {
+            ag_asprintf(error, "--watch can't be used with -c, -g, -l or -L");
+            return PARSE_ERROR;
+        }
+        /* Follow files, not stdin. Workers have to read files themselves to say how much they read. */
+        opts.search_stream = 0;
+        opts.io_uring_depth = 0;
+    }
+
+    if (opts.quiet) {
+        /* One match is enough to decide the exit status */
+        opts.max_total_matches = 1;
+    }
+
     if (!(opts.print_path != PATH_PRINT_DEFAULT || opts.print_break == 0)) {
         if (group) {
             opts.print_break = 1;
@@ -742,56 +1049,23 @@ void parse_options(int argc, char **argv, char **base_paths[], char **paths[]) {
     log_debug("Query is %s", opts.query);
 
     if (opts.query_len == 0) {
-        log_err("Error: No query. What do you want to search for?");
-        exit(1);
+        ag_asprintf(error, "Error: No query. What do you want to search for?");
+        return PARSE_NO_QUERY;
     }
 
     if (!is_regex(opts.query)) {
         opts.literal = 1;
     }
 
-    char *path = NULL;
-#ifdef PATH_MAX
-    char *tmp = NULL;
-#endif
     opts.paths_len = argc;
+    resolve_paths(argc, argv, base_paths, paths);
     if (argc > 0) {
-        *paths = ag_calloc(sizeof(char *), argc + 1);
-        *base_paths = ag_calloc(sizeof(char *), argc + 1);
-        for (i = 0; i < (size_t)argc; i++) {
-            path = ag_strdup(argv[i]);
-            path_len = strlen(path);
-            /* kill trailing slash */
-            if (path_len > 1 && path[path_len - 1] == '/') {
-                path[path_len - 1] = '\0';
-            }
-            (*paths)[i] = path;
-#ifdef PATH_MAX
-            tmp = ag_malloc(PATH_MAX);
-            (*base_paths)[i] = realpath(path, tmp);
-#else
-            (*base_paths)[i] = realpath(path, NULL);
-#endif
-        }
         /* Make sure we search these paths instead of stdin. */
         opts.search_stream = 0;
-    } else {
-        path = ag_strdup(".");
-        *paths = ag_malloc(sizeof(char *) * 2);
-        *base_paths = ag_malloc(sizeof(char *) * 2);
-        (*paths)[0] = path;
-#ifdef PATH_MAX
-        tmp = ag_malloc(PATH_MAX);
-        (*base_paths)[0] = realpath(path, tmp);
-#else
-        (*base_paths)[0] = realpath(path, NULL);
-#endif
-        i = 1;
     }
-    (*paths)[i] = NULL;
-    (*base_paths)[i] = NULL;
 
 #ifdef _WIN32
     windows_use_ansi(opts.color_win_ansi);
 #endif
+    return PARSE_SEARCH;
 }
@@ -6,10 +6,17 @@
 
 #include <pcre.h>
 
+#include "libag.h"
+
 #define DEFAULT_AFTER_LEN 2
 #define DEFAULT_BEFORE_LEN 2
 #define DEFAULT_CONTEXT_LEN 2
 #define DEFAULT_MAX_SEARCH_DEPTH 25
+#define DEFAULT_MMAP_THRESHOLD (1024 * 1024)
+#define DEFAULT_IO_URING_DEPTH 16
+#define MAX_PREFETCH_LEN 256
+#define DEFAULT_SPLIT_SIZE (64 * 1024 * 1024)
+#define DEFAULT_STREAM_WINDOW (64 * 1024)
 enum case_behavior {
     CASE_DEFAULT, /* Changes to CASE_SMART at the end of option parsing */
     CASE_SENSITIVE,
@@ -26,6 +33,13 @@ enum path_print_behavior {
     PATH_PRINT_NOTHING
 };
 
+enum dispatch_order {
+    DISPATCH_READDIR, /* Whatever order readdir() returns */
+    DISPATCH_INODE,
+    DISPATCH_SIZE,  /* Biggest files first */
+    DISPATCH_EXTENT /* Where a file's data starts on disk. Falls back to inode order. */
+};
+
 typedef struct {
     int ackmate;
     pcre *ackmate_dir_filter;
@@ -33,10 +47,15 @@ typedef struct {
     size_t after;
     size_t before;
     enum case_behavior casing;
+    enum dispatch_order dispatch_order;
     const char *file_search_string;
     int match_files;
     pcre *file_search_regex;
     pcre_extra *file_search_regex_extra;
+    char *lang_exts; /* Extensions for --cc, --python, etc. Sorted, SINGLE_EXT_LEN apart */
+    size_t lang_exts_len;
+    int sniff_types;     /* Also search extensionless files whose shebang or modeline says they're one of the types */
+    char *lang_selected; /* Indexed like langs. Set for each type asked for. */
     int color;
     char *color_line_number;
     char *color_match;
@@ -46,15 +65,21 @@ typedef struct {
     int context;
     int follow_symlinks;
     int invert_match;
+    int io_uring_depth; /* Files each worker keeps in flight with io_uring. 0 means don't use io_uring */
+    int json; /* One JSON object per line */
     int literal;
-    int literal_starts_wordchar;
-    int literal_ends_wordchar;
     size_t max_matches_per_file;
+    size_t max_total_matches;
     int max_search_depth;
+    off_t mmap_threshold; /* Smaller files are read() instead of mmap()ed. -1 means never mmap */
     int multiline;
     int one_dev;
     int only_matching;
+    int packed;       /* Binary output. See packed.h. */
+    int packed_lines; /* Whether --packed includes the text of each line */
     char path_sep;
+    off_t split_size; /* Files at least this big are searched by several workers at once. 0 means never */
+    size_t prefetch_len; /* How many queued files to ask the kernel to read ahead */
     char *path_to_agignore;
     int print_break;
     int print_count;
@@ -63,8 +88,9 @@ typedef struct {
     int print_line_numbers;
     int print_long_lines; /* TODO: support this in print.c */
     int passthrough;
-    pcre *re;
-    pcre_extra *re_extra;
+    int quiet;
+    char *replace;        /* --replace template */
+    int replace_captures; /* Capture groups it uses, so how many to keep for each match */
     int recurse_dirs;
     int search_all_files;
     int skip_vcs_ignores;
@@ -72,32 +98,63 @@ typedef struct {
     int search_zip_files;
     int search_hidden_files;
     int search_stream; /* true if tail -F blah | ag */
+    size_t stream_window; /* Most bytes of a stream searched at once, so matches can span lines. 0 means a line at a time */
     int stats;
+    char *stats_json;
+    char *trace;
     size_t stream_line_num; /* This should totally not be in here */
-    int match_found;        /* This should totally not be in here */
+    size_t stream_offset;   /* Nor this */
+    int stream_continues;     /* Or this. More of the stream comes after buf. */
+    size_t stream_match_line; /* Or this. Where the last match printed from the stream was, or 0. */
     ino_t stdout_inode;
     char *query;
     int query_len;
+    char *queries;        /* --queries file. Searched for instead of query. */
+    char *queries_output; /* Directory to write each query's results to */
     char *pager;
     int paths_len;
     int parallel;
     int use_thread_affinity;
     int vimgrep;
+    int watch; /* Keep searching what gets added to the files, like tail -F */
     size_t width;
     int word_regexp;
-    int workers;
+    int workers; /* Set to the number of workers actually started */
+    int workers_auto;
+    ag_result_cb result_cb; /* For libag. If set, results go here instead of being printed. */
+    void *result_baton;
 } cli_options;
 
-/* global options. parse_options gives it sane values, everything else reads from it */
-cli_options opts;
+/* global options. parse_options gives it sane values, everything else reads from it.
+ * Each thread has its own, so searches running at once can have different ones.
+ */
+extern __thread cli_options opts;
 
 typedef struct option option_t;
 
+/* What parse_options() found the arguments to ask for */
+enum parse_result {
+    PARSE_SEARCH,
+    PARSE_HELP,
+    PARSE_VERSION,
+    PARSE_LIST_FILE_TYPES,
+    PARSE_USAGE,    /* The arguments don't make sense. The usage says how they should look. */
+    PARSE_NO_QUERY, /* There's nothing to search for */
+    PARSE_ERROR
+};
+
 void usage(void);
 void print_version(void);
+void print_file_types(void);
 
 void init_options(void);
-void parse_options(int argc, char **argv, char **base_paths[], char **paths[]);
+void resolve_paths(const int argc, char *const argv[], char **base_paths[], char **paths[]);
+/* Anything but PARSE_SEARCH, PARSE_HELP, PARSE_VERSION and
+ * PARSE_LIST_FILE_TYPES sets error (which the caller frees), except that
+ * PARSE_USAGE leaves it NULL if getopt has already said what's wrong. Call
+ * cleanup_options() either way.
+ */
+enum parse_result parse_options(int argc, char **argv, char **base_paths[], char **paths[], char **error);
 void cleanup_options(void);
 
 #endif
@@ -0,0 +1,111 @@
+#include <string.h>
+
+#include "packed.h"
+
+int packed_read_varint(const unsigned char **pos, const unsigned char *end, uint64_t *value) {
+    const unsigned char *p = *pos;
+    uint64_t n = 0;
+    unsigned int shift = 0;
+
+    if (p == end) {
+        return 0;
+    }
+    for (; p < end; p++, shift += 7) {
+        if (shift > 63 || (shift == 63 && (*p & 0x7e))) {
+            return -1; /* Doesn't fit in 64 bits */
+        }
+        n |= (uint64_t)(*p & 0x7f) << shift;
+        if (!(*p & 0x80)) {
+            *pos = p + 1;
+            *value = n;
+            return 1;
+        }
+    }
+    return -1;
+}
+
+int packed_read_header(const unsigned char **pos, const unsigned char *end, int *flags) {
+    const unsigned char *p = *pos;
+
+    if (p == end) {
+        return 0;
+    }
+    if ((size_t)(end - p) < PACKED_HEADER_LEN || memcmp(p, PACKED_MAGIC, PACKED_MAGIC_LEN) != 0 ||
+        p[PACKED_MAGIC_LEN] != PACKED_VERSION) {
+        return -1;
+    }
+    *flags = p[PACKED_MAGIC_LEN + 1];
+    *pos = p + PACKED_HEADER_LEN;
+    return 1;
+}
+
+int packed_next_record(const unsigned char **pos, const unsigned char *end, packed_record_t *rec) {
+    const unsigned char *p = *pos;
+    uint64_t len;
+
+    if (p == end) {
+        return 0;
+    }
+    rec->type = *p++;
+    if (packed_read_varint(&p, end, &len) != 1 || len > (uint64_t)(end - p)) {
+        return -1;
+    }
+    rec->data = p;
+    rec->len = (size_t)len;
+    *pos = p + len;
+    return 1;
+}
+
+int packed_read_lines(const packed_record_t *rec, const int flags, packed_lines_t *lines) {
+    const unsigned char *p = rec->data;
+    const unsigned char *end = rec->data + rec->len;
+    uint64_t n;
+    uint64_t i;
+
+    if (rec->type != PACKED_MATCH && rec->type != PACKED_CONTEXT) {
+        return -1;
+    }
+    if (packed_read_varint(&p, end, &lines->path_id) != 1 ||
+        packed_read_varint(&p, end, &lines->line_number) != 1 ||
+        packed_read_varint(&p, end, &lines->offset) != 1) {
+        return -1;
+    }
+    lines->submatches_len = 0;
+    if (rec->type == PACKED_MATCH && packed_read_varint(&p, end, &lines->submatches_len) != 1) {
+        return -1;
+    }
+    lines->pos = p;
+    lines->submatches_left = lines->submatches_len;
+    /* Skip to the line */
+    for (i = 0; i < lines->submatches_len * 2; i++) {
+        if (packed_read_varint(&p, end, &n) != 1) {
+            return -1;
+        }
+    }
+    lines->end = p;
+    if (flags & PACKED_FLAG_LINES) {
+        lines->line = p;
+        lines->line_len = end - p;
+    } else if (p != end) {
+        return -1;
+    } else {
+        lines->line = NULL;
+        lines->line_len = 0;
+    }
+    return 1;
+}
+
+int packed_next_submatch(packed_lines_t *lines, uint64_t *start, uint64_t *end) {
+    uint64_t len;
+
+    if (lines->submatches_left == 0) {
+        return 0;
+    }
+    if (packed_read_varint(&lines->pos, lines->end, start) != 1 ||
+        packed_read_varint(&lines->pos, lines->end, &len) != 1) {
+        return -1;
+    }
+    lines->submatches_left--;
+    *end = *start + len;
+    return 1;
+}
@@ -0,0 +1,92 @@
+#ifndef PACKED_H
+#define PACKED_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Reading ag --packed output.
+ *
+ * The stream starts with "AGPK", a version byte and a flags byte. Records
+ * follow: a type byte, the length of the rest of the record as a varint, and
+ * then the fields below. Numbers are unsigned LEB128 varints: 7 bits per
+ * byte, low bits first, the high bit set on every byte but the last.
+ *
+ *   PATH     id, path (the rest of the record). Comes before any record
+ *            that uses the id. Each path is only sent once.
+ *   MATCH    path id, line number, offset of the line in the file, number
+ *            of submatches, then for each submatch its start and length from
+ *            the start of the line, then the lines the matches are on if
+ *            PACKED_FLAG_LINES is set.
+ *   CONTEXT  path id, line number, offset, then the line if
+ *            PACKED_FLAG_LINES is set.
+ *   END      path id, number of matches, file size, PACKED_END_* flags.
+ *   FILE     path id, number of matches. For -l, -c and -g.
+ *
+ * Lines never include their newline. Records of types that aren't listed
+ * here should be skipped, so that new ones can be added.
+ *
+ *   const unsigned char *pos = buf, *end = buf + len;
+ *   packed_record_t rec;
+ *   packed_read_header(&pos, end, &flags);
+ *   while (packed_next_record(&pos, end, &rec) == 1) {
+ *       if (rec.type == PACKED_MATCH) {
+ *           packed_read_lines(&rec, flags, &lines);
+ *           while (packed_next_submatch(&lines, &start, &sub_end) == 1) { ... }
+ *       }
+ *   }
+ *
+ * This file and packed.c only need the C standard library, so they can be
+ * copied into other programs.
+ */
+
+#define PACKED_MAGIC "AGPK"
+#define PACKED_MAGIC_LEN 4
+#define PACKED_VERSION 1
+#define PACKED_HEADER_LEN (PACKED_MAGIC_LEN + 2)
+
+#define PACKED_FLAG_LINES 1
+
+#define PACKED_END_BINARY 1
+
+enum {
+    PACKED_PATH = 1,
+    PACKED_MATCH,
+    PACKED_CONTEXT,
+    PACKED_END,
+    PACKED_FILE
+};
+
+typedef struct {
+    int type;
+    const unsigned char *data; /* The record's fields */
+    size_t len;
+} packed_record_t;
+
+/* A MATCH or CONTEXT record */
+typedef struct {
+    uint64_t path_id;
+    uint64_t line_number;
+    uint64_t offset;
+    uint64_t submatches_len; /* 0 for CONTEXT */
+    const unsigned char *line; /* NULL without PACKED_FLAG_LINES */
+    size_t line_len;
+    /* For packed_next_submatch() */
+    const unsigned char *pos;
+    const unsigned char *end;
+    uint64_t submatches_left;
+} packed_lines_t;
+
+/* The functions below return 1 on success, 0 at the end of the input, and
+ * -1 if the input is cut short or isn't valid. They advance *pos past what
+ * they read.
+ */
+int packed_read_varint(const unsigned char **pos, const unsigned char *end, uint64_t *value);
+/* Sets *flags to the header's PACKED_FLAG_* bits. Fails on other versions. */
+int packed_read_header(const unsigned char **pos, const unsigned char *end, int *flags);
+/* rec points into the input, so it's only valid as long as that is */
+int packed_next_record(const unsigned char **pos, const unsigned char *end, packed_record_t *rec);
+int packed_read_lines(const packed_record_t *rec, const int flags, packed_lines_t *lines);
+/* Submatch offsets are from lines->line, and end after start */
+int packed_next_submatch(packed_lines_t *lines, uint64_t *start, uint64_t *end);
+
+#endif
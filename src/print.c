@@ -1,3 +1,4 @@
+#include <ctype.h>
 #include <limits.h>
 #include <stdarg.h>
 #include <stdio.h>
@@ -7,18 +8,21 @@
 #include "ignore.h"
 #include "log.h"
 #include "options.h"
+#include "packed.h"
 #include "print.h"
+#include "search.h"
 #include "util.h"
+#include "uthash.h"
 #ifdef _WIN32
 #define fprintf(...) fprintf_w32(__VA_ARGS__)
 #endif
 
-int first_file_match = 1;
-
 const char *color_reset = "\033[0m\033[K";
 
 const char *truncate_marker = " [...]";
 
+#define NO_LINE ((size_t)-1)
+
 void print_path(const char *path, const char sep) {
     if (opts.print_path == PATH_PRINT_NOTHING && !opts.vimgrep) {
         return;
@@ -66,7 +70,6 @@ void print_binary_file_matches(const char *path) {
 
 void print_file_matches(const char *path, const char *buf, const size_t buf_len, const match_t matches[], const size_t matches_len) {
     size_t line = 1;
-    char **context_prev_lines = NULL;
     size_t prev_line = 0;
     size_t last_prev_line = 0;
     size_t prev_line_offset = 0;
@@ -74,10 +77,13 @@ void print_file_matches(const char *path, const char *buf, const size_t buf_len,
     size_t lines_since_last_match = INT_MAX;
     ssize_t lines_to_print = 0;
     size_t last_printed_match = 0;
+    size_t match_line = 0;
     char sep = '-';
     size_t i, j;
     int in_a_match = FALSE;
     int printing_a_match = FALSE;
+    /* Start and end offsets of the lines before the current one, for printing context */
+    match_t *context_prev_lines;
 
     if (opts.ackmate || opts.vimgrep) {
         sep = ':';
@@ -99,13 +105,51 @@ void print_file_matches(const char *path, const char *buf, const size_t buf_len,
         }
     }
 
-    context_prev_lines = ag_calloc(sizeof(char *), (opts.before + 1));
+    if (opts.stream_match_line) {
+        /* Pick up the context from where the last piece of the stream left off */
+        lines_since_last_match = opts.stream_line_num - opts.stream_match_line;
+    }
+
+    if (cur_search->context_prev_lines_size < opts.before + 1) {
+        cur_search->context_prev_lines_size = opts.before + 1;
+        cur_search->context_prev_lines = ag_realloc(cur_search->context_prev_lines,
+                                                    cur_search->context_prev_lines_size * sizeof(match_t));
+    }
+    context_prev_lines = cur_search->context_prev_lines;
+    for (i = 0; i < opts.before; i++) {
+        context_prev_lines[i].start = NO_LINE;
+    }
 
     for (i = 0; i <= buf_len && (cur_match < matches_len || lines_since_last_match <= opts.after); i++) {
+        if (i == buf_len && opts.stream_continues && buf_len > 0 && buf[buf_len - 1] == '\n') {
+            /* The next line is in the next piece of the stream */
+            break;
+        }
+        if (i == prev_line_offset && !in_a_match && cur_match < matches_len &&
+            lines_since_last_match > opts.after && matches[cur_match].start > i) {
+            /* Nothing gets printed until the context before the next match.
+             * Skip there with memchr() instead of looking at every byte.
+             * Huge files with few matches spend most of their time here.
+             */
+            size_t lines_to_skip = count_lines(buf + i, matches[cur_match].start - i);
+            if (lines_to_skip > opts.before) {
+                lines_to_skip -= opts.before;
+                line += lines_to_skip;
+                if (lines_since_last_match < INT_MAX) {
+                    lines_since_last_match += lines_to_skip;
+                }
+                for (; lines_to_skip > 0; lines_to_skip--) {
+                    i = (const char *)memchr(buf + i, '\n', buf_len - i) - buf + 1;
+                }
+                prev_line_offset = i;
+            }
+        }
+
         if (cur_match < matches_len && i == matches[cur_match].start) {
             in_a_match = TRUE;
             /* We found the start of a match */
-            if (cur_match > 0 && opts.context && lines_since_last_match > (opts.before + opts.after + 1)) {
+            if ((cur_match > 0 || opts.stream_match_line) && opts.context &&
+                lines_since_last_match > (opts.before + opts.after + 1)) {
                 fprintf(out_fd, "--\n");
             }
 
@@ -121,12 +165,14 @@ void print_file_matches(const char *path, const char *buf, const size_t buf_len,
 
                 for (j = (opts.before - lines_to_print); j < opts.before; j++) {
                     prev_line = (last_prev_line + j) % opts.before;
-                    if (context_prev_lines[prev_line] != NULL) {
+                    if (context_prev_lines[prev_line].start != NO_LINE) {
                         if (opts.print_path == PATH_PRINT_EACH_LINE) {
                             print_path(path, ':');
                         }
                         print_line_number(line - (opts.before - j), sep);
-                        fprintf(out_fd, "%s\n", context_prev_lines[prev_line]);
+                        fwrite(buf + context_prev_lines[prev_line].start, 1,
+                               context_prev_lines[prev_line].end - context_prev_lines[prev_line].start, out_fd);
+                        fputc('\n', out_fd);
                     }
                 }
             }
@@ -141,16 +187,15 @@ void print_file_matches(const char *path, const char *buf, const size_t buf_len,
 
         /* We found the end of a line. */
         if ((i == buf_len || buf[i] == '\n') && opts.before > 0) {
-            if (context_prev_lines[last_prev_line] != NULL) {
-                free(context_prev_lines[last_prev_line]);
-            }
-            /* We don't want to strcpy the \n */
-            context_prev_lines[last_prev_line] = ag_strndup(&buf[prev_line_offset], i - prev_line_offset);
+            /* We don't want to print the \n */
+            context_prev_lines[last_prev_line].start = prev_line_offset;
+            context_prev_lines[last_prev_line].end = i;
             last_prev_line = (last_prev_line + 1) % opts.before;
         }
 
         if (i == buf_len || buf[i] == '\n') {
             if (lines_since_last_match == 0) {
+                match_line = line;
                 if (opts.print_path == PATH_PRINT_EACH_LINE && !opts.search_stream) {
                     print_path(path, ':');
                 }
@@ -266,20 +311,563 @@ void print_file_matches(const char *path, const char *buf, const size_t buf_len,
         }
     }
 
-    for (i = 0; i < opts.before; i++) {
-        if (context_prev_lines[i] != NULL) {
-            free(context_prev_lines[i]);
+    if (opts.stream_continues && match_line) {
+        opts.stream_match_line = match_line + opts.stream_line_num - 1;
+    }
+}
+
+/* If s starts with a --replace reference ($N, ${N} or $$), how long it is.
+ * *group is N, or -1 for $$. Returns 0 if s isn't a valid reference.
+ */
+static size_t replace_ref(const char *s, int *group) {
+    const char *p = s + 1;
+    int braces;
+
+    if (*p == '$') {
+        *group = -1;
+        return 2;
+    }
+    braces = *p == '{';
+    p += braces;
+    if (!isdigit((unsigned char)*p)) {
+        return 0;
+    }
+    for (*group = 0; isdigit((unsigned char)*p); p++) {
+        *group = *group * 10 + (*p - '0');
+        if (*group > MAX_REPLACE_GROUP) {
+            return 0;
+        }
+    }
+    if (braces) {
+        if (*p != '}') {
+            return 0;
+        }
+        p++;
+    }
+    return p - s;
+}
+
+/* The highest capture group a --replace template uses, or -1 if it isn't valid */
+int replace_max_group(const char *replace) {
+    const char *p = replace;
+    int max_group = 0;
+    int group;
+    size_t ref_len;
+
+    while ((p = strchr(p, '$')) != NULL) {
+        ref_len = replace_ref(p, &group);
+        if (ref_len == 0) {
+            return -1;
+        }
+        if (group > max_group) {
+            max_group = group;
+        }
+        p += ref_len;
+    }
+    return max_group;
+}
+
+/* Print opts.replace for match, filling in its capture groups. Groups that
+ * didn't take part in the match, or aren't in captures, are empty.
+ */
+static void print_replacement(const char *buf, const match_t *match, const match_t captures[], const size_t captures_len) {
+    const char *p = opts.replace;
+    const char *dollar;
+    const match_t *span;
+    int group;
+    size_t ref_len;
+
+    while ((dollar = strchr(p, '$')) != NULL) {
+        fwrite(p, 1, dollar - p, out_fd);
+        ref_len = replace_ref(dollar, &group);
+        if (group == -1) {
+            fputc('$', out_fd);
+        } else {
+            span = group == 0 ? match : (captures && (size_t)group <= captures_len ? &captures[group - 1] : NULL);
+            if (span) {
+                fwrite(buf + span->start, 1, span->end - span->start, out_fd);
+            }
+        }
+        p = dollar + ref_len;
+    }
+    fputs(p, out_fd);
+}
+
+/* --replace: like -o, but each match is printed as opts.replace. captures
+ * holds captures_len groups (starting at group 1) for each match, or is NULL.
+ */
+void print_file_replacements(const char *path, const char *buf, const size_t buf_len, const match_t matches[], const size_t matches_len,
+                             const match_t captures[], const size_t captures_len) {
+    size_t line = 1;
+    size_t line_start = 0;
+    size_t i;
+    const char *nl;
+
+    print_file_separator();
+
+    if (opts.print_path == PATH_PRINT_DEFAULT) {
+        opts.print_path = PATH_PRINT_TOP;
+    } else if (opts.print_path == PATH_PRINT_DEFAULT_EACH_LINE) {
+        opts.print_path = PATH_PRINT_EACH_LINE;
+    }
+    if (opts.print_path == PATH_PRINT_TOP) {
+        print_path(path, opts.path_sep);
+    }
+
+    for (i = 0; i < matches_len && matches[i].start <= buf_len; i++) {
+        while ((nl = memchr(buf + line_start, '\n', matches[i].start - line_start)) != NULL) {
+            line_start = nl - buf + 1;
+            line++;
+        }
+        if (opts.vimgrep) {
+            print_path(path, ':');
+            fprintf(out_fd, "%lu:", (unsigned long)line);
+            print_column_number(matches, i, line_start, ':');
+        } else {
+            if (opts.print_path == PATH_PRINT_EACH_LINE) {
+                print_path(path, ':');
+            }
+            print_line_number(line, ':');
+            if (opts.column) {
+                print_column_number(matches, i, line_start, ':');
+            }
         }
+        if (opts.color) {
+            fputs(opts.color_match, out_fd);
+        }
+        print_replacement(buf, &matches[i], captures ? captures + i * captures_len : NULL, captures_len);
+        if (opts.color) {
+            fputs(color_reset, out_fd);
+        }
+        fputc('\n', out_fd);
+    }
+}
+
+/* libag: give results to opts.result_cb instead of printing them. These run
+ * with print_mtx held, like the rest of printing.
+ */
+void callback_path(const char *path, const size_t matches_len) {
+    ag_result_t result;
+
+    memset(&result, 0, sizeof(result));
+    result.path = normalize_path(path);
+    result.matches = matches_len;
+    opts.result_cb(&result, opts.result_baton);
+}
+
+static void callback_line(ag_result_t *result, const char *buf, const size_t buf_len, const size_t line_start,
+                          const size_t match_start, const size_t match_end) {
+    const char *line_end = memchr(buf + line_start, '\n', buf_len - line_start);
+
+    result->line = buf + line_start;
+    result->line_len = (line_end ? (size_t)(line_end - buf) : buf_len) - line_start;
+    result->match_start = match_start - line_start;
+    result->match_end = match_end - line_start;
+    opts.result_cb(result, opts.result_baton);
+}
+
+void callback_file_matches(const char *path, const char *buf, const size_t buf_len, const match_t matches[], const size_t matches_len) {
+    ag_result_t result;
+    size_t line_start = 0;
+    const char *nl;
+    size_t i;
+
+    memset(&result, 0, sizeof(result));
+    result.path = normalize_path(path);
+    result.line_number = 1;
+    result.matches = 1;
+    for (i = 0; i < matches_len; i++) {
+        /* Matches are in order, so only the lines since the last one need counting */
+        while (line_start < matches[i].start &&
+               (nl = memchr(buf + line_start, '\n', matches[i].start - line_start)) != NULL) {
+            line_start = nl - buf + 1;
+            result.line_number++;
+        }
+        if (!opts.invert_match) {
+            callback_line(&result, buf, buf_len, line_start, matches[i].start, matches[i].end);
+            continue;
+        }
+        /* Inverted matches are runs of whole lines. Each line is a result. */
+        while (line_start < matches[i].end && line_start < buf_len) {
+            nl = memchr(buf + line_start, '\n', buf_len - line_start);
+            callback_line(&result, buf, buf_len, line_start, line_start, nl ? (size_t)(nl - buf) : buf_len);
+            if (nl == NULL) {
+                break;
+            }
+            line_start = nl - buf + 1;
+            result.line_number++;
+        }
+    }
+}
+
+/* --json and --packed: records for each file, match and context line. Both
+ * formats walk the matches the same way, and differ only in how they write
+ * each record.
+ */
+typedef struct {
+    const char *path; /* Normalized */
+    const char *tag;  /* --queries name, or NULL */
+    size_t path_id;   /* --packed */
+    const char *buf;
+    size_t offset; /* Where buf starts in the file or stream */
+} record_file_t;
+
+typedef struct {
+    void (*begin)(strbuf_t *out, const record_file_t *file);
+    /* Lines buf[start, end). Submatches are offsets from base. */
+    void (*match)(strbuf_t *out, const record_file_t *file, const size_t start, const size_t end, const size_t line,
+                  const match_t submatches[], const size_t submatches_len, const size_t base);
+    void (*context)(strbuf_t *out, const record_file_t *file, const size_t start, const size_t end, const size_t line);
+    void (*end)(strbuf_t *out, const record_file_t *file, const size_t matches_len, const size_t bytes, const int binary);
+    /* -l, -c and -g */
+    void (*path)(strbuf_t *out, const record_file_t *file, const size_t matches_len);
+} record_format_t;
+
+/* --json: one JSON object per line. These only format into a buffer, so
+ * workers can do it before taking print_mtx.
+ */
+
+/* "name":"s", or "name_base64":"..." if s isn't UTF-8 */
+static void json_field(strbuf_t *out, const char *name, const char *s, const size_t len) {
+    size_t field_start = out->len;
+
+    strbuf_append(out, "\"", 1);
+    strbuf_append(out, name, strlen(name));
+    strbuf_append(out, "\":", 2);
+    if (!strbuf_append_json(out, s, len)) {
+        out->len = field_start;
+        strbuf_append(out, "\"", 1);
+        strbuf_append(out, name, strlen(name));
+        strbuf_append(out, "_base64\":", 9);
+        strbuf_append_base64(out, s, len);
+    }
+}
+
+static void json_record_start(strbuf_t *out, const char *type, const record_file_t *file) {
+    strbuf_append(out, "{\"type\":\"", 9);
+    strbuf_append(out, type, strlen(type));
+    strbuf_append(out, "\",", 2);
+    if (file->tag) {
+        strbuf_append(out, "\"query\":", 8);
+        strbuf_append_json(out, file->tag, strlen(file->tag));
+        strbuf_append(out, ",", 1);
+    }
+    json_field(out, "path", file->path, strlen(file->path));
+}
+
+/* The start of a "match" or "context" record for the lines in buf[start, end) */
+static void json_lines(strbuf_t *out, const char *type, const record_file_t *file,
+                       const size_t start, const size_t end, const size_t line) {
+    json_record_start(out, type, file);
+    strbuf_append(out, ",\"line_number\":", 15);
+    strbuf_append_num(out, line);
+    strbuf_append(out, ",\"offset\":", 10);
+    strbuf_append_num(out, file->offset + start);
+    strbuf_append(out, ",", 1);
+    json_field(out, "lines", file->buf + start, end - start);
+}
+
+static void json_begin(strbuf_t *out, const record_file_t *file) {
+    json_record_start(out, "begin", file);
+    strbuf_append(out, "}\n", 2);
+}
+
+static void json_match(strbuf_t *out, const record_file_t *file, const size_t start, const size_t end, const size_t line,
+                       const match_t submatches[], const size_t submatches_len, const size_t base) {
+    size_t i;
+
+    json_lines(out, "match", file, start, end, line);
+    strbuf_append(out, ",\"submatches\":[", 15);
+    for (i = 0; i < submatches_len; i++) {
+        strbuf_append(out, i == 0 ? "{\"start\":" : ",{\"start\":", i == 0 ? 9 : 10);
+        strbuf_append_num(out, submatches[i].start - base);
+        strbuf_append(out, ",\"end\":", 7);
+        strbuf_append_num(out, submatches[i].end - base);
+        strbuf_append(out, "}", 1);
+    }
+    strbuf_append(out, "]}\n", 3);
+}
+
+static void json_context(strbuf_t *out, const record_file_t *file, const size_t start, const size_t end, const size_t line) {
+    json_lines(out, "context", file, start, end, line);
+    strbuf_append(out, "}\n", 2);
+}
+
+static void json_end(strbuf_t *out, const record_file_t *file, const size_t matches_len, const size_t bytes, const int binary) {
+    json_record_start(out, "end", file);
+    strbuf_append(out, ",\"matches\":", 11);
+    strbuf_append_num(out, matches_len);
+    if (binary) {
+        strbuf_append(out, ",\"binary\":true}\n", 16);
+    } else {
+        strbuf_append(out, ",\"bytes\":", 9);
+        strbuf_append_num(out, bytes);
+        strbuf_append(out, "}\n", 2);
+    }
+}
+
+static void json_path(strbuf_t *out, const record_file_t *file, const size_t matches_len) {
+    json_record_start(out, "file", file);
+    strbuf_append(out, ",\"matches\":", 11);
+    strbuf_append_num(out, matches_len);
+    strbuf_append(out, "}\n", 2);
+}
+
+static const record_format_t json_format = { json_begin, json_match, json_context, json_end, json_path };
+
+/* --packed: see packed.h. Paths are numbered in the order they're first
+ * printed, so these must run with print_mtx held.
+ */
+typedef struct {
+    char *path;
+    size_t id;
+    UT_hash_handle hh;
+} packed_path_t;
+
+static packed_path_t *packed_paths = NULL;
+static size_t packed_paths_len = 0;
+
+static void packed_record_start(strbuf_t *out, const int type, const size_t len) {
+    strbuf_grow(out, 1);
+    out->data[out->len++] = (char)type;
+    strbuf_append_varint(out, len);
+}
+
+/* Find the path's id, sending a PATH record first if it's new */
+static size_t packed_path_id(strbuf_t *out, const char *path) {
+    packed_path_t *p;
+    size_t path_len = strlen(path);
+
+    HASH_FIND(hh, packed_paths, path, path_len, p);
+    if (p == NULL) {
+        p = ag_malloc(sizeof(packed_path_t));
+        p->path = ag_strndup(path, path_len);
+        p->id = packed_paths_len++;
+        HASH_ADD_KEYPTR(hh, packed_paths, p->path, path_len, p);
+        packed_record_start(out, PACKED_PATH, varint_len(p->id) + path_len);
+        strbuf_append_varint(out, p->id);
+        strbuf_append(out, path, path_len);
+    }
+    return p->id;
+}
+
+static void packed_match(strbuf_t *out, const record_file_t *file, const size_t start, const size_t end, const size_t line,
+                         const match_t submatches[], const size_t submatches_len, const size_t base) {
+    size_t len = varint_len(file->path_id) + varint_len(line) + varint_len(file->offset + start) + varint_len(submatches_len);
+    size_t i;
+
+    for (i = 0; i < submatches_len; i++) {
+        len += varint_len(submatches[i].start - base) + varint_len(submatches[i].end - submatches[i].start);
+    }
+    if (opts.packed_lines) {
+        len += end - start;
+    }
+    packed_record_start(out, PACKED_MATCH, len);
+    strbuf_append_varint(out, file->path_id);
+    strbuf_append_varint(out, line);
+    strbuf_append_varint(out, file->offset + start);
+    strbuf_append_varint(out, submatches_len);
+    for (i = 0; i < submatches_len; i++) {
+        strbuf_append_varint(out, submatches[i].start - base);
+        strbuf_append_varint(out, submatches[i].end - submatches[i].start);
+    }
+    if (opts.packed_lines) {
+        strbuf_append(out, file->buf + start, end - start);
+    }
+}
+
+static void packed_context(strbuf_t *out, const record_file_t *file, const size_t start, const size_t end, const size_t line) {
+    size_t lines_len = opts.packed_lines ? end - start : 0;
+
+    packed_record_start(out, PACKED_CONTEXT, varint_len(file->path_id) + varint_len(line) + varint_len(file->offset + start) + lines_len);
+    strbuf_append_varint(out, file->path_id);
+    strbuf_append_varint(out, line);
+    strbuf_append_varint(out, file->offset + start);
+    strbuf_append(out, file->buf + start, lines_len);
+}
+
+static void packed_end(strbuf_t *out, const record_file_t *file, const size_t matches_len, const size_t bytes, const int binary) {
+    packed_record_start(out, PACKED_END, varint_len(file->path_id) + varint_len(matches_len) + varint_len(bytes) + 1);
+    strbuf_append_varint(out, file->path_id);
+    strbuf_append_varint(out, matches_len);
+    strbuf_append_varint(out, bytes);
+    strbuf_append_varint(out, binary ? PACKED_END_BINARY : 0);
+}
+
+static void packed_path(strbuf_t *out, const record_file_t *file, const size_t matches_len) {
+    packed_record_start(out, PACKED_FILE, varint_len(file->path_id) + varint_len(matches_len));
+    strbuf_append_varint(out, file->path_id);
+    strbuf_append_varint(out, matches_len);
+}
+
+static const record_format_t packed_format = { NULL, packed_match, packed_context, packed_end, packed_path };
+
+void print_packed_header(void) {
+    char header[PACKED_HEADER_LEN];
+
+    memcpy(header, PACKED_MAGIC, PACKED_MAGIC_LEN);
+    header[PACKED_MAGIC_LEN] = PACKED_VERSION;
+    header[PACKED_MAGIC_LEN + 1] = opts.packed_lines ? PACKED_FLAG_LINES : 0;
+    fwrite(header, 1, sizeof(header), out_fd);
+}
+
+void print_packed_cleanup(void) {
+    packed_path_t *p;
+    packed_path_t *tmp;
+
+    HASH_ITER(hh, packed_paths, p, tmp) {
+        HASH_DEL(packed_paths, p);
+        free(p->path);
+        free(p);
+    }
+    packed_paths_len = 0;
+}
+
+static const record_format_t *record_file_init(record_file_t *file, strbuf_t *out, const char *path, const char *tag,
+                                               const char *buf) {
+    file->path = normalize_path(path);
+    file->tag = tag;
+    file->buf = buf;
+    file->offset = opts.stream_line_num ? opts.stream_offset : 0;
+    if (opts.packed) {
+        file->path_id = packed_path_id(out, file->path);
+        return &packed_format;
+    }
+    file->path_id = 0;
+    return &json_format;
+}
+
+/* Where the line with buf[pos] on it ends: its newline, or buf_len */
+static size_t record_line_end(const char *buf, const size_t buf_len, const size_t pos) {
+    const char *nl = pos < buf_len ? memchr(buf + pos, '\n', buf_len - pos) : NULL;
+    return nl ? (size_t)(nl - buf) : buf_len;
+}
+
+void print_records_path(strbuf_t *out, const char *path, const char *tag, const size_t matches_len) {
+    record_file_t file;
+    const record_format_t *format = record_file_init(&file, out, path, tag, NULL);
+
+    format->path(out, &file, matches_len);
+}
+
+void print_records_binary_file_matches(strbuf_t *out, const char *path, const char *tag, const size_t matches_len) {
+    record_file_t file;
+    const record_format_t *format = record_file_init(&file, out, path, tag, NULL);
+
+    if (format->begin) {
+        format->begin(out, &file);
+    }
+    format->end(out, &file, matches_len, 0, TRUE);
+}
+
+/* Like print_file_matches(), but as begin, context, match and end records.
+ * A match record holds every line that its matches are on, and their
+ * submatches are byte offsets into those lines. If invert is set, matches
+ * are runs of lines that didn't match, and each line gets a record and
+ * counts as a match.
+ */
+void print_records_file_matches(strbuf_t *out, const char *path, const char *tag, const char *buf, const size_t buf_len,
+                                const match_t matches[], const size_t matches_len, const int invert) {
+    size_t line = opts.stream_line_num ? opts.stream_line_num : 1;
+    size_t pos = 0;     /* Start of line number line */
+    size_t printed = 0; /* Lines before this have been printed */
+    size_t rec_end;
+    size_t start;
+    size_t end;
+    size_t before;
+    size_t i = 0;
+    size_t j;
+    size_t inverted_lines = 0;
+    size_t match_line = 0;
+    const char *nl;
+    match_t whole_line;
+    record_file_t file;
+    const record_format_t *format = record_file_init(&file, out, path, tag, buf);
+
+    if (!opts.stream_line_num && format->begin) {
+        format->begin(out, &file);
+    }
+
+    while (i < matches_len) {
+        /* Move to the line the match starts on */
+        while ((nl = memchr(buf + pos, '\n', matches[i].start - pos)) != NULL) {
+            pos = nl - buf + 1;
+            line++;
+        }
+
+        /* Context before, but not lines that were printed already */
+        start = pos;
+        for (before = 0; before < opts.before && start > printed; before++) {
+            for (start--; start > printed && buf[start - 1] != '\n'; start--) {
+            }
+        }
+        for (; before > 0; before--) {
+            end = record_line_end(buf, buf_len, start);
+            format->context(out, &file, start, end, line - before);
+            start = end + 1;
+        }
+
+        /* Matches that start on the lines this one covers go in the same record */
+        j = i;
+        rec_end = record_line_end(buf, buf_len, matches[i].end > matches[i].start ? matches[i].end - 1 : matches[i].start);
+        while (j + 1 < matches_len && matches[j + 1].start <= rec_end) {
+            j++;
+            end = record_line_end(buf, buf_len, matches[j].end > matches[j].start ? matches[j].end - 1 : matches[j].start);
+            if (end > rec_end) {
+                rec_end = end;
+            }
+        }
+
+        if (invert) {
+            for (start = pos; start <= rec_end && start < buf_len; start = end + 1) {
+                end = record_line_end(buf, buf_len, start);
+                whole_line.start = start;
+                whole_line.end = end;
+                format->match(out, &file, start, end, line++, &whole_line, 1, start);
+                inverted_lines++;
+            }
+            line--;
+        } else {
+            format->match(out, &file, pos, rec_end, line, matches + i, j - i + 1, pos);
+            while ((nl = memchr(buf + pos, '\n', rec_end - pos)) != NULL) {
+                pos = nl - buf + 1;
+                line++;
+            }
+        }
+        match_line = line;
+        i = j + 1;
+        pos = rec_end + 1;
+        line++;
+        printed = pos;
+
+        /* Context after, up to the line the next match is on */
+        for (j = 0; j < opts.after && pos < buf_len; j++) {
+            end = record_line_end(buf, buf_len, pos);
+            if (i < matches_len && matches[i].start <= end) {
+                break;
+            }
+            format->context(out, &file, pos, end, line);
+            pos = end + 1;
+            line++;
+            printed = pos;
+        }
+    }
+
+    if (opts.stream_continues && match_line) {
+        opts.stream_match_line = match_line;
+    }
+    if (!opts.stream_line_num) {
+        format->end(out, &file, invert ? inverted_lines : matches_len, buf_len, FALSE);
     }
-    free(context_prev_lines);
 }
 
 void print_line_number(size_t line, const char sep) {
     if (!opts.print_line_numbers) {
         return;
     }
-    if (opts.search_stream && opts.stream_line_num) {
-        line = opts.stream_line_num;
+    if (opts.stream_line_num) {
+        /* buf is the part of the stream (or --watch'ed file) that starts at that line */
+        line += opts.stream_line_num - 1;
     }
     if (opts.color) {
         fprintf(out_fd, "%s%lu%s%c", opts.color_line_number, (unsigned long)line, color_reset, sep);
@@ -298,10 +886,10 @@ void print_column_number(const match_t matches[], size_t last_printed_match,
 }
 
 void print_file_separator(void) {
-    if (first_file_match == 0 && opts.print_break) {
+    if (cur_search->first_file_match == 0 && opts.print_break) {
         fprintf(out_fd, "\n");
     }
-    first_file_match = 0;
+    cur_search->first_file_match = 0;
 }
 
 const char *normalize_path(const char *path) {
@@ -3,16 +3,32 @@
 
 #include "util.h"
 
+/* Highest capture group --replace can use */
+#define MAX_REPLACE_GROUP 99
+
+
 void print_path(const char *path, const char sep);
 void print_path_count(const char *path, const char sep, const size_t count);
 void print_line(const char *buf, size_t buf_pos, size_t prev_line_offset);
 void print_binary_file_matches(const char *path);
 void print_file_matches(const char *path, const char *buf, const size_t buf_len, const match_t matches[], const size_t matches_len);
+void print_file_replacements(const char *path, const char *buf, const size_t buf_len, const match_t matches[], const size_t matches_len,
+                             const match_t captures[], const size_t captures_len);
 void print_line_number(size_t line, const char sep);
 void print_column_number(const match_t matches[], size_t last_printed_match,
                          size_t prev_line_offset, const char sep);
 void print_file_separator(void);
+void callback_path(const char *path, const size_t matches_len);
+void callback_file_matches(const char *path, const char *buf, const size_t buf_len, const match_t matches[], const size_t matches_len);
+/* --json or --packed records. With --packed, caller must hold print_mtx. */
+void print_records_path(strbuf_t *out, const char *path, const char *tag, const size_t matches_len);
+void print_records_binary_file_matches(strbuf_t *out, const char *path, const char *tag, const size_t matches_len);
+void print_records_file_matches(strbuf_t *out, const char *path, const char *tag, const char *buf, const size_t buf_len,
+                                const match_t matches[], const size_t matches_len, const int invert);
+void print_packed_header(void);
+void print_packed_cleanup(void);
 const char *normalize_path(const char *path);
+int replace_max_group(const char *replace);
 
 #ifdef _WIN32
 void windows_use_ansi(int use_ansi);
@@ -0,0 +1,429 @@
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lang.h"
+#include "log.h"
+#include "options.h"
+#include "queries.h"
+#include "util.h"
+
+/* Words in one line of a --queries file */
+#define MAX_QUERY_WORDS 64
+
+/* Without --queries-output, every query prints into tagged_fp and its output
+ * is copied to out_fd with each line starting "NAME:". tagged_fp writes to
+ * memory where there's open_memstream(), and to a temporary file that's read
+ * back into tagged_copy where there isn't (Windows).
+ */
+static FILE *tagged_fp = NULL;
+#ifdef HAVE_OPEN_MEMSTREAM
+static char *tagged_buf = NULL;
+static size_t tagged_len = 0;
+#else
+static strbuf_t tagged_copy;
+#endif
+static FILE *untagged_fd = NULL;
+static int untagged_first_file_match = 1;
+
+/* Split line into words in place. Single quotes keep everything up to the
+ * next one, double quotes allow \" and \\ inside, and a backslash outside of
+ * quotes escapes the next character. Returns the number of words, or -1 if a
+ * quote isn't closed.
+ */
+static int split_words(char *line, char *words[], const int words_size) {
+    char *in = line;
+    char *out = line;
+    int words_len = 0;
+    char quote;
+
+    while (TRUE) {
+        while (isspace((unsigned char)*in)) {
+            in++;
+        }
+        if (*in == '\0' || *in == '#') {
+            return words_len;
+        }
+        if (words_len == words_size) {
+            return words_len;
+        }
+        words[words_len++] = out;
+        while (*in != '\0' && !isspace((unsigned char)*in)) {
+            if (*in == '\'' || *in == '"') {
+                quote = *in++;
+                while (*in != quote) {
+                    if (*in == '\0') {
+                        return -1;
+                    }
+                    if (quote == '"' && *in == '\\' && (in[1] == '"' || in[1] == '\\')) {
+                        in++;
+                    }
+                    *out++ = *in++;
+                }
+                in++;
+            } else {
+                if (*in == '\\' && in[1] != '\0') {
+                    in++;
+                }
+                *out++ = *in++;
+            }
+        }
+        if (*in != '\0') {
+            in++;
+        }
+        *out++ = '\0';
+    }
+}
+
+static int valid_query_name(const char *name) {
+    const char *c;
+
+    if (name[0] == '.' || strlen(name) > MAX_QUERY_NAME_LEN) {
+        return FALSE;
+    }
+    for (c = name; *c != '\0'; c++) {
+        if (!isalnum((unsigned char)*c) && *c != '_' && *c != '-' && *c != '.') {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/* Like compile_query() in libag.c, but for one query's pattern */
+static void query_compile(query_t *query, const int study_opts) {
+    pattern_t *pattern = &query->pattern;
+    int pcre_opts = PCRE_MULTILINE;
+    char *error = NULL;
+    char *c;
+
+    if (pattern->casing == CASE_SMART) {
+        pattern->casing = is_lowercase(pattern->query) ? CASE_INSENSITIVE : CASE_SENSITIVE;
+    }
+    if (pattern->literal) {
+        if (pattern->casing == CASE_INSENSITIVE) {
+            for (c = pattern->query; *c != '\0'; ++c) {
+                *c = (char)tolower(*c);
+            }
+        }
+        pattern->alpha_skip_lookup = ag_malloc(256 * sizeof(size_t));
+        generate_alpha_skip(pattern->query, pattern->query_len, pattern->alpha_skip_lookup, pattern->casing == CASE_SENSITIVE);
+        generate_find_skip(pattern->query, pattern->query_len, &pattern->find_skip_lookup, pattern->casing == CASE_SENSITIVE);
+        if (pattern->word_regexp) {
+            init_wordchar_table();
+            pattern->literal_starts_wordchar = is_wordchar(pattern->query[0]);
+            pattern->literal_ends_wordchar = is_wordchar(pattern->query[pattern->query_len - 1]);
+        }
+    } else {
+        if (pattern->casing == CASE_INSENSITIVE) {
+            pcre_opts |= PCRE_CASELESS;
+        }
+        if (pattern->word_regexp) {
+            char *word_regexp_query;
+            ag_asprintf(&word_regexp_query, "\\b(?:%s)\\b", pattern->query);
+            free(pattern->query);
+            pattern->query = word_regexp_query;
+            pattern->query_len = strlen(pattern->query);
+        }
+        if (!compile_study(&pattern->re, &pattern->re_extra, pattern->query, pcre_opts, study_opts, &error)) {
+            die("%s", error);
+        }
+    }
+}
+
+/* Set up query from the words after its name. Options start out as they were
+ * given to ag and can be changed per query.
+ */
+static void query_parse(query_t *query, char *words[], const int words_len, const enum case_behavior casing,
+                        const char *path, const int line_num) {
+    pattern_t *pattern = &query->pattern;
+    size_t lang_count = get_lang_count();
+    size_t *ext_index = ag_calloc(lang_count, sizeof(size_t));
+    size_t lang_num = 0;
+    char *file_search_regex = NULL;
+    const char *word;
+    size_t i;
+    int w;
+
+    pattern->literal = opts.literal;
+    pattern->casing = casing;
+    pattern->word_regexp = opts.word_regexp;
+    pattern->invert_match = opts.invert_match;
+
+    for (w = 1; w < words_len - 1 && words[w][0] == '-'; w++) {
+        word = words[w];
+        if (strcmp(word, "--") == 0) {
+            w++;
+            break;
+        } else if (strcmp(word, "--ignore-case") == 0) {
+            pattern->casing = CASE_INSENSITIVE;
+        } else if (strcmp(word, "--case-sensitive") == 0) {
+            pattern->casing = CASE_SENSITIVE;
+        } else if (strcmp(word, "--smart-case") == 0) {
+            pattern->casing = CASE_SMART;
+        } else if (strcmp(word, "--literal") == 0 || strcmp(word, "--fixed-strings") == 0) {
+            pattern->literal = TRUE;
+        } else if (strcmp(word, "--word-regexp") == 0) {
+            pattern->word_regexp = TRUE;
+        } else if (strcmp(word, "--invert-match") == 0) {
+            pattern->invert_match = TRUE;
+        } else if (strcmp(word, "--file-search-regex") == 0 || strcmp(word, "-G") == 0) {
+            if (++w == words_len - 1) {
+                die("%s:%i: %s needs a regex", path, line_num, word);
+            }
+            file_search_regex = words[w];
+        } else if (word[1] == '-') {
+            for (i = 0; i < lang_count; i++) {
+                if (strcmp(word + 2, langs[i].name) == 0) {
+                    ext_index[lang_num++] = i;
+                    break;
+                }
+            }
+            if (i == lang_count) {
+                die("%s:%i: %s can't be used in a query", path, line_num, word);
+            }
+        } else {
+            /* Short options can be bundled, like -iw */
+            for (i = 1; word[i] != '\0'; i++) {
+                switch (word[i]) {
+                    case 'i':
+                        pattern->casing = CASE_INSENSITIVE;
+                        break;
+                    case 's':
+                        pattern->casing = CASE_SENSITIVE;
+                        break;
+                    case 'S':
+                        pattern->casing = CASE_SMART;
+                        break;
+                    case 'Q':
+                    case 'F':
+                        pattern->literal = TRUE;
+                        break;
+                    case 'w':
+                        pattern->word_regexp = TRUE;
+                        break;
+                    case 'v':
+                        pattern->invert_match = TRUE;
+                        break;
+                    default:
+                        die("%s:%i: -%c can't be used in a query", path, line_num, word[i]);
+                }
+            }
+        }
+    }
+    if (w != words_len - 1) {
+        die("%s:%i: expected NAME [OPTIONS] PATTERN", path, line_num);
+    }
+
+    pattern->query = ag_strdup(words[w]);
+    pattern->query_len = strlen(pattern->query);
+    if (pattern->query_len == 0) {
+        die("%s:%i: query %s has an empty pattern", path, line_num, query->name);
+    }
+    if (!is_regex(pattern->query)) {
+        pattern->literal = TRUE;
+    }
+
+    if (file_search_regex) {
+        int pcre_opts = 0;
+        char *error = NULL;
+        if (pattern->casing == CASE_INSENSITIVE || (pattern->casing == CASE_SMART && is_lowercase(file_search_regex))) {
+            pcre_opts |= PCRE_CASELESS;
+        }
+        if (!compile_study(&query->file_search_regex, &query->file_search_regex_extra, file_search_regex, pcre_opts, 0, &error)) {
+            die("%s", error);
+        }
+    }
+    if (lang_num > 0) {
+        query->lang_exts_len = combine_file_extensions(ext_index, lang_num, &query->lang_exts);
+        query->lang_exts_len = sort_file_extensions(query->lang_exts, query->lang_exts_len);
+    }
+    free(ext_index);
+}
+
+void queries_load(const char *path, const enum case_behavior casing, const int study_opts) {
+    FILE *fp = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    char *line = NULL;
+    size_t line_cap = 0;
+    char *words[MAX_QUERY_WORDS];
+    int words_len;
+    int line_num = 0;
+    char *out_path;
+    query_t *query;
+    size_t i;
+
+    if (fp == NULL) {
+        die("Can't open --queries file %s: %s", path, strerror(errno));
+    }
+    while (getline(&line, &line_cap, fp) > 0) {
+        line_num++;
+        words_len = split_words(line, words, MAX_QUERY_WORDS);
+        if (words_len < 0) {
+            die("%s:%i: unclosed quote", path, line_num);
+        }
+        if (words_len == 0) {
+            continue;
+        }
+        if (!valid_query_name(words[0])) {
+            die("%s:%i: query names can only have letters, numbers, '_', '-' and '.', and can't start with '.'", path, line_num);
+        }
+        for (i = 0; i < queries_len; i++) {
+            if (strcmp(queries[i].name, words[0]) == 0) {
+                die("%s:%i: there's already a query named %s", path, line_num, words[0]);
+            }
+        }
+        queries = ag_realloc(queries, (queries_len + 1) * sizeof(query_t));
+        query = &queries[queries_len++];
+        memset(query, 0, sizeof(query_t));
+        query->name = ag_strdup(words[0]);
+        query->first_file_match = 1;
+        query_parse(query, words, words_len, casing, path, line_num);
+        query_compile(query, study_opts);
+        log_debug("Query %s is %s", query->name, query->pattern.query);
+    }
+    free(line);
+    if (fp != stdin) {
+        fclose(fp);
+    }
+    if (queries_len == 0) {
+        die("No queries in %s", path);
+    }
+
+    if (opts.queries_output == NULL) {
+#ifdef HAVE_OPEN_MEMSTREAM
+        tagged_fp = open_memstream(&tagged_buf, &tagged_len);
+        if (tagged_fp == NULL) {
+            die("open_memstream() failed: %s", strerror(errno));
+        }
+#else
+        tagged_fp = tmpfile();
+        if (tagged_fp == NULL) {
+            die("tmpfile() failed: %s", strerror(errno));
+        }
+#endif
+        return;
+    }
+    for (i = 0; i < queries_len; i++) {
+        ag_asprintf(&out_path, "%s/%s", opts.queries_output, queries[i].name);
+        queries[i].out = fopen(out_path, "w");
+        if (queries[i].out == NULL) {
+            die("Can't write to %s: %s", out_path, strerror(errno));
+        }
+        free(out_path);
+    }
+}
+
+int query_wants_path(const query_t *query, const char *path) {
+    if (query->lang_exts_len > 0 && !has_file_extension(path, query->lang_exts, query->lang_exts_len)) {
+        return FALSE;
+    }
+    if (query->file_search_regex &&
+        pcre_exec(query->file_search_regex, query->file_search_regex_extra, path, strlen(path), 0, 0, NULL, 0) < 0) {
+        return FALSE;
+    }
+    return TRUE;
+}
+
+int queries_want_path(const char *path) {
+    size_t i;
+
+    for (i = 0; i < queries_len; i++) {
+        if (query_wants_path(&queries[i], path)) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+void query_output_begin(query_t *query) {
+    untagged_fd = out_fd;
+    untagged_first_file_match = cur_search->first_file_match;
+    cur_search->first_file_match = query->first_file_match;
+    if (query->out) {
+        out_fd = query->out;
+    } else if (!opts.json) {
+        /* --json records say which query they're from instead */
+        out_fd = tagged_fp;
+    }
+}
+
+void query_output_end(query_t *query) {
+    const char *line;
+    const char *end;
+    const char *nl;
+#ifndef HAVE_OPEN_MEMSTREAM
+    long tagged_len;
+#endif
+
+    query->first_file_match = cur_search->first_file_match;
+    cur_search->first_file_match = untagged_first_file_match;
+    out_fd = untagged_fd;
+    if (query->out != NULL || opts.json) {
+        return;
+    }
+
+    fflush(tagged_fp);
+#ifdef HAVE_OPEN_MEMSTREAM
+    line = tagged_buf;
+    end = tagged_buf + tagged_len;
+#else
+    /* Only what this query wrote. Anything past it is left from earlier ones. */
+    tagged_len = ftell(tagged_fp);
+    rewind(tagged_fp);
+    tagged_copy.len = 0;
+    strbuf_grow(&tagged_copy, tagged_len);
+    tagged_copy.len = fread(tagged_copy.data, 1, tagged_len, tagged_fp);
+    line = tagged_copy.data;
+    end = tagged_copy.data + tagged_copy.len;
+#endif
+    while (line < end) {
+        nl = memchr(line, '\n', end - line);
+        nl = nl ? nl + 1 : end;
+        fprintf(out_fd, "%s:", query->name);
+        fwrite(line, 1, nl - line, out_fd);
+        line = nl;
+    }
+    /* The next query's output overwrites this one's */
+    rewind(tagged_fp);
+}
+
+void queries_cleanup(void) {
+    size_t i;
+
+    for (i = 0; i < queries_len; i++) {
+        free(queries[i].name);
+        free(queries[i].pattern.query);
+        free(queries[i].pattern.alpha_skip_lookup);
+        free(queries[i].pattern.find_skip_lookup);
+        if (queries[i].pattern.re) {
+            pcre_free(queries[i].pattern.re);
+        }
+        if (queries[i].pattern.re_extra) {
+            pcre_free(queries[i].pattern.re_extra);
+        }
+        if (queries[i].file_search_regex) {
+            pcre_free(queries[i].file_search_regex);
+        }
+        if (queries[i].file_search_regex_extra) {
+            pcre_free(queries[i].file_search_regex_extra);
+        }
+        free(queries[i].lang_exts);
+        if (queries[i].out) {
+            fclose(queries[i].out);
+        }
+    }
+    free(queries);
+    queries = NULL;
+    queries_len = 0;
+    if (tagged_fp) {
+        fclose(tagged_fp);
+        tagged_fp = NULL;
+    }
+#ifdef HAVE_OPEN_MEMSTREAM
+    free(tagged_buf);
+    tagged_buf = NULL;
+    tagged_len = 0;
+#else
+    free(tagged_copy.data);
+    memset(&tagged_copy, 0, sizeof(tagged_copy));
+#endif
+}
@@ -0,0 +1,43 @@
+#ifndef QUERIES_H
+#define QUERIES_H
+
+#include <stdio.h>
+
+#include "search.h"
+
+/* Longest query name. Names are also file names with --queries-output. */
+#define MAX_QUERY_NAME_LEN 64
+
+/* One line of a --queries file. Each file is read once and searched with
+ * every query that wants it.
+ */
+typedef struct {
+    char *name;
+    pattern_t pattern;
+    char *lang_exts; /* Like opts.lang_exts, but only for this query */
+    size_t lang_exts_len;
+    pcre *file_search_regex;
+    pcre_extra *file_search_regex_extra;
+    FILE *out;            /* Its own file with --queries-output, else NULL */
+    int first_file_match; /* print.c's, for this query's output */
+} query_t;
+
+query_t *queries;
+size_t queries_len;
+
+/* Read and compile the queries in path. Dies if any are bad. casing is ag's,
+ * before smart case was decided by the command line's (unused) query.
+ */
+void queries_load(const char *path, const enum case_behavior casing, const int study_opts);
+/* Whether the query's file type and -G options let it search path */
+int query_wants_path(const query_t *query, const char *path);
+/* Whether any query wants path. No use opening a file if nobody does. */
+int queries_want_path(const char *path);
+/* Print the query's results to its own output until query_output_end().
+ * Caller must hold print_mtx.
+ */
+void query_output_begin(query_t *query);
+void query_output_end(query_t *query);
+void queries_cleanup(void);
+
+#endif
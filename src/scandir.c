@@ -2,6 +2,7 @@
 #include <stdlib.h>
 
 #include "scandir.h"
+#include "stats.h"
 #include "util.h"
 
 int ag_scandir(const char *dirname,
@@ -13,6 +14,8 @@ int ag_scandir(const char *dirname,
     struct dirent *entry, *d;
     int names_len = 32;
     int results_len = 0;
+    double filter_start;
+    int keep;
 
     dirp = opendir(dirname);
     if (dirp == NULL) {
@@ -25,7 +28,10 @@ int ag_scandir(const char *dirname,
     }
 
     while ((entry = readdir(dirp)) != NULL) {
-        if ((*filter)(dirname, entry, baton) == FALSE) {
+        filter_start = stats_phase_start();
+        keep = (*filter)(dirname, entry, baton);
+        stats_phase_end(STATS_PHASE_IGNORE, filter_start);
+        if (keep == FALSE) {
             continue;
         }
         if (results_len >= names_len) {
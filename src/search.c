@@ -1,72 +1,360 @@
 #include "search.h"
+#include "queries.h"
 #include "scandir.h"
+#include "trace.h"
 
-void search_buf(const char *buf, const size_t buf_len,
-                const char *dir_full_path) {
-    int binary = -1; /* 1 = yes, 0 = no, -1 = don't know */
-    size_t buf_offset = 0;
+#ifdef HAVE_LINUX_FIEMAP_H
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#endif
 
-    if (opts.search_stream) {
-        binary = 0;
-    } else if (!opts.search_binary_files) {
-        binary = is_binary((const void *)buf, buf_len);
-        if (binary) {
-            log_debug("File %s is binary. Skipping...", dir_full_path);
-            return;
-        }
-    }
+__thread search_t *cur_search = NULL;
 
-    size_t matches_len = 0;
+/* Buffers each thread keeps from one file to the next instead of freeing them */
+typedef struct {
     match_t *matches;
     size_t matches_size;
-    size_t matches_spare;
+    match_t *captures; /* opts.replace_captures groups for each of matches */
+    size_t captures_size;
+    char *read_buf; /* For files smaller than opts.mmap_threshold */
+    size_t read_buf_size;
+    int node;                /* The worker's NUMA node, or -1 if this isn't a worker */
+    const pattern_t *pattern; /* The copy of the query to search with */
+    query_t *query;           /* The --queries query being searched for, if any */
+    int file_counted;         /* Stats count a file once, however many queries search it, */
+    int file_matched;         /* and count it as matching once */
+    strbuf_t records;         /* --json or --packed output for the file being searched */
+} search_scratch_t;
+
+/* Don't hang on to huge buffers after searching a pathological file */
+#define MAX_SCRATCH_MATCHES 100000
+#define MAX_SCRATCH_READ_BUF (16 * 1024 * 1024)
+
+#define MAX_PREFETCH_BYTES (1024 * 1024)
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
 
-    if (opts.invert_match) {
-        /* If we are going to invert the set of matches at the end, we will need
-         * one extra match struct, even if there are no matches at all. So make
-         * sure we have a nonempty array; and make sure we always have spare
-         * capacity for one extra.
-         */
-        matches_size = 100;
-        matches = ag_malloc(matches_size * sizeof(match_t));
-        matches_spare = 1;
-    } else {
-        matches_size = 0;
-        matches = NULL;
-        matches_spare = 0;
+/* What sniff_file_type() said about each file we've sniffed. lang is -1 if
+ * it's no type we know of. Files don't change type without their mtime
+ * changing, so we never have to read one again.
+ */
+typedef struct {
+    sniff_key_t key;
+    int lang;
+    UT_hash_handle hh;
+} sniff_cache_t;
+
+static sniff_cache_t *sniff_cache = NULL;
+static pthread_mutex_t sniff_cache_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_key_t scratch_key;
+static pthread_once_t scratch_key_once = PTHREAD_ONCE_INIT;
+static int scratch_key_created = FALSE;
+
+static void free_scratch(void *ptr) {
+    search_scratch_t *scratch = ptr;
+    free(scratch->matches);
+    free(scratch->captures);
+    free(scratch->read_buf);
+    free(scratch->records.data);
+    free(scratch);
+}
+
+static void create_scratch_key(void) {
+    scratch_key_created = pthread_key_create(&scratch_key, &free_scratch) == 0;
+}
+
+/* search_init() has made sure there's a key */
+static search_scratch_t *get_scratch(void) {
+    search_scratch_t *scratch;
+
+    scratch = pthread_getspecific(scratch_key);
+    if (scratch == NULL) {
+        scratch = ag_calloc(1, sizeof(search_scratch_t));
+        scratch->node = -1;
+        pthread_setspecific(scratch_key, scratch);
+    }
+    return scratch;
+}
+
+int search_init(search_t *search, const pattern_t *pattern, const int nodes, const int pcre_opts, const int study_opts, char **error) {
+    int shards_inited;
+    int i;
+
+    pthread_once(&scratch_key_once, &create_scratch_key);
+    if (!scratch_key_created) {
+        ag_asprintf(error, "pthread_key_create failed!");
+        return FALSE;
+    }
+
+    memset(search, 0, sizeof(search_t));
+    search->opts = opts;
+    search->out_fd = out_fd;
+    search->first_file_match = 1;
+    search->pattern = *pattern;
+    search->pattern.invert_match = opts.invert_match;
+    search->pcre_opts = pcre_opts;
+    search->study_opts = study_opts;
+    if (nodes > 1) {
+        search->pattern_copies_len = nodes;
+        search->pattern_copies = ag_calloc(nodes, sizeof(pattern_t));
+    }
+
+    search->shards_len = nodes > 1 ? nodes : 1;
+    search->shards = ag_calloc(search->shards_len, sizeof(work_queue_shard_t));
+    for (shards_inited = 0; shards_inited < search->shards_len; shards_inited++) {
+        if (pthread_mutex_init(&search->shards[shards_inited].mtx, NULL)) {
+            break;
+        }
+        if (pthread_cond_init(&search->shards[shards_inited].files_ready, NULL)) {
+            pthread_mutex_destroy(&search->shards[shards_inited].mtx);
+            break;
+        }
+    }
+    if (shards_inited < search->shards_len) {
+        ag_asprintf(error, "Can't set up the work queue");
+        goto search_init_failed;
+    }
+
+    if (pthread_mutex_init(&search->print_mtx, NULL)) {
+        ag_asprintf(error, "pthread_mutex_init failed!");
+        goto search_init_failed;
+    }
+    if (pthread_mutex_init(&search->pattern_copies_mtx, NULL)) {
+        ag_asprintf(error, "pthread_mutex_init failed!");
+        pthread_mutex_destroy(&search->print_mtx);
+        goto search_init_failed;
     }
+    if (pthread_mutex_init(&search->prefetch_mtx, NULL)) {
+        ag_asprintf(error, "pthread_mutex_init failed!");
+        pthread_mutex_destroy(&search->pattern_copies_mtx);
+        pthread_mutex_destroy(&search->print_mtx);
+        goto search_init_failed;
+    }
+    if (pthread_cond_init(&search->prefetch_wanted_cond, NULL)) {
+        ag_asprintf(error, "pthread_cond_init failed!");
+        pthread_mutex_destroy(&search->prefetch_mtx);
+        pthread_mutex_destroy(&search->pattern_copies_mtx);
+        pthread_mutex_destroy(&search->print_mtx);
+        goto search_init_failed;
+    }
+
+    cur_search = search;
+    /* This thread may have searched for something else before */
+    get_scratch()->pattern = NULL;
+    return TRUE;
+
+search_init_failed:
+    for (i = 0; i < shards_inited; i++) {
+        pthread_cond_destroy(&search->shards[i].files_ready);
+        pthread_mutex_destroy(&search->shards[i].mtx);
+    }
+    free(search->shards);
+    free(search->pattern_copies);
+    return FALSE;
+}
+
+void search_cleanup(search_t *search) {
+    int i;
+
+    for (i = 0; i < search->shards_len; i++) {
+        pthread_cond_destroy(&search->shards[i].files_ready);
+        pthread_mutex_destroy(&search->shards[i].mtx);
+    }
+    free(search->shards);
+    for (i = 0; i < search->pattern_copies_len; i++) {
+        free(search->pattern_copies[i].alpha_skip_lookup);
+        free(search->pattern_copies[i].find_skip_lookup);
+        if (search->pattern_copies[i].re != NULL) {
+            pcre_free(search->pattern_copies[i].re);
+        }
+        if (search->pattern_copies[i].re_extra != NULL) {
+            /* Using pcre_free_study on pcre_extra* can segfault on some versions of PCRE */
+            pcre_free(search->pattern_copies[i].re_extra);
+        }
+    }
+    free(search->pattern_copies);
+    free(search->context_prev_lines);
+    pthread_cond_destroy(&search->prefetch_wanted_cond);
+    pthread_mutex_destroy(&search->prefetch_mtx);
+    pthread_mutex_destroy(&search->pattern_copies_mtx);
+    pthread_mutex_destroy(&search->print_mtx);
+    if (cur_search == search) {
+        get_scratch()->pattern = NULL;
+        cur_search = NULL;
+    }
+}
+
+/* The copy of the query this thread should search with. The first worker on
+ * each node to ask makes that node's copy, so its memory is on that node.
+ */
+static const pattern_t *get_pattern(search_scratch_t *scratch) {
+    const pattern_t *main_pattern = &cur_search->pattern;
+    pattern_t *copy;
+    char *error = NULL;
+
+    if (scratch->pattern != NULL) {
+        return scratch->pattern;
+    }
+    if (scratch->node < 0 || scratch->node >= cur_search->pattern_copies_len) {
+        scratch->pattern = main_pattern;
+        return scratch->pattern;
+    }
+
+    pthread_mutex_lock(&cur_search->pattern_copies_mtx);
+    copy = &cur_search->pattern_copies[scratch->node];
+    if (copy->alpha_skip_lookup == NULL && copy->re == NULL) {
+        *copy = *main_pattern;
+        copy->alpha_skip_lookup = NULL;
+        copy->find_skip_lookup = NULL;
+        copy->re = NULL;
+        copy->re_extra = NULL;
+        if (main_pattern->literal) {
+            copy->alpha_skip_lookup = ag_malloc(256 * sizeof(size_t));
+            memcpy(copy->alpha_skip_lookup, main_pattern->alpha_skip_lookup, 256 * sizeof(size_t));
+            copy->find_skip_lookup = ag_malloc(main_pattern->query_len * sizeof(size_t));
+            memcpy(copy->find_skip_lookup, main_pattern->find_skip_lookup, main_pattern->query_len * sizeof(size_t));
+        } else if (!compile_study(&copy->re, &copy->re_extra, main_pattern->query, cur_search->pcre_opts, cur_search->study_opts, &error)) {
+            /* It compiled once already, so this can't happen. Search with the original. */
+            log_err("%s", error);
+            free(error);
+            pthread_mutex_unlock(&cur_search->pattern_copies_mtx);
+            scratch->pattern = main_pattern;
+            return scratch->pattern;
+        }
+        log_debug("Copied the pattern to NUMA node %i", scratch->node);
+    }
+    pthread_mutex_unlock(&cur_search->pattern_copies_mtx);
+    scratch->pattern = copy;
+    return copy;
+}
 
-    if (!opts.literal && opts.query_len == 1 && opts.query[0] == '.') {
-        matches_size = 1;
-        matches = matches == NULL ? ag_malloc(matches_size * sizeof(match_t)) : matches;
-        matches[0].start = 0;
+int search_is_done(void) {
+    return __atomic_load_n(&cur_search->done, __ATOMIC_ACQUIRE);
+}
+
+void search_set_done(const int done) {
+    __atomic_store_n(&cur_search->done, done, __ATOMIC_RELEASE);
+}
+
+/* Reserve up to wanted results against --max-total-count. Returns how many
+ * may be printed, which is 0 once the limit has been reached. Caller must
+ * hold print_mtx.
+ */
+static size_t claim_results(size_t wanted) {
+    if (search_is_done()) {
+        return 0;
+    }
+    if (opts.max_total_matches == 0) {
+        return wanted;
+    }
+    if (wanted > opts.max_total_matches - cur_search->total_results) {
+        wanted = opts.max_total_matches - cur_search->total_results;
+    }
+    cur_search->total_results += wanted;
+    if (cur_search->total_results >= opts.max_total_matches) {
+        log_debug("Reached %lu total matches. Stopping search.", (unsigned long)cur_search->total_results);
+        search_set_done(TRUE);
+    }
+    return wanted;
+}
+
+/* No single file can contribute more than --max-total-count matches, so stop
+ * matching once we have that many. Inverted matches are only known after the
+ * whole buffer has been searched. -c, -l and -L count files instead, and each
+ * file's count has to be complete.
+ */
+static int total_limit_reached(const pattern_t *pattern, const size_t matches_len) {
+    if (search_is_done()) {
+        return TRUE;
+    }
+    return !pattern->invert_match && !opts.print_filename_only && opts.max_total_matches > 0 &&
+           matches_len >= opts.max_total_matches;
+}
+
+/* Keep the spans of the groups --replace uses for match number match_i.
+ * offset_vector is from pcre_exec(), which returned rv, and its offsets are
+ * from buf_offset. Groups that didn't take part in the match are empty.
+ */
+static void save_captures(search_scratch_t *scratch, const size_t match_i, const int *offset_vector, int rv,
+                          const size_t buf_offset) {
+    const size_t captures_len = opts.replace_captures;
+    match_t *captures;
+    size_t i;
+
+    if (scratch->captures_size < (match_i + 1) * captures_len) {
+        scratch->captures_size = scratch->captures_size ? scratch->captures_size * 2 : 100 * captures_len;
+        if (scratch->captures_size < (match_i + 1) * captures_len) {
+            scratch->captures_size = (match_i + 1) * captures_len;
+        }
+        scratch->captures = ag_realloc(scratch->captures, scratch->captures_size * sizeof(match_t));
+    }
+    if (rv == 0) {
+        /* offset_vector was too small for every group, so it's full */
+        rv = captures_len + 1;
+    }
+    captures = scratch->captures + match_i * captures_len;
+    for (i = 0; i < captures_len; i++) {
+        if ((int)i + 1 < rv && offset_vector[2 * (i + 1)] >= 0) {
+            captures[i].start = offset_vector[2 * (i + 1)] + buf_offset;
+            captures[i].end = offset_vector[2 * (i + 1) + 1] + buf_offset;
+        } else {
+            captures[i].start = captures[i].end = 0;
+        }
+    }
+}
+
+/* Find the matches that start in [range_start, range_end) of buf and append
+ * them to *matches_p. Matches may run past range_end. The regex always sees
+ * the text before range_start, so anchors and lookbehinds work just like
+ * they do when searching all of buf. range_start must be the start of a
+ * line. Returns the number of matches found.
+ */
+static size_t search_range(const char *buf, const size_t buf_len, const size_t range_start, const size_t range_end,
+                           match_t **matches_p, size_t *matches_size_p, const size_t matches_spare,
+                           const char *dir_full_path) {
+    size_t buf_offset = range_start;
+    size_t matches_len = 0;
+    match_t *matches = *matches_p;
+    size_t matches_size = *matches_size_p;
+    search_scratch_t *scratch = get_scratch();
+    const pattern_t *pattern = get_pattern(scratch);
+
+    if (!pattern->literal && pattern->query_len == 1 && pattern->query[0] == '.') {
+        realloc_matches(&matches, &matches_size, 0);
+        matches[0].start = range_start;
         matches[0].end = buf_len;
         matches_len = 1;
-    } else if (opts.literal) {
-        const char *match_ptr = buf;
-        strncmp_fp ag_strnstr_fp = get_strstr(opts.casing);
-
-        while (buf_offset < buf_len) {
-            match_ptr = ag_strnstr_fp(match_ptr, opts.query, buf_len - buf_offset, opts.query_len, alpha_skip_lookup, find_skip_lookup);
+    } else if (pattern->literal) {
+        const char *match_ptr = buf + range_start;
+        strncmp_fp ag_strnstr_fp = get_strstr(pattern->casing);
+        /* Only look far enough past range_end to find matches that start before it */
+        const size_t search_end = range_end + pattern->query_len - 1 < buf_len ? range_end + pattern->query_len - 1 : buf_len;
+
+        while (buf_offset < range_end) {
+            match_ptr = ag_strnstr_fp(match_ptr, pattern->query, search_end - buf_offset, pattern->query_len, pattern->alpha_skip_lookup, pattern->find_skip_lookup);
             if (match_ptr == NULL) {
                 break;
             }
 
-            if (opts.word_regexp) {
+            if (pattern->word_regexp) {
                 const char *start = match_ptr;
-                const char *end = match_ptr + opts.query_len;
+                const char *end = match_ptr + pattern->query_len;
 
                 /* Check whether both start and end of the match lie on a word
                  * boundary
                  */
                 if ((start == buf ||
-                     is_wordchar(*(start - 1)) != opts.literal_starts_wordchar) &&
+                     is_wordchar(*(start - 1)) != pattern->literal_starts_wordchar) &&
                     (end == buf + buf_len ||
-                     is_wordchar(*end) != opts.literal_ends_wordchar)) {
+                     is_wordchar(*end) != pattern->literal_ends_wordchar)) {
                     /* It's a match */
                 } else {
                     /* It's not a match */
-                    match_ptr += opts.query_len;
+                    match_ptr += pattern->query_len;
                     buf_offset = end - buf;
                     continue;
                 }
@@ -75,22 +363,43 @@ void search_buf(const char *buf, const size_t buf_len,
             realloc_matches(&matches, &matches_size, matches_len + matches_spare);
 
             matches[matches_len].start = match_ptr - buf;
-            matches[matches_len].end = matches[matches_len].start + opts.query_len;
+            matches[matches_len].end = matches[matches_len].start + pattern->query_len;
             buf_offset = matches[matches_len].end;
             log_debug("Match found. File %s, offset %lu bytes.", dir_full_path, matches[matches_len].start);
             matches_len++;
-            match_ptr += opts.query_len;
+            match_ptr += pattern->query_len;
 
             if (opts.max_matches_per_file > 0 && matches_len >= opts.max_matches_per_file) {
-                log_err("Too many matches in %s. Skipping the rest of this file.", dir_full_path);
+                break;
+            }
+            if (total_limit_reached(pattern, matches_len)) {
                 break;
             }
         }
     } else {
-        int offset_vector[3];
+        /* The whole match, then the groups --replace uses */
+        int offset_vector[3 * (MAX_REPLACE_GROUP + 1)];
+        const int offset_vector_len = 3 * (opts.replace_captures + 1);
         if (opts.multiline) {
-            while (buf_offset < buf_len &&
-                   (pcre_exec(opts.re, opts.re_extra, buf, buf_len, buf_offset, 0, offset_vector, 3)) >= 0) {
+            /* When searching part of buf, stop the regex at range_end. If a
+             * match might continue past it, PCRE_PARTIAL_HARD tells us where
+             * that match started, and we retry from there with all of buf.
+             */
+            const size_t subject_len = range_end;
+            const int exec_opts = range_end < buf_len ? PCRE_PARTIAL_HARD : 0;
+            int rv;
+
+            while (buf_offset < range_end) {
+                rv = pcre_exec(pattern->re, pattern->re_extra, buf, subject_len, buf_offset, exec_opts, offset_vector, offset_vector_len);
+                if (rv == PCRE_ERROR_PARTIAL) {
+                    rv = pcre_exec(pattern->re, pattern->re_extra, buf, buf_len, offset_vector[0], 0, offset_vector, offset_vector_len);
+                    if (rv >= 0 && (size_t)offset_vector[0] >= range_end) {
+                        break;
+                    }
+                }
+                if (rv < 0) {
+                    break;
+                }
                 log_debug("Regex match found. File %s, offset %i bytes.", dir_full_path, offset_vector[0]);
                 buf_offset = offset_vector[1];
                 if (offset_vector[0] == offset_vector[1]) {
@@ -102,15 +411,20 @@ void search_buf(const char *buf, const size_t buf_len,
 
                 matches[matches_len].start = offset_vector[0];
                 matches[matches_len].end = offset_vector[1];
+                if (opts.replace_captures) {
+                    save_captures(scratch, matches_len, offset_vector, rv, 0);
+                }
                 matches_len++;
 
                 if (opts.max_matches_per_file > 0 && matches_len >= opts.max_matches_per_file) {
-                    log_err("Too many matches in %s. Skipping the rest of this file.", dir_full_path);
+                    break;
+                }
+                if (total_limit_reached(pattern, matches_len)) {
                     break;
                 }
             }
         } else {
-            while (buf_offset < buf_len) {
+            while (buf_offset < range_end) {
                 const char *line;
                 size_t line_len = buf_getline(&line, buf, buf_len, buf_offset);
                 if (!line) {
@@ -118,11 +432,12 @@ void search_buf(const char *buf, const size_t buf_len,
                 }
                 size_t line_offset = 0;
                 while (line_offset < line_len) {
-                    int rv = pcre_exec(opts.re, opts.re_extra, line, line_len, line_offset, 0, offset_vector, 3);
+                    int rv = pcre_exec(pattern->re, pattern->re_extra, line, line_len, line_offset, 0, offset_vector, offset_vector_len);
                     if (rv < 0) {
                         break;
                     }
-                    size_t line_to_buf = buf_offset + line_offset;
+                    /* Offsets are from the start of the line, not from line_offset */
+                    size_t line_to_buf = buf_offset;
                     log_debug("Regex match found. File %s, offset %i bytes.", dir_full_path, offset_vector[0]);
                     line_offset = offset_vector[1];
                     if (offset_vector[0] == offset_vector[1]) {
@@ -134,10 +449,15 @@ void search_buf(const char *buf, const size_t buf_len,
 
                     matches[matches_len].start = offset_vector[0] + line_to_buf;
                     matches[matches_len].end = offset_vector[1] + line_to_buf;
+                    if (opts.replace_captures) {
+                        save_captures(scratch, matches_len, offset_vector, rv, line_to_buf);
+                    }
                     matches_len++;
 
                     if (opts.max_matches_per_file > 0 && matches_len >= opts.max_matches_per_file) {
-                        log_err("Too many matches in %s. Skipping the rest of this file.", dir_full_path);
+                        goto multiline_done;
+                    }
+                    if (total_limit_reached(pattern, matches_len)) {
                         goto multiline_done;
                     }
                 }
@@ -148,26 +468,65 @@ void search_buf(const char *buf, const size_t buf_len,
 
 multiline_done:
 
-    if (opts.invert_match) {
+    *matches_p = matches;
+    *matches_size_p = matches_size;
+    return matches_len;
+}
+
+/* Invert matches if need be, count them and print them. matches must have
+ * room for one more match if the pattern's invert_match is set.
+ */
+static void report_matches(const char *buf, const size_t buf_len, match_t *matches, size_t matches_len,
+                           int binary, const char *dir_full_path) {
+    double phase_start;
+    search_scratch_t *scratch = get_scratch();
+    const pattern_t *pattern = get_pattern(scratch);
+    const char *tag = scratch->query ? scratch->query->name : NULL;
+    int records_ready = FALSE;
+
+    if (opts.max_matches_per_file > 0 && matches_len >= opts.max_matches_per_file) {
+        log_err("Too many matches in %s. Skipping the rest of this file.", dir_full_path);
+    }
+
+    if (pattern->invert_match) {
         matches_len = invert_matches(buf, buf_len, matches, matches_len);
     }
 
-    if (opts.stats) {
-        pthread_mutex_lock(&stats_mtx);
-        stats.total_bytes += buf_len;
-        stats.total_files++;
-        stats.total_matches += matches_len;
-        if (matches_len > 0) {
-            stats.total_file_matches++;
+    if (STATS_ENABLED) {
+        ag_stats *st = stats_thread();
+        if (!scratch->file_counted) {
+            st->total_bytes += buf_len;
+            st->total_files++;
+        }
+        st->total_matches += matches_len;
+        if (matches_len > 0 && !scratch->file_matched) {
+            st->total_file_matches++;
+        }
+        if (scratch->query) {
+            scratch->file_counted = TRUE;
+            scratch->file_matched = scratch->file_matched || matches_len > 0;
         }
-        pthread_mutex_unlock(&stats_mtx);
     }
 
     if (matches_len > 0) {
         if (binary == -1 && !opts.print_filename_only) {
             binary = is_binary((const void *)buf, buf_len);
         }
-        pthread_mutex_lock(&print_mtx);
+        /* Format --json output before taking the lock, unless only some of
+         * the matches may get printed because of --max-total-count. --packed
+         * numbers paths as it goes, so it has to wait for the lock.
+         */
+        scratch->records.len = 0;
+        if (opts.json && !opts.print_filename_only && !binary && !opts.quiet && opts.max_total_matches == 0) {
+            print_records_file_matches(&scratch->records, dir_full_path, tag, buf, buf_len, matches, matches_len, pattern->invert_match);
+            records_ready = TRUE;
+        }
+        phase_start = stats_phase_start();
+        pthread_mutex_lock(&cur_search->print_mtx);
+        trace_span("print_wait", phase_start, NULL);
+        if (scratch->query) {
+            query_output_begin(scratch->query);
+        }
         if (opts.print_filename_only) {
             /* If the --files-without-matches or -L option is passed we should
              * not print a matching line. This option currently sets
@@ -176,64 +535,830 @@ multiline_done:
              * on a file-without-matches which is not desired behaviour. See
              * GitHub issue 206 for the consequences if this behaviour is not
              * checked. */
-            if (!opts.invert_match || matches_len < 2) {
-                if (opts.print_count) {
+            if ((!pattern->invert_match || matches_len < 2) && claim_results(1) > 0 && !opts.quiet) {
+                if (opts.result_cb) {
+                    callback_path(dir_full_path, opts.print_count ? (size_t)matches_len : 1);
+                } else if (opts.json || opts.packed) {
+                    print_records_path(&scratch->records, dir_full_path, tag, opts.print_count ? (size_t)matches_len : 1);
+                    fwrite(scratch->records.data, 1, scratch->records.len, out_fd);
+                } else if (opts.print_count) {
                     print_path_count(dir_full_path, opts.path_sep, (size_t)matches_len);
                 } else {
                     print_path(dir_full_path, opts.path_sep);
                 }
             }
-        } else if (binary) {
-            print_binary_file_matches(dir_full_path);
         } else {
-            print_file_matches(dir_full_path, buf, buf_len, matches, matches_len);
+            matches_len = claim_results(matches_len);
+            if (matches_len == 0 || opts.quiet) {
+                /* Either --max-total-count was reached by another file or we're not printing anything */
+            } else if (opts.result_cb) {
+                if (binary) {
+                    callback_path(dir_full_path, matches_len);
+                } else {
+                    callback_file_matches(dir_full_path, buf, buf_len, matches, matches_len);
+                }
+            } else if (opts.json || opts.packed) {
+                if (binary) {
+                    print_records_binary_file_matches(&scratch->records, dir_full_path, tag, matches_len);
+                } else if (!records_ready) {
+                    print_records_file_matches(&scratch->records, dir_full_path, tag, buf, buf_len, matches, matches_len, pattern->invert_match);
+                }
+                fwrite(scratch->records.data, 1, scratch->records.len, out_fd);
+            } else if (binary) {
+                print_binary_file_matches(dir_full_path);
+            } else if (opts.replace) {
+                /* Inverted matches don't have groups */
+                print_file_replacements(dir_full_path, buf, buf_len, matches, matches_len,
+                                        pattern->invert_match ? NULL : scratch->captures, opts.replace_captures);
+            } else {
+                print_file_matches(dir_full_path, buf, buf_len, matches, matches_len);
+            }
+        }
+        if (scratch->query) {
+            query_output_end(scratch->query);
+        }
+        pthread_mutex_unlock(&cur_search->print_mtx);
+        stats_phase_end(STATS_PHASE_PRINT, phase_start);
+        __atomic_store_n(&cur_search->match_found, TRUE, __ATOMIC_RELAXED);
+        if (scratch->records.size > MAX_SCRATCH_READ_BUF) {
+            free(scratch->records.data);
+            memset(&scratch->records, 0, sizeof(strbuf_t));
+        }
+    } else if (opts.search_stream && opts.passthrough && !opts.quiet) {
+        fprintf(out_fd, "%s", buf);
+    } else if (opts.stream_match_line && opts.stream_line_num - opts.stream_match_line <= opts.after &&
+               !opts.print_filename_only && !opts.quiet && !opts.result_cb && !opts.json && !opts.packed && !opts.replace) {
+        /* This piece of the stream starts with context after the last one's match */
+        pthread_mutex_lock(&cur_search->print_mtx);
+        print_file_matches(dir_full_path, buf, buf_len, matches, 0);
+        pthread_mutex_unlock(&cur_search->print_mtx);
+    } else {
+        log_debug("No match in %s", dir_full_path);
+    }
+}
+
+/* Returns 1 if buf should be skipped for being binary, else what we know
+ * about it: 0 if it's text, -1 if we didn't check.
+ */
+static int check_binary(const char *buf, const size_t buf_len, const char *dir_full_path) {
+    int binary = -1; /* 1 = yes, 0 = no, -1 = don't know */
+    double phase_start;
+
+    if (opts.search_stream) {
+        binary = 0;
+    } else if (!opts.search_binary_files) {
+        phase_start = stats_phase_start();
+        binary = is_binary((const void *)buf, buf_len);
+        stats_phase_end(STATS_PHASE_BINARY, phase_start);
+        if (binary) {
+            log_debug("File %s is binary. Skipping...", dir_full_path);
+            stats_skip(STATS_SKIP_BINARY);
+        }
+    }
+    return binary;
+}
+
+/* Search buf with the pattern get_pattern() gives */
+static void search_buf_pattern(const char *buf, const size_t buf_len, const int binary,
+                               const char *dir_full_path) {
+    double phase_start;
+    search_scratch_t *scratch = get_scratch();
+    const pattern_t *pattern = get_pattern(scratch);
+    size_t matches_len = 0;
+    match_t *matches = scratch->matches;
+    size_t matches_size = scratch->matches_size;
+    size_t matches_spare;
+
+    if (pattern->invert_match) {
+        /* If we are going to invert the set of matches at the end, we will need
+         * one extra match struct, even if there are no matches at all. So make
+         * sure we have a nonempty array; and make sure we always have spare
+         * capacity for one extra.
+         */
+        realloc_matches(&matches, &matches_size, 0);
+        matches_spare = 1;
+    } else {
+        matches_spare = 0;
+    }
+
+    phase_start = stats_phase_start();
+    matches_len = search_range(buf, buf_len, 0, buf_len, &matches, &matches_size, matches_spare, dir_full_path);
+    stats_phase_end(STATS_PHASE_MATCH, phase_start);
+
+    report_matches(buf, buf_len, matches, matches_len, binary, dir_full_path);
+
+    if (matches_size > MAX_SCRATCH_MATCHES) {
+        free(matches);
+        matches = NULL;
+        matches_size = 0;
+        free(scratch->captures);
+        scratch->captures = NULL;
+        scratch->captures_size = 0;
+    }
+    scratch->matches = matches;
+    scratch->matches_size = matches_size;
+}
+
+/* Search buf once for each --queries query that wants it */
+static void search_buf_queries(const char *buf, const size_t buf_len, const int binary,
+                               const char *dir_full_path) {
+    search_scratch_t *scratch = get_scratch();
+    const pattern_t *prev_pattern = scratch->pattern;
+    size_t i;
+
+    scratch->file_counted = FALSE;
+    scratch->file_matched = FALSE;
+    for (i = 0; i < queries_len && !search_is_done(); i++) {
+        if (!query_wants_path(&queries[i], dir_full_path)) {
+            continue;
+        }
+        scratch->query = &queries[i];
+        scratch->pattern = &queries[i].pattern;
+        search_buf_pattern(buf, buf_len, binary, dir_full_path);
+    }
+    scratch->query = NULL;
+    scratch->pattern = prev_pattern;
+}
+
+void search_buf(const char *buf, const size_t buf_len,
+                const char *dir_full_path) {
+    int binary;
+
+    if (search_is_done()) {
+        return;
+    }
+
+    binary = check_binary(buf, buf_len, dir_full_path);
+    if (binary == 1) {
+        return;
+    }
+
+    if (queries_len > 0) {
+        search_buf_queries(buf, buf_len, binary, dir_full_path);
+    } else {
+        search_buf_pattern(buf, buf_len, binary, dir_full_path);
+    }
+}
+
+/* Big files get split into chunks that several workers search at once. The
+ * worker that loaded the file (the owner) queues one helper item per extra
+ * chunk at the front of the work queue. Everyone claims chunks until there
+ * are none left. The owner waits for the rest to finish, then merges and
+ * prints the matches in order.
+ */
+typedef struct {
+    size_t start;
+    size_t end;
+    match_t *matches;
+    size_t matches_len;
+    size_t matches_size;
+} file_chunk_t;
+
+struct split_file_t {
+    const char *buf;
+    size_t buf_len;
+    const char *path;
+    file_chunk_t *chunks;
+    size_t chunks_len;
+    size_t next_chunk; /* Next one to be claimed */
+    size_t chunks_done;
+    int refs; /* The owner plus helper items that haven't been taken off the queue */
+    pthread_mutex_t mtx;
+    pthread_cond_t all_done;
+};
+
+/* Chunks per worker, so that one slow chunk doesn't hold everyone up */
+#define SPLIT_CHUNKS_PER_WORKER 4
+#define MIN_SPLIT_CHUNK (1024 * 1024)
+
+static void split_release(split_file_t *split) {
+    size_t i;
+    int refs;
+
+    pthread_mutex_lock(&split->mtx);
+    refs = --split->refs;
+    pthread_mutex_unlock(&split->mtx);
+    if (refs > 0) {
+        return;
+    }
+    for (i = 0; i < split->chunks_len; i++) {
+        free(split->chunks[i].matches);
+    }
+    free(split->chunks);
+    pthread_mutex_destroy(&split->mtx);
+    pthread_cond_destroy(&split->all_done);
+    free(split);
+}
+
+/* Claim and search chunks until there are none left */
+static void search_chunks(split_file_t *split) {
+    file_chunk_t *chunk;
+    double phase_start;
+
+    while (TRUE) {
+        pthread_mutex_lock(&split->mtx);
+        if (split->next_chunk == split->chunks_len) {
+            pthread_mutex_unlock(&split->mtx);
+            return;
+        }
+        chunk = &split->chunks[split->next_chunk++];
+        pthread_mutex_unlock(&split->mtx);
+
+        if (!search_is_done()) {
+            phase_start = stats_phase_start();
+            chunk->matches_len = search_range(split->buf, split->buf_len, chunk->start, chunk->end,
+                                              &chunk->matches, &chunk->matches_size, 0, split->path);
+            stats_phase_end(STATS_PHASE_MATCH, phase_start);
+        }
+
+        pthread_mutex_lock(&split->mtx);
+        if (++split->chunks_done == split->chunks_len) {
+            pthread_cond_signal(&split->all_done);
+        }
+        pthread_mutex_unlock(&split->mtx);
+    }
+}
+
+/* Split buf into line-aligned chunks. Returns NULL if it isn't worth it. */
+static split_file_t *split_buf(const char *buf, const size_t buf_len, const char *path) {
+    split_file_t *split;
+    size_t chunk_len = buf_len / ((size_t)opts.workers * SPLIT_CHUNKS_PER_WORKER);
+    size_t start = 0;
+    size_t end;
+    const char *newline;
+
+    if (chunk_len < MIN_SPLIT_CHUNK) {
+        chunk_len = MIN_SPLIT_CHUNK;
+    }
+    if (buf_len < 2 * chunk_len) {
+        return NULL;
+    }
+
+    split = ag_calloc(1, sizeof(split_file_t));
+    split->buf = buf;
+    split->buf_len = buf_len;
+    split->path = path;
+    split->chunks = ag_calloc(buf_len / chunk_len + 1, sizeof(file_chunk_t));
+    while (start < buf_len) {
+        end = start + chunk_len;
+        if (end >= buf_len) {
+            end = buf_len;
+        } else {
+            /* Chunks start at the beginning of a line */
+            newline = memchr(buf + end, '\n', buf_len - end);
+            end = newline ? (size_t)(newline - buf) + 1 : buf_len;
+        }
+        split->chunks[split->chunks_len].start = start;
+        split->chunks[split->chunks_len].end = end;
+        split->chunks_len++;
+        start = end;
+    }
+    if (split->chunks_len < 2) {
+        free(split->chunks);
+        free(split);
+        return NULL;
+    }
+    split->refs = 1;
+    pthread_mutex_init(&split->mtx, NULL);
+    pthread_cond_init(&split->all_done, NULL);
+    return split;
+}
+
+/* Put the chunks' matches together as if we'd searched buf in one go */
+static size_t merge_chunks(split_file_t *split, match_t **matches_p, size_t *matches_size_p, const size_t matches_spare) {
+    file_chunk_t *chunk;
+    size_t matches_len = 0;
+    size_t prev_end = 0;
+    size_t i;
+    size_t j;
+
+    for (i = 0; i < split->chunks_len; i++) {
+        chunk = &split->chunks[i];
+        if (matches_len > 0 && chunk->matches_len > 0 && chunk->matches[0].start < prev_end) {
+            /* The previous match ran into this chunk. Carry on from where it
+             * ended, same as a single pass over the whole buffer would.
+             */
+            chunk->matches_len = prev_end < chunk->end ? search_range(split->buf, split->buf_len, prev_end, chunk->end, &chunk->matches, &chunk->matches_size, 0, split->path) : 0;
+        }
+        for (j = 0; j < chunk->matches_len; j++) {
+            if ((opts.max_matches_per_file > 0 && matches_len >= opts.max_matches_per_file) ||
+                total_limit_reached(get_pattern(get_scratch()), matches_len)) {
+                return matches_len;
+            }
+            realloc_matches(matches_p, matches_size_p, matches_len + matches_spare);
+            (*matches_p)[matches_len++] = chunk->matches[j];
+            prev_end = chunk->matches[j].end;
+        }
+    }
+    return matches_len;
+}
+
+/* The shard of the work queue this thread takes files from first */
+static int home_shard(void) {
+    int node = get_scratch()->node;
+    return node >= 0 && node < cur_search->shards_len ? node : 0;
+}
+
+/* Put a list of items at the front of our own shard. Idle workers on other
+ * nodes are woken too, since their shards are dry and they can steal these.
+ */
+static void work_queue_push_front(work_queue_t *head, work_queue_t *tail, const size_t len) {
+    work_queue_shard_t *shards = cur_search->shards;
+    work_queue_shard_t *shard = &shards[home_shard()];
+    int i;
+
+    pthread_mutex_lock(&shard->mtx);
+    tail->next = shard->head;
+    if (shard->tail == NULL) {
+        shard->tail = tail;
+    }
+    shard->head = head;
+    stats_queue_add(len);
+    pthread_mutex_unlock(&shard->mtx);
+    for (i = 0; i < cur_search->shards_len; i++) {
+        pthread_mutex_lock(&shards[i].mtx);
+        pthread_cond_broadcast(&shards[i].files_ready);
+        pthread_mutex_unlock(&shards[i].mtx);
+    }
+}
+
+/* Like search_buf(), but buf is searched by several workers if it's big enough */
+static void search_buf_split(const char *buf, const size_t buf_len, const char *dir_full_path) {
+    split_file_t *split;
+    work_queue_t *head = NULL;
+    work_queue_t *queue_item;
+    size_t helpers_len;
+    size_t i;
+    int binary;
+    double phase_start;
+
+    if (search_is_done()) {
+        return;
+    }
+
+    split = split_buf(buf, buf_len, dir_full_path);
+    if (split == NULL) {
+        search_buf(buf, buf_len, dir_full_path);
+        return;
+    }
+
+    binary = check_binary(buf, buf_len, dir_full_path);
+    if (binary == 1) {
+        split_release(split);
+        return;
+    }
+
+    log_debug("Splitting %s into %lu chunks", dir_full_path, (unsigned long)split->chunks_len);
+    helpers_len = split->chunks_len - 1;
+    if (helpers_len > (size_t)opts.workers - 1) {
+        /* Helpers keep claiming chunks, so there's no use in more of them than other workers */
+        helpers_len = opts.workers - 1;
+    }
+    split->refs += helpers_len;
+    for (i = 0; i < helpers_len; i++) {
+        queue_item = ag_calloc(1, sizeof(work_queue_t));
+        queue_item->split = split;
+        queue_item->next = head;
+        head = queue_item;
+    }
+    if (head != NULL) {
+        for (queue_item = head; queue_item->next != NULL; queue_item = queue_item->next) {
+        }
+        work_queue_push_front(head, queue_item, helpers_len);
+    }
+
+    search_chunks(split);
+
+    phase_start = stats_phase_start();
+    pthread_mutex_lock(&split->mtx);
+    while (split->chunks_done < split->chunks_len) {
+        pthread_cond_wait(&split->all_done, &split->mtx);
+    }
+    pthread_mutex_unlock(&split->mtx);
+    stats_phase_end(STATS_PHASE_IDLE, phase_start);
+
+    search_scratch_t *scratch = get_scratch();
+    match_t *matches = scratch->matches;
+    size_t matches_size = scratch->matches_size;
+    size_t matches_len;
+    size_t matches_spare = get_pattern(scratch)->invert_match ? 1 : 0;
+
+    realloc_matches(&matches, &matches_size, 0);
+    matches_len = merge_chunks(split, &matches, &matches_size, matches_spare);
+    split_release(split);
+
+    if (!search_is_done() || matches_len > 0) {
+        report_matches(buf, buf_len, matches, matches_len, binary, dir_full_path);
+    }
+
+    if (matches_size > MAX_SCRATCH_MATCHES) {
+        free(matches);
+        matches = NULL;
+        matches_size = 0;
+    }
+    scratch->matches = matches;
+    scratch->matches_size = matches_size;
+}
+
+/* read() a whole file into this thread's read buffer. For small files this is
+ * much cheaper than mmap() and munmap(), which also cause TLB shootdowns
+ * across all our threads. Returns the number of bytes read, or -1 on error.
+ */
+static ssize_t read_into_scratch(search_scratch_t *scratch, const int fd, const size_t f_len) {
+    size_t total = 0;
+    ssize_t rv;
+
+    if (scratch->read_buf_size < f_len + 1) {
+        /* No need to realloc(). The old contents are garbage anyway. */
+        free(scratch->read_buf);
+        scratch->read_buf_size = f_len + 1;
+        scratch->read_buf = ag_malloc(scratch->read_buf_size);
+    }
+    while (total < f_len) {
+        rv = read(fd, scratch->read_buf + total, f_len - total);
+        if (rv < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (rv == 0) {
+            /* File shrank since we fstat()ed it */
+            break;
+        }
+        total += rv;
+    }
+    /* Lets buf_getline() peek one past the end, just like with page-padded mmaps */
+    scratch->read_buf[total] = '\0';
+    return total;
+}
+
+/* Leave the matches that end past *cut to be searched again with more of
+ * the stream, and move *cut back to the start of the line they start on.
+ * Returns how many matches are left.
+ */
+static size_t stream_window_put_back(const char *buf, size_t *cut, const match_t matches[], size_t matches_len) {
+    size_t line_start;
+
+    if (matches_len > 0 && matches[matches_len - 1].end == *cut && *cut > matches[matches_len - 1].start) {
+        /* It ends with the newline before the cut. The line after it gets
+         * printed with it, so it waits for that line too.
+         */
+        (*cut)--;
+    }
+    while (matches_len > 0 && matches[matches_len - 1].end > *cut) {
+        matches_len--;
+        for (line_start = matches[matches_len].start; line_start > 0 && buf[line_start - 1] != '\n'; line_start--) {
+        }
+        if (line_start < *cut) {
+            *cut = line_start;
+        }
+    }
+    return matches_len;
+}
+
+/* Find the matches in buf[start, *cut) that more of the stream can't change,
+ * and move *cut back to the end of the last line they're on. If final is
+ * set, buf is all there is, and every match counts. Returns how many there
+ * are.
+ */
+static size_t search_stream_window_matches(const char *buf, const size_t start, size_t *cut, const int final,
+                                           match_t **matches_p, size_t *matches_size_p, const size_t matches_spare) {
+    search_scratch_t *scratch = get_scratch();
+    const pattern_t *pattern = get_pattern(scratch);
+    int offset_vector[3 * (MAX_REPLACE_GROUP + 1)];
+    const int offset_vector_len = 3 * (opts.replace_captures + 1);
+    const size_t buf_len = *cut;
+    size_t buf_offset = start;
+    size_t matches_len = 0;
+    match_t *matches = *matches_p;
+    size_t matches_size = *matches_size_p;
+    size_t line_start;
+    int rv;
+
+    while (buf_offset < buf_len) {
+        /* PCRE_PARTIAL_HARD says where a match that might continue past
+         * buf_len starts, instead of settling for a shorter one.
+         */
+        rv = pcre_exec(pattern->re, pattern->re_extra, buf, buf_len, buf_offset, final ? 0 : PCRE_PARTIAL_HARD,
+                       offset_vector, offset_vector_len);
+        if (rv == PCRE_ERROR_PARTIAL) {
+            for (line_start = offset_vector[0]; line_start > 0 && buf[line_start - 1] != '\n'; line_start--) {
+            }
+            *cut = line_start;
+            break;
+        }
+        if (rv < 0) {
+            break;
+        }
+        realloc_matches(&matches, &matches_size, matches_len + matches_spare);
+        matches[matches_len].start = offset_vector[0];
+        matches[matches_len].end = offset_vector[1];
+        if (opts.replace_captures) {
+            save_captures(scratch, matches_len, offset_vector, rv, 0);
+        }
+        matches_len++;
+        buf_offset = offset_vector[1];
+        if (offset_vector[0] == offset_vector[1]) {
+            ++buf_offset;
+        }
+        if (total_limit_reached(pattern, matches_len)) {
+            break;
+        }
+    }
+
+    /* Matches on the lines after the cut get searched again with them */
+    if (!final) {
+        matches_len = stream_window_put_back(buf, cut, matches, matches_len);
+    }
+
+    *matches_p = matches;
+    *matches_size_p = matches_size;
+    return matches_len;
+}
+
+/* Search a stream up to opts.stream_window bytes at a time, so that
+ * multiline regexes match like they do in files. Lines are printed and
+ * dropped from the window as soon as no more input can change their
+ * matches, or the context after them. The last few lines that weren't
+ * printed are kept at the start of the window as context for the next
+ * match. A match that doesn't fit in the window gets cut short at the end
+ * of a line, and a line that doesn't fit makes the window bigger.
+ */
+static void search_stream_window(FILE *stream, const char *path) {
+    search_scratch_t *scratch = get_scratch();
+    const pattern_t *pattern = get_pattern(scratch);
+    size_t window_size = opts.stream_window;
+    char *window = ag_malloc(window_size);
+    size_t window_len = 0;
+    size_t start = 0; /* Lines before this were searched already, and are only kept for context */
+    size_t line = 1;  /* Line number of window[0] */
+    size_t cut_line;
+    size_t printed_line; /* Last line printed as a match or context after one */
+    size_t keep;
+    size_t keep_lines;
+    int fd = fileno(stream);
+    int eof = FALSE;
+    int final;
+    ssize_t rv;
+    size_t cut;
+    size_t lines_end; /* End of the last whole line in the window */
+    size_t line_start;
+    size_t matches_len;
+    const match_t *last;
+
+    opts.stream_offset = 0;
+    opts.stream_match_line = 0;
+    while (!search_is_done() && !(eof && window_len == start)) {
+        if (!eof) {
+            if (window_len == window_size) {
+                /* Context and a line too long for what's left of the window fill it */
+                window_size *= 2;
+                window = ag_realloc(window, window_size);
+            }
+            /* read() instead of fread(), so that tail -f | ag doesn't wait for a whole window */
+            rv = read(fd, window + window_len, window_size - window_len);
+            if (rv < 0 && errno == EINTR) {
+                continue;
+            }
+            if (rv < 0) {
+                log_err("Error reading %s: %s", path[0] ? path : "stdin", strerror(errno));
+            }
+            if (rv <= 0) {
+                eof = TRUE;
+            } else {
+                window_len += rv;
+            }
+        }
+
+        /* Search whole lines, unless there's no room left to finish one */
+        final = eof;
+        cut = window_len;
+        if (!eof) {
+            for (cut = window_len; cut > start && window[cut - 1] != '\n'; cut--) {
+            }
+            if (cut <= start) {
+                /* Wait for the end of the line */
+                continue;
+            }
+        }
+        lines_end = cut;
+
+        if (pattern->invert_match) {
+            realloc_matches(&scratch->matches, &scratch->matches_size, 0);
+        }
+        matches_len = search_stream_window_matches(window, start, &cut, final, &scratch->matches, &scratch->matches_size,
+                                                   pattern->invert_match ? 1 : 0);
+        if (!final && matches_len > 0 && opts.after > 0 && !pattern->invert_match) {
+            /* Wait for the lines of context after the last match, so they're printed with it */
+            last = &scratch->matches[matches_len - 1];
+            if (count_lines(window + last->end, cut - last->end) <= opts.after) {
+                for (line_start = last->start; line_start > start && window[line_start - 1] != '\n'; line_start--) {
+                }
+                cut = line_start;
+                matches_len = stream_window_put_back(window, &cut, scratch->matches, matches_len);
+            }
+        }
+        if (cut <= start && window_len == window_size) {
+            /* A match might go on past the window. Settle for the lines that fit. */
+            cut = lines_end;
+            matches_len = search_stream_window_matches(window, start, &cut, TRUE, &scratch->matches, &scratch->matches_size,
+                                                       pattern->invert_match ? 1 : 0);
+        }
+        if (cut <= start) {
+            continue;
+        }
+        if (pattern->invert_match && start > 0) {
+            /* The lines kept for context matched when they were searched, so
+             * they aren't inverted matches now.
+             */
+            realloc_matches(&scratch->matches, &scratch->matches_size, matches_len + 1);
+            memmove(scratch->matches + 1, scratch->matches, matches_len * sizeof(match_t));
+            scratch->matches[0].start = 0;
+            scratch->matches[0].end = start - 1;
+            matches_len++;
+        }
+
+        opts.stream_line_num = line;
+        opts.stream_continues = !eof;
+        report_matches(window, cut, scratch->matches, matches_len, 0, path);
+        cut_line = line + count_lines(window, cut);
+        printed_line = opts.stream_match_line ? opts.stream_match_line + opts.after : 0;
+        if (printed_line >= cut_line) {
+            printed_line = cut_line - 1;
+        }
+
+        /* Keep the lines before the cut that weren't printed, as context
+         * before the next match.
+         */
+        keep = cut;
+        keep_lines = 0;
+        if (window[cut - 1] == '\n') {
+            keep_lines = cut_line - 1 - printed_line;
+            if (keep_lines > opts.before) {
+                keep_lines = opts.before;
+            }
+            if (keep_lines > cut_line - line) {
+                keep_lines = cut_line - line;
+            }
+            for (; keep_lines > 0; keep_lines--) {
+                for (keep--; keep > 0 && window[keep - 1] != '\n'; keep--) {
+                }
+            }
+        }
+        line += count_lines(window, keep);
+        opts.stream_offset += keep;
+        memmove(window, window + keep, window_len - keep);
+        window_len -= keep;
+        start = cut - keep;
+    }
+    opts.stream_line_num = 0;
+    opts.stream_offset = 0;
+    opts.stream_continues = FALSE;
+    opts.stream_match_line = 0;
+
+    free(window);
+}
+
+void search_stream(FILE *stream, const char *path) {
+    char *line = NULL;
+    ssize_t line_len = 0;
+    size_t line_cap = 0;
+    size_t i;
+    const pattern_t *pattern = get_pattern(get_scratch());
+
+    /* Literals can't span lines, and --passthrough prints each line that didn't match */
+    if (opts.stream_window > 0 && opts.multiline && !pattern->literal && !opts.passthrough && queries_len == 0) {
+        search_stream_window(stream, path);
+        return;
+    }
+
+    opts.stream_offset = 0;
+    for (i = 1; !search_is_done() && (line_len = getline(&line, &line_cap, stream)) > 0; i++) {
+        opts.stream_line_num = i;
+        search_buf(line, line_len, path);
+        opts.stream_offset += line_len;
+    }
+    opts.stream_line_num = 0;
+    opts.stream_offset = 0;
+
+    free(line);
+}
+
+/* Returns TRUE or FALSE if we've sniffed this file before and know whether
+ * it's one of the types searched, -1 if we have to read it to find out.
+ */
+int sniffed_type_wanted(const sniff_key_t *key) {
+    sniff_cache_t *item;
+    int wanted = -1;
+
+    pthread_mutex_lock(&sniff_cache_mtx);
+    HASH_FIND(hh, sniff_cache, key, sizeof(sniff_key_t), item);
+    if (item != NULL) {
+        wanted = item->lang >= 0 && opts.lang_selected[item->lang];
+    }
+    pthread_mutex_unlock(&sniff_cache_mtx);
+    return wanted;
+}
+
+/* Check the shebang or modeline in the first bytes of buf, which is_binary()
+ * looks at anyway. Returns whether the file is one of the types searched.
+ */
+static int sniff_file(const char *buf, const size_t f_len, const sniff_key_t *key, const char *path) {
+    sniff_cache_t *item = ag_malloc(sizeof(sniff_cache_t));
+    sniff_cache_t *found;
+    int lang = sniff_file_type(buf, f_len);
+
+    memcpy(&item->key, key, sizeof(sniff_key_t));
+    item->lang = lang;
+    pthread_mutex_lock(&sniff_cache_mtx);
+    /* Another path to the same file may have beaten us to it */
+    HASH_FIND(hh, sniff_cache, key, sizeof(sniff_key_t), found);
+    if (found == NULL) {
+        HASH_ADD(hh, sniff_cache, key, sizeof(sniff_key_t), item);
+    } else {
+        free(item);
+    }
+    pthread_mutex_unlock(&sniff_cache_mtx);
+
+    if (lang < 0 || !opts.lang_selected[lang]) {
+        log_debug("Skipping %s: not one of the file types searched.", path);
+        return FALSE;
+    }
+    log_debug("%s looks like %s", path, langs[lang].name);
+    return TRUE;
+}
+
+/* Search a file that has already been loaded into memory, decompressing it
+ * first if need be. If sniff_key is set, only search it if sniff_file() says so.
+ */
+void search_file_buf(const char *buf, const size_t f_len, const char *file_full_path, const sniff_key_t *sniff_key) {
+    double phase_start;
+
+    if (sniff_key != NULL && !sniff_file(buf, f_len, sniff_key, file_full_path)) {
+        return;
+    }
+
+    if (opts.search_zip_files) {
+        ag_compression_type zip_type = is_zipped(buf, f_len);
+        if (zip_type != AG_NO_COMPRESSION) {
+            int _buf_len = (int)f_len;
+            phase_start = stats_phase_start();
+            char *_buf = decompress(zip_type, buf, f_len, file_full_path, &_buf_len);
+            stats_phase_end(STATS_PHASE_DECOMPRESS, phase_start);
+            if (_buf == NULL || _buf_len == 0) {
+                log_err("Cannot decompress zipped file %s", file_full_path);
+                stats_skip(STATS_SKIP_ERROR);
+                return;
+            }
+            search_buf(_buf, _buf_len, file_full_path);
+            free(_buf);
+            return;
         }
-        pthread_mutex_unlock(&print_mtx);
-        opts.match_found = 1;
-    } else if (opts.search_stream && opts.passthrough) {
-        fprintf(out_fd, "%s", buf);
-    } else {
-        log_debug("No match in %s", dir_full_path);
     }
 
-    if (matches_size > 0) {
-        free(matches);
-    }
-}
-
-/* TODO: this will only match single lines. multi-line regexes silently don't match */
-void search_stream(FILE *stream, const char *path) {
-    char *line = NULL;
-    ssize_t line_len = 0;
-    size_t line_cap = 0;
-    size_t i;
-
-    for (i = 1; (line_len = getline(&line, &line_cap, stream)) > 0; i++) {
-        opts.stream_line_num = i;
-        search_buf(line, line_len, path);
+    /* Each query would need its own split, so --queries searches big files in one go */
+    if (opts.split_size > 0 && f_len >= (size_t)opts.split_size && opts.workers > 1 && queries_len == 0) {
+        search_buf_split(buf, f_len, file_full_path);
+    } else {
+        search_buf(buf, f_len, file_full_path);
     }
-
-    free(line);
 }
 
-void search_file(const char *file_full_path) {
+void search_file(const char *file_full_path, const int sniff) {
     int fd;
     off_t f_len = 0;
     char *buf = NULL;
     struct stat statbuf;
     int rv = 0;
     FILE *fp = NULL;
+    double phase_start;
+    double file_start;
+    double read_start;
+    int mapped = FALSE;
+    search_scratch_t *scratch = NULL;
+    sniff_key_t sniff_key;
+    int sniffed = -1;
+
+    if (search_is_done()) {
+        log_debug("Skipping %s: search is already done", file_full_path);
+        return;
+    }
 
-    fd = open(file_full_path, O_RDONLY);
+    file_start = stats_phase_start();
+    phase_start = file_start;
+    fd = open(file_full_path, O_RDONLY | O_BINARY);
     if (fd < 0) {
         /* XXXX: strerror is not thread-safe */
         log_err("Skipping %s: Error opening file: %s", file_full_path, strerror(errno));
+        stats_skip(STATS_SKIP_ERROR);
         goto cleanup;
     }
 
     rv = fstat(fd, &statbuf);
     if (rv != 0) {
         log_err("Skipping %s: Error fstat()ing file.", file_full_path);
+        stats_skip(STATS_SKIP_ERROR);
         goto cleanup;
     }
 
@@ -244,9 +1369,24 @@ void search_file(const char *file_full_path) {
 
     if ((statbuf.st_mode & S_IFMT) == 0) {
         log_err("Skipping %s: Mode %u is not a file.", file_full_path, statbuf.st_mode);
+        stats_skip(STATS_SKIP_ERROR);
         goto cleanup;
     }
 
+    if (sniff) {
+        memset(&sniff_key, 0, sizeof(sniff_key_t));
+        sniff_key.dev = statbuf.st_dev;
+        sniff_key.ino = statbuf.st_ino;
+        sniff_key.mtime = statbuf.st_mtime;
+        sniff_key.size = statbuf.st_size;
+        sniffed = sniffed_type_wanted(&sniff_key);
+        /* Reading a named pipe's first line would eat it */
+        if (sniffed == FALSE || (statbuf.st_mode & S_IFIFO)) {
+            log_debug("Skipping %s: not one of the file types searched.", file_full_path);
+            goto cleanup;
+        }
+    }
+
     if (statbuf.st_mode & S_IFIFO) {
         log_debug("%s is a named pipe. stream searching", file_full_path);
         fp = fdopen(fd, "r");
@@ -259,102 +1399,377 @@ void search_file(const char *file_full_path) {
 
     if (f_len == 0) {
         log_debug("Skipping %s: file is empty.", file_full_path);
+#ifdef HAVE_SYS_INOTIFY_H
+        if (opts.watch) {
+            watch_file(file_full_path, &statbuf, NULL, 0);
+        }
+#endif
         goto cleanup;
     }
 
     if (!opts.literal && f_len > INT_MAX) {
         log_err("Skipping %s: pcre_exec() can't handle files larger than %i bytes.", file_full_path, INT_MAX);
+        stats_skip(STATS_SKIP_TOO_BIG);
         goto cleanup;
     }
 
+    read_start = stats_phase_start();
+    if (opts.mmap_threshold < 0 || f_len < opts.mmap_threshold) {
+        ssize_t bytes_read;
+        scratch = get_scratch();
+        bytes_read = read_into_scratch(scratch, fd, (size_t)f_len);
+        if (bytes_read < 0) {
+            log_err("File %s failed to load: %s.", file_full_path, strerror(errno));
+            stats_skip(STATS_SKIP_ERROR);
+            goto cleanup;
+        }
+        if (bytes_read == 0) {
+            log_debug("Skipping %s: file is empty.", file_full_path);
+            goto cleanup;
+        }
+        f_len = bytes_read;
+        buf = scratch->read_buf;
+    } else {
 #ifdef _WIN32
-    {
-        HANDLE hmmap = CreateFileMapping(
-            (HANDLE)_get_osfhandle(fd), 0, PAGE_READONLY, 0, f_len, NULL);
-        buf = (char *)MapViewOfFile(hmmap, FILE_SHARE_READ, 0, 0, f_len);
-        if (hmmap != NULL)
-            CloseHandle(hmmap);
-    }
-    if (buf == NULL) {
-        FormatMessageA(
-            FORMAT_MESSAGE_ALLOCATE_BUFFER |
-                FORMAT_MESSAGE_FROM_SYSTEM |
-                FORMAT_MESSAGE_IGNORE_INSERTS,
-            NULL, GetLastError(), 0, (void *)&buf, 0, NULL);
-        log_err("File %s failed to load: %s.", file_full_path, buf);
-        LocalFree((void *)buf);
-        goto cleanup;
-    }
+        {
+            HANDLE hmmap = CreateFileMapping(
+                (HANDLE)_get_osfhandle(fd), 0, PAGE_READONLY, 0, f_len, NULL);
+            buf = (char *)MapViewOfFile(hmmap, FILE_SHARE_READ, 0, 0, f_len);
+            if (hmmap != NULL)
+                CloseHandle(hmmap);
+        }
+        if (buf == NULL) {
+            FormatMessageA(
+                FORMAT_MESSAGE_ALLOCATE_BUFFER |
+                    FORMAT_MESSAGE_FROM_SYSTEM |
+                    FORMAT_MESSAGE_IGNORE_INSERTS,
+                NULL, GetLastError(), 0, (void *)&buf, 0, NULL);
+            log_err("File %s failed to load: %s.", file_full_path, buf);
+            LocalFree((void *)buf);
+            buf = NULL;
+            stats_skip(STATS_SKIP_ERROR);
+            goto cleanup;
+        }
 #else
-    buf = mmap(0, f_len, PROT_READ, MAP_SHARED, fd, 0);
-    if (buf == MAP_FAILED) {
-        log_err("File %s failed to load: %s.", file_full_path, strerror(errno));
-        goto cleanup;
-    }
+        buf = mmap(0, f_len, PROT_READ, MAP_SHARED, fd, 0);
+        if (buf == MAP_FAILED) {
+            log_err("File %s failed to load: %s.", file_full_path, strerror(errno));
+            buf = NULL;
+            stats_skip(STATS_SKIP_ERROR);
+            goto cleanup;
+        }
 #if HAVE_MADVISE
-    madvise(buf, f_len, MADV_SEQUENTIAL);
+        madvise(buf, f_len, MADV_SEQUENTIAL);
 #elif HAVE_POSIX_FADVISE
-    posix_fadvise(fd, 0, f_len, POSIX_MADV_SEQUENTIAL);
+        posix_fadvise(fd, 0, f_len, POSIX_MADV_SEQUENTIAL);
 #endif
 #endif
+        mapped = TRUE;
+    }
+    trace_span("read", read_start, NULL);
+    stats_phase_end(STATS_PHASE_OPEN, phase_start);
 
-    if (opts.search_zip_files) {
-        ag_compression_type zip_type = is_zipped(buf, f_len);
-        if (zip_type != AG_NO_COMPRESSION) {
-            int _buf_len = (int)f_len;
-            char *_buf = decompress(zip_type, buf, f_len, file_full_path, &_buf_len);
-            if (_buf == NULL || _buf_len == 0) {
-                log_err("Cannot decompress zipped file %s", file_full_path);
-                goto cleanup;
-            }
-            search_buf(_buf, _buf_len, file_full_path);
-            free(_buf);
-            goto cleanup;
-        }
+#ifdef HAVE_SYS_INOTIFY_H
+    if (opts.watch) {
+        watch_file(file_full_path, &statbuf, buf, f_len);
     }
+#endif
 
-    search_buf(buf, f_len, file_full_path);
+    search_file_buf(buf, f_len, file_full_path, sniff && sniffed == -1 ? &sniff_key : NULL);
 
 cleanup:
 
     if (buf != NULL) {
+        stats_file_done(file_full_path, (long)f_len, file_start);
+    }
+    if (mapped) {
 #ifdef _WIN32
         UnmapViewOfFile(buf);
 #else
         munmap(buf, f_len);
 #endif
+    } else if (scratch != NULL && scratch->read_buf_size > MAX_SCRATCH_READ_BUF) {
+        free(scratch->read_buf);
+        scratch->read_buf = NULL;
+        scratch->read_buf_size = 0;
     }
     if (fd != -1) {
         close(fd);
     }
 }
 
-void *search_file_worker(void *i) {
+/* Deal files out to the shards in turn. A worker sleeping on its dry shard is
+ * woken by the next file dealt to it, or once the walk is done, and takes
+ * whatever is left on other nodes then.
+ */
+void work_queue_push(work_queue_t *queue_item) {
+    work_queue_shard_t *shard = &cur_search->shards[cur_search->next_shard];
+
+    cur_search->next_shard = (cur_search->next_shard + 1) % cur_search->shards_len;
+    queue_item->next = NULL;
+    pthread_mutex_lock(&shard->mtx);
+    if (shard->tail == NULL) {
+        shard->head = queue_item;
+    } else {
+        shard->tail->next = queue_item;
+    }
+    shard->tail = queue_item;
+    stats_queue_add(1);
+    pthread_cond_signal(&shard->files_ready);
+    pthread_mutex_unlock(&shard->mtx);
+}
+
+void work_queue_done_adding(void) {
+    int i;
+
+    for (i = 0; i < cur_search->shards_len; i++) {
+        pthread_mutex_lock(&cur_search->shards[i].mtx);
+    }
+    cur_search->done_adding_files = TRUE;
+    for (i = 0; i < cur_search->shards_len; i++) {
+        pthread_cond_broadcast(&cur_search->shards[i].files_ready);
+        pthread_mutex_unlock(&cur_search->shards[i].mtx);
+    }
+}
+
+static work_queue_t *shard_pop(work_queue_shard_t *shard) {
     work_queue_t *queue_item;
-    int worker_id = *(int *)i;
 
-    log_debug("Worker %i started", worker_id);
-    while (TRUE) {
-        pthread_mutex_lock(&work_queue_mtx);
-        while (work_queue == NULL) {
-            if (done_adding_files) {
-                pthread_mutex_unlock(&work_queue_mtx);
-                log_debug("Worker %i finished.", worker_id);
-                pthread_exit(NULL);
+    pthread_mutex_lock(&shard->mtx);
+    queue_item = shard->head;
+    if (queue_item != NULL) {
+        shard->head = queue_item->next;
+        if (shard->head == NULL) {
+            shard->tail = NULL;
+        }
+        stats_queue_add(-1);
+    }
+    pthread_mutex_unlock(&shard->mtx);
+    return queue_item;
+}
+
+/* Take the next path off the work queue, from our own node's shard if we can.
+ * If every shard is empty, wait for search_dir() to add more unless wait is
+ * FALSE. Returns NULL once there's nothing (left) to take. The caller frees
+ * the returned item.
+ */
+work_queue_t *work_queue_pop(const int wait) {
+    work_queue_shard_t *shards = cur_search->shards;
+    const int shards_len = cur_search->shards_len;
+    work_queue_t *queue_item = NULL;
+    work_queue_shard_t *shard;
+    const int home = home_shard();
+    double idle_start = stats_phase_start();
+    int i;
+
+    for (;;) {
+        for (i = 0; i < shards_len && queue_item == NULL; i++) {
+            queue_item = shard_pop(&shards[(home + i) % shards_len]);
+        }
+        if (queue_item != NULL) {
+            if (i > 1) {
+                log_debug("Took %s from NUMA node %i's shard", queue_item->path, (home + i - 1) % shards_len);
+            }
+            break;
+        }
+        if (!wait) {
+            break;
+        }
+        shard = &shards[home];
+        pthread_mutex_lock(&shard->mtx);
+        if (shard->head == NULL) {
+            if (cur_search->done_adding_files) {
+                /* We just looked at the other shards. Nothing is added to them now. */
+                pthread_mutex_unlock(&shard->mtx);
+                break;
+            }
+            pthread_cond_wait(&shard->files_ready, &shard->mtx);
+        }
+        pthread_mutex_unlock(&shard->mtx);
+    }
+    stats_phase_end(STATS_PHASE_IDLE, idle_start);
+    return queue_item;
+}
+
+/* Whether there's nothing left to take off the work queue, and never will be */
+int work_queue_finished(void) {
+    int finished = TRUE;
+    int i;
+
+    for (i = 0; i < cur_search->shards_len && finished; i++) {
+        pthread_mutex_lock(&cur_search->shards[i].mtx);
+        finished = cur_search->shards[i].head == NULL && cur_search->done_adding_files;
+        pthread_mutex_unlock(&cur_search->shards[i].mtx);
+    }
+    return finished;
+}
+
+#ifdef HAVE_POSIX_FADVISE
+/* Ask the kernel to start reading the next opts.prefetch_len files queued on
+ * each shard. Only the first MAX_PREFETCH_BYTES of each file are hinted. Past
+ * that, readahead within the file does the job.
+ */
+static void prefetch_queued_files(void) {
+    work_queue_shard_t *shards = cur_search->shards;
+    char *paths[MAX_PREFETCH_LEN];
+    size_t paths_len;
+    work_queue_t *queue_item;
+    double phase_start;
+    size_t i;
+    int shard_i;
+    int fd;
+
+    for (shard_i = 0; shard_i < cur_search->shards_len; shard_i++) {
+        /* Copy the paths so we don't hold the lock during the syscalls. Items
+         * can be taken and freed by workers at any time.
+         */
+        phase_start = stats_phase_start();
+        paths_len = 0;
+        pthread_mutex_lock(&shards[shard_i].mtx);
+        queue_item = shards[shard_i].head;
+        for (i = 0; queue_item != NULL && i < opts.prefetch_len; i++) {
+            if (!queue_item->prefetched) {
+                queue_item->prefetched = TRUE;
+                paths[paths_len++] = ag_strdup(queue_item->path);
+            }
+            queue_item = queue_item->next;
+        }
+        pthread_mutex_unlock(&shards[shard_i].mtx);
+
+        for (i = 0; i < paths_len; i++) {
+            /* O_NONBLOCK so a named pipe doesn't block us waiting for a writer */
+            fd = open(paths[i], O_RDONLY | O_NONBLOCK);
+            if (fd != -1) {
+                posix_fadvise(fd, 0, MAX_PREFETCH_BYTES, POSIX_FADV_WILLNEED);
+                close(fd);
             }
-            pthread_cond_wait(&files_ready, &work_queue_mtx);
+            free(paths[i]);
+        }
+        stats_phase_end(STATS_PHASE_PREFETCH, phase_start);
+    }
+}
+
+/* The open() for each hinted file can wait on disk for its inode, so workers
+ * leave the hints to this thread. It runs each time a worker takes a file,
+ * while that worker reads and searches it.
+ */
+static void *prefetch_worker(void *ptr) {
+    search_t *search = ptr;
+
+    cur_search = search;
+    opts = search->opts;
+    out_fd = search->out_fd;
+    pthread_mutex_lock(&search->prefetch_mtx);
+    while (search->prefetch_running) {
+        if (!search->prefetch_wanted) {
+            pthread_cond_wait(&search->prefetch_wanted_cond, &search->prefetch_mtx);
+            continue;
+        }
+        search->prefetch_wanted = FALSE;
+        pthread_mutex_unlock(&search->prefetch_mtx);
+        prefetch_queued_files();
+        pthread_mutex_lock(&search->prefetch_mtx);
+    }
+    pthread_mutex_unlock(&search->prefetch_mtx);
+    return NULL;
+}
+#endif
+
+int prefetch_start(void) {
+#ifdef HAVE_POSIX_FADVISE
+    int rv;
+
+    cur_search->prefetch_wanted = FALSE;
+    cur_search->prefetch_running = TRUE;
+    rv = pthread_create(&cur_search->prefetch_thread, NULL, &prefetch_worker, cur_search);
+    if (rv != 0) {
+        cur_search->prefetch_running = FALSE;
+    }
+    return rv;
+#else
+    return 0;
+#endif
+}
+
+/* Call after the workers are done */
+void prefetch_stop(void) {
+#ifdef HAVE_POSIX_FADVISE
+    if (!cur_search->prefetch_running) {
+        return;
+    }
+    pthread_mutex_lock(&cur_search->prefetch_mtx);
+    cur_search->prefetch_running = FALSE;
+    pthread_cond_signal(&cur_search->prefetch_wanted_cond);
+    pthread_mutex_unlock(&cur_search->prefetch_mtx);
+    pthread_join(cur_search->prefetch_thread, NULL);
+#endif
+}
+
+static void prefetch_wake(void) {
+#ifdef HAVE_POSIX_FADVISE
+    pthread_mutex_lock(&cur_search->prefetch_mtx);
+    cur_search->prefetch_wanted = TRUE;
+    pthread_cond_signal(&cur_search->prefetch_wanted_cond);
+    pthread_mutex_unlock(&cur_search->prefetch_mtx);
+#endif
+}
+
+/* Search whatever a worker took off the work queue, then free it */
+void search_queue_item(work_queue_t *queue_item) {
+    if (queue_item->split != NULL) {
+        /* Help search a big file. If the search is done, this is quick. */
+        search_chunks(queue_item->split);
+        split_release(queue_item->split);
+    } else if (!search_is_done()) {
+        /* Once the search is done, just drain the queue */
+        if (opts.prefetch_len > 0) {
+            prefetch_wake();
         }
-        queue_item = work_queue;
-        work_queue = work_queue->next;
-        if (work_queue == NULL) {
-            work_queue_tail = NULL;
+        search_file(queue_item->path, queue_item->sniff);
+    }
+    free(queue_item);
+}
+
+void *search_file_worker(void *i) {
+    work_queue_t *queue_item;
+    const worker_t *worker = i;
+    int worker_id = worker->id;
+
+    cur_search = worker->search;
+    opts = cur_search->opts;
+    out_fd = cur_search->out_fd;
+
+#if defined(HAVE_PTHREAD_SETAFFINITY_NP) && defined(USE_CPU_SET)
+    if (worker->cpu >= 0) {
+        /* Pin ourselves before allocating anything, so our buffers are on our node */
+        cpu_set_t cpu_set;
+        int rv;
+        CPU_ZERO(&cpu_set);
+        CPU_SET(worker->cpu, &cpu_set);
+        rv = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set);
+        if (rv) {
+            log_err("Error in pthread_setaffinity_np(): %s", strerror(rv));
+            log_err("Performance may be affected. Use --noaffinity to suppress this message.");
+        } else {
+            log_debug("Thread %i set to CPU %i", worker_id, worker->cpu);
         }
-        pthread_mutex_unlock(&work_queue_mtx);
+    }
+#endif
+    get_scratch()->node = worker->node;
+    trace_thread_name("worker", worker_id);
 
-        search_file(queue_item->path);
-        free(queue_item->path);
-        free(queue_item);
+    log_debug("Worker %i started", worker_id);
+#ifdef USE_IO_URING
+    if (opts.io_uring_depth > 0 && search_files_uring(worker_id) == 0) {
+        log_debug("Worker %i finished.", worker_id);
+        pthread_exit(NULL);
+    }
+#endif
+    while ((queue_item = work_queue_pop(TRUE)) != NULL) {
+        search_queue_item(queue_item);
     }
+    log_debug("Worker %i finished.", worker_id);
+    pthread_exit(NULL);
 }
 
 static int check_symloop_enter(const char *path, dirkey_t *outkey) {
@@ -378,14 +1793,14 @@ static int check_symloop_enter(const char *path, dirkey_t *outkey) {
     outkey->dev = buf.st_dev;
     outkey->ino = buf.st_ino;
 
-    HASH_FIND(hh, symhash, outkey, sizeof(dirkey_t), item_found);
+    HASH_FIND(hh, cur_search->symhash, outkey, sizeof(dirkey_t), item_found);
     if (item_found) {
         return SYMLOOP_LOOP;
     }
 
     new_item = (symdir_t *)ag_malloc(sizeof(symdir_t));
     memcpy(&new_item->key, outkey, sizeof(dirkey_t));
-    HASH_ADD(hh, symhash, key, sizeof(dirkey_t), new_item);
+    HASH_ADD(hh, cur_search->symhash, key, sizeof(dirkey_t), new_item);
     return SYMLOOP_OK;
 #endif
 }
@@ -400,18 +1815,264 @@ static int check_symloop_leave(dirkey_t *dirkey) {
         return SYMLOOP_ERROR;
     }
 
-    HASH_FIND(hh, symhash, dirkey, sizeof(dirkey_t), item_found);
+    HASH_FIND(hh, cur_search->symhash, dirkey, sizeof(dirkey_t), item_found);
     if (!item_found) {
         log_err("item not found! weird stuff...\n");
         return SYMLOOP_ERROR;
     }
 
-    HASH_DELETE(hh, symhash, item_found);
+    HASH_DELETE(hh, cur_search->symhash, item_found);
     free(item_found);
     return SYMLOOP_OK;
 #endif
 }
 
+static int compare_dirent_ino(const void *a, const void *b) {
+    const struct dirent *x = *(struct dirent *const *)a;
+    const struct dirent *y = *(struct dirent *const *)b;
+
+    if (x->d_ino == y->d_ino) {
+        return 0;
+    }
+    return x->d_ino < y->d_ino ? -1 : 1;
+}
+
+typedef struct {
+    struct dirent *entry;
+    int has_key;
+    unsigned long long key;
+} dir_sort_key_t;
+
+/* Entries with a key first, in ascending order. The rest by inode. */
+static int compare_dir_sort_key(const void *a, const void *b) {
+    const dir_sort_key_t *x = a;
+    const dir_sort_key_t *y = b;
+
+    if (x->has_key != y->has_key) {
+        return y->has_key - x->has_key;
+    }
+    if (!x->has_key) {
+        return compare_dirent_ino(&x->entry, &y->entry);
+    }
+    if (x->key == y->key) {
+        return 0;
+    }
+    return x->key < y->key ? -1 : 1;
+}
+
+#ifdef HAVE_LINUX_FIEMAP_H
+/* Returns 0 and sets physical to the byte offset on disk of the file's first extent.
+ * Returns -1 if the file has no extents or the filesystem won't tell us.
+ */
+static int first_extent(const char *path, unsigned long long *physical) {
+    union {
+        struct fiemap map;
+        char buf[sizeof(struct fiemap) + sizeof(struct fiemap_extent)];
+    } fm;
+    int rv = -1;
+    /* O_NONBLOCK so a named pipe doesn't block us waiting for a writer */
+    int fd = open(path, O_RDONLY | O_NONBLOCK);
+
+    if (fd == -1) {
+        return -1;
+    }
+    memset(&fm, 0, sizeof(fm));
+    fm.map.fm_length = FIEMAP_MAX_OFFSET;
+    fm.map.fm_extent_count = 1;
+    /* Data that hasn't been written out yet has no location */
+    if (ioctl(fd, FS_IOC_FIEMAP, &fm.map) == 0 && fm.map.fm_mapped_extents > 0 &&
+        !(fm.map.fm_extents[0].fe_flags & FIEMAP_EXTENT_UNKNOWN)) {
+        *physical = fm.map.fm_extents[0].fe_physical;
+        rv = 0;
+    }
+    close(fd);
+    return rv;
+}
+#endif
+
+/* Put dir's full path in *dir_full_path, which starts with its directory's
+ * path_len bytes of path and a slash. Returns how long it is.
+ */
+static size_t dir_entry_path(char **dir_full_path, size_t *dir_full_path_size, const size_t path_len,
+                             const struct dirent *dir) {
+    size_t name_len;
+
+#ifdef HAVE_DIRENT_DNAMLEN
+    name_len = dir->d_namlen;
+#else
+    name_len = strlen(dir->d_name);
+#endif
+    if (path_len + name_len + 2 > *dir_full_path_size) {
+        *dir_full_path_size = path_len + name_len + 2;
+        *dir_full_path = ag_realloc(*dir_full_path, *dir_full_path_size);
+    }
+    memcpy(*dir_full_path + path_len + 1, dir->d_name, name_len + 1);
+    return path_len + 1 + name_len;
+}
+
+/* Reorder a directory's entries so that files get queued (and subdirectories
+ * walked) roughly in the order they sit on disk, or biggest first. On spinning
+ * disks and cold caches, disk order saves a lot of seeking compared to readdir
+ * order. Starting big files first keeps a big file found late from leaving
+ * one worker busy long after the rest are done.
+ */
+static void sort_dir_entries(char **dir_full_path, size_t *dir_full_path_size, const size_t path_len,
+                             struct dirent **dir_list, const int results) {
+    dir_sort_key_t *keys;
+    struct stat s;
+    int i;
+
+    if (opts.dispatch_order == DISPATCH_INODE) {
+        qsort(dir_list, results, sizeof(struct dirent *), &compare_dirent_ino);
+        return;
+    }
+
+    keys = ag_malloc(results * sizeof(dir_sort_key_t));
+    for (i = 0; i < results; i++) {
+        keys[i].entry = dir_list[i];
+        keys[i].has_key = FALSE;
+        dir_entry_path(dir_full_path, dir_full_path_size, path_len, dir_list[i]);
+        if (opts.dispatch_order == DISPATCH_SIZE) {
+            /* Directories and other non-files go last */
+            if (stat(*dir_full_path, &s) == 0 && S_ISREG(s.st_mode)) {
+                /* Biggest first */
+                keys[i].key = ~(unsigned long long)s.st_size;
+                keys[i].has_key = TRUE;
+            }
+        }
+#ifdef HAVE_LINUX_FIEMAP_H
+        else if (opts.dispatch_order == DISPATCH_EXTENT) {
+            keys[i].has_key = first_extent(*dir_full_path, &keys[i].key) == 0;
+        }
+#endif
+    }
+    qsort(keys, results, sizeof(dir_sort_key_t), &compare_dir_sort_key);
+    for (i = 0; i < results; i++) {
+        dir_list[i] = keys[i].entry;
+    }
+    free(keys);
+}
+
+/* Whether a file search_dir() came across should be searched: -1 if not, else
+ * whether it has to be sniffed first.
+ */
+static int file_wanted(const char *dir_full_path, const char *name) {
+    int offset_vector[3];
+    int sniff = FALSE;
+
+    if (opts.lang_exts_len > 0 && !has_file_extension(dir_full_path, opts.lang_exts, opts.lang_exts_len)) {
+        /* Scripts in bin/ often have no extension. Their first line says what they are. */
+        if (opts.sniff_types && !opts.match_files && strchr(name + 1, '.') == NULL) {
+            sniff = TRUE;
+        } else {
+            log_debug("Skipping %s: not one of the file types searched.", dir_full_path);
+            return -1;
+        }
+    }
+    if (opts.file_search_regex &&
+        pcre_exec(opts.file_search_regex, NULL, dir_full_path, strlen(dir_full_path), 0, 0, offset_vector, 3) < 0) {
+        log_debug("Skipping %s due to file_search_regex.", dir_full_path);
+        return -1;
+    }
+    if (queries_len > 0 && !opts.match_files && !queries_want_path(dir_full_path)) {
+        log_debug("Skipping %s: no query searches files like it.", dir_full_path);
+        return -1;
+    }
+    return sniff;
+}
+
+/* Queue a file that filename_filter() let through, or search a directory.
+ * dir_full_path is path/dir->d_name, and dir_full_path_len its length.
+ */
+void search_dir_entry(ignores *ig, const char *base_path, const char *path, const struct dirent *dir,
+                      const char *dir_full_path, const size_t dir_full_path_len, const int depth,
+                      dev_t original_dev) {
+    work_queue_t *queue_item;
+    int sniff;
+
+#ifndef _WIN32
+    if (opts.one_dev) {
+        struct stat s;
+        if (lstat(dir_full_path, &s) != 0) {
+            log_err("Failed to get device information for %s. Skipping...", dir->d_name);
+            return;
+        }
+        if (s.st_dev != original_dev) {
+            log_debug("File %s crosses a device boundary (is probably a mount point.) Skipping...", dir->d_name);
+            return;
+        }
+    }
+#endif
+
+    /* If a link points to a directory then we need to treat it as a directory. */
+    if (!opts.follow_symlinks && is_symlink(path, dir)) {
+        log_debug("File %s ignored becaused it's a symlink", dir->d_name);
+        stats_skip(STATS_SKIP_SYMLINK);
+        return;
+    }
+
+    if (!is_directory(path, dir)) {
+        sniff = file_wanted(dir_full_path, dir->d_name);
+        if (sniff < 0) {
+            return;
+        }
+        if (opts.match_files) {
+            log_debug("match_files: file_search_regex matched for %s.", dir_full_path);
+            pthread_mutex_lock(&cur_search->print_mtx);
+            if (claim_results(1) > 0 && !opts.quiet) {
+                if (opts.result_cb) {
+                    callback_path(dir_full_path, 1);
+                } else if (opts.json || opts.packed) {
+                    search_scratch_t *scratch = get_scratch();
+                    scratch->records.len = 0;
+                    print_records_path(&scratch->records, dir_full_path, NULL, 1);
+                    fwrite(scratch->records.data, 1, scratch->records.len, out_fd);
+                } else {
+                    print_path(dir_full_path, opts.path_sep);
+                }
+            }
+            pthread_mutex_unlock(&cur_search->print_mtx);
+            __atomic_store_n(&cur_search->match_found, TRUE, __ATOMIC_RELAXED);
+            return;
+        }
+
+        queue_item = ag_malloc(sizeof(work_queue_t) + dir_full_path_len);
+        memcpy(queue_item->path, dir_full_path, dir_full_path_len + 1);
+        queue_item->prefetched = FALSE;
+        queue_item->split = NULL;
+        queue_item->sniff = sniff;
+        work_queue_push(queue_item);
+        log_debug("%s added to work queue", dir_full_path);
+    } else if (opts.recurse_dirs) {
+        if (depth < opts.max_search_depth || opts.max_search_depth == -1) {
+            log_debug("Searching dir %s", dir_full_path);
+            ignores *child_ig;
+#ifdef HAVE_DIRENT_DNAMLEN
+            child_ig = init_ignore(ig, dir->d_name, dir->d_namlen);
+#else
+            child_ig = init_ignore(ig, dir->d_name, strlen(dir->d_name));
+#endif
+            search_dir(child_ig, base_path, dir_full_path, depth + 1,
+                       original_dev);
+            /* --watch keeps each directory's ignores for files added to it later */
+            if (!opts.watch) {
+                cleanup_ignore(child_ig);
+            }
+        } else {
+            if (opts.max_search_depth == DEFAULT_MAX_SEARCH_DEPTH) {
+                /*
+                 * If the user didn't intentionally specify a particular depth,
+                 * this is a warning...
+                 */
+                log_err("Skipping %s. Use the --depth option to search deeper.", dir_full_path);
+            } else {
+                /* ... if they did, let's settle for debug. */
+                log_debug("Skipping %s. Use the --depth option to search deeper.", dir_full_path);
+            }
+        }
+    }
+}
+
 /* TODO: Append matches to some data structure instead of just printing them out.
  * Then ag can have sweet summaries of matches/files scanned/time/etc.
  */
@@ -423,12 +2084,22 @@ void search_dir(ignores *ig, const char *base_path, const char *path, const int
     int results = 0;
 
     char *dir_full_path = NULL;
+    size_t dir_full_path_size;
+    size_t path_len;
+    size_t full_path_len;
     const char *ignore_file = NULL;
     int i;
 
     int symres;
     dirkey_t current_dirkey;
 
+#ifdef HAVE_SYS_INOTIFY_H
+    if (opts.watch) {
+        /* Before reading the directory, so nothing added meanwhile is missed */
+        watch_path(ig, base_path, path, depth, original_dev);
+    }
+#endif
+
     symres = check_symloop_enter(path, &current_dirkey);
     if (symres == SYMLOOP_LOOP) {
         log_err("Recursive directory loop: %s", path);
@@ -455,7 +2126,9 @@ void search_dir(ignores *ig, const char *base_path, const char *path, const int
     scandir_baton.ig = ig;
     scandir_baton.base_path = base_path;
     scandir_baton.base_path_len = base_path ? strlen(base_path) : 0;
+    double walk_start = stats_phase_start();
     results = ag_scandir(path, &dir_list, &filename_filter, &scandir_baton);
+    stats_phase_end(STATS_PHASE_WALK, walk_start);
     if (results == 0) {
         log_debug("No results found in directory %s", path);
         goto search_dir_cleanup;
@@ -471,108 +2144,48 @@ void search_dir(ignores *ig, const char *base_path, const char *path, const int
                 if (opts.only_matching && opts.print_path == PATH_PRINT_NOTHING) {
                     opts.print_line_numbers = FALSE;
                 }
+                /* The workers have nothing else to do, so have them help with
+                 * this file as soon as it's big enough to be worth splitting.
+                 */
+                if (opts.split_size > 0) {
+                    opts.split_size = 1;
+                }
             }
-            search_file(path);
+            search_file(path, FALSE);
         } else {
             log_err("Error opening directory %s: %s", path, strerror(errno));
         }
         goto search_dir_cleanup;
     }
 
-    int offset_vector[3];
-    int rc = 0;
-    work_queue_t *queue_item;
+    /* Every entry's full path is built in the same buffer. Files that get
+     * queued are copied into their queue item.
+     */
+    path_len = strlen(path);
+    dir_full_path_size = path_len + 2 + 64;
+    dir_full_path = ag_malloc(dir_full_path_size);
+    memcpy(dir_full_path, path, path_len);
+    dir_full_path[path_len] = '/';
+
+    if (opts.dispatch_order != DISPATCH_READDIR) {
+        walk_start = stats_phase_start();
+        sort_dir_entries(&dir_full_path, &dir_full_path_size, path_len, dir_list, results);
+        stats_phase_end(STATS_PHASE_WALK, walk_start);
+    }
 
     for (i = 0; i < results; i++) {
-        queue_item = NULL;
         dir = dir_list[i];
-        ag_asprintf(&dir_full_path, "%s/%s", path, dir->d_name);
-#ifndef _WIN32
-        if (opts.one_dev) {
-            struct stat s;
-            if (lstat(dir_full_path, &s) != 0) {
-                log_err("Failed to get device information for %s. Skipping...", dir->d_name);
-                goto cleanup;
-            }
-            if (s.st_dev != original_dev) {
-                log_debug("File %s crosses a device boundary (is probably a mount point.) Skipping...", dir->d_name);
-                goto cleanup;
-            }
-        }
-#endif
-
-        /* If a link points to a directory then we need to treat it as a directory. */
-        if (!opts.follow_symlinks && is_symlink(path, dir)) {
-            log_debug("File %s ignored becaused it's a symlink", dir->d_name);
-            goto cleanup;
-        }
-
-        if (!is_directory(path, dir)) {
-            if (opts.file_search_regex) {
-                rc = pcre_exec(opts.file_search_regex, NULL, dir_full_path, strlen(dir_full_path),
-                               0, 0, offset_vector, 3);
-                if (rc < 0) { /* no match */
-                    log_debug("Skipping %s due to file_search_regex.", dir_full_path);
-                    goto cleanup;
-                } else if (opts.match_files) {
-                    log_debug("match_files: file_search_regex matched for %s.", dir_full_path);
-                    pthread_mutex_lock(&print_mtx);
-                    print_path(dir_full_path, opts.path_sep);
-                    pthread_mutex_unlock(&print_mtx);
-                    opts.match_found = 1;
-                    goto cleanup;
-                }
-            }
-
-            queue_item = ag_malloc(sizeof(work_queue_t));
-            queue_item->path = dir_full_path;
-            queue_item->next = NULL;
-            pthread_mutex_lock(&work_queue_mtx);
-            if (work_queue_tail == NULL) {
-                work_queue = queue_item;
-            } else {
-                work_queue_tail->next = queue_item;
-            }
-            work_queue_tail = queue_item;
-            pthread_cond_signal(&files_ready);
-            pthread_mutex_unlock(&work_queue_mtx);
-            log_debug("%s added to work queue", dir_full_path);
-        } else if (opts.recurse_dirs) {
-            if (depth < opts.max_search_depth || opts.max_search_depth == -1) {
-                log_debug("Searching dir %s", dir_full_path);
-                ignores *child_ig;
-#ifdef HAVE_DIRENT_DNAMLEN
-                child_ig = init_ignore(ig, dir->d_name, dir->d_namlen);
-#else
-                child_ig = init_ignore(ig, dir->d_name, strlen(dir->d_name));
-#endif
-                search_dir(child_ig, base_path, dir_full_path, depth + 1,
-                           original_dev);
-                cleanup_ignore(child_ig);
-            } else {
-                if (opts.max_search_depth == DEFAULT_MAX_SEARCH_DEPTH) {
-                    /*
-                     * If the user didn't intentionally specify a particular depth,
-                     * this is a warning...
-                     */
-                    log_err("Skipping %s. Use the --depth option to search deeper.", dir_full_path);
-                } else {
-                    /* ... if they did, let's settle for debug. */
-                    log_debug("Skipping %s. Use the --depth option to search deeper.", dir_full_path);
-                }
-            }
+        /* Once the search is done, just free the remaining entries */
+        if (!search_is_done()) {
+            full_path_len = dir_entry_path(&dir_full_path, &dir_full_path_size, path_len, dir);
+            search_dir_entry(ig, base_path, path, dir, dir_full_path, full_path_len, depth, original_dev);
         }
-
-    cleanup:
         free(dir);
         dir = NULL;
-        if (queue_item == NULL) {
-            free(dir_full_path);
-            dir_full_path = NULL;
-        }
     }
 
 search_dir_cleanup:
+    free(dir_full_path);
     check_symloop_leave(&current_dirkey);
     free(dir_list);
     dir_list = NULL;
@@ -25,28 +25,63 @@
 
 #include "decompress.h"
 #include "ignore.h"
+#include "lang.h"
 #include "log.h"
 #include "options.h"
 #include "print.h"
+#include "stats.h"
+#include "uring.h"
 #include "uthash.h"
 #include "util.h"
+#include "watch.h"
 
-size_t alpha_skip_lookup[256];
-size_t *find_skip_lookup;
+/* The compiled query. With more than one NUMA node, workers on each node
+ * search with their own copy instead of reading the one the search started
+ * with. Each --queries query has its own too, so the matching options live
+ * here rather than being read from opts.
+ */
+typedef struct {
+    size_t *alpha_skip_lookup;
+    size_t *find_skip_lookup;
+    pcre *re;
+    pcre_extra *re_extra;
+    char *query;
+    int query_len;
+    int literal;
+    enum case_behavior casing;
+    int word_regexp;
+    int literal_starts_wordchar;
+    int literal_ends_wordchar;
+    int invert_match;
+} pattern_t;
+
+typedef struct split_file_t split_file_t;
 
 struct work_queue_t {
-    char *path;
     struct work_queue_t *next;
+    int prefetched;      /* A worker has already asked the kernel to read this file in */
+    split_file_t *split; /* Set if this is a call for help searching part of a big file. path is empty. */
+    int sniff;           /* Only search this if its shebang or modeline says it's one of the types */
+    char path[1]; /* Allocated along with the rest of the struct */
 };
 typedef struct work_queue_t work_queue_t;
 
-work_queue_t *work_queue;
-work_queue_t *work_queue_tail;
-int done_adding_files;
-pthread_cond_t files_ready;
-pthread_mutex_t print_mtx;
-pthread_mutex_t stats_mtx;
-pthread_mutex_t work_queue_mtx;
+/* Each NUMA node has its own shard of the work queue. search_dir() deals
+ * files out to them in turn, and workers only take from another node's shard
+ * once their own runs dry.
+ */
+typedef struct {
+    work_queue_t *head;
+    work_queue_t *tail;
+    pthread_mutex_t mtx;
+    pthread_cond_t files_ready;
+} work_queue_shard_t;
+
+/* Set once --max-total-count is reached. Everyone stops early. Every thread
+ * checks it without a lock, so it's only read and written through these.
+ */
+int search_is_done(void);
+void search_set_done(const int done);
 
 
 /* For symlink loop detection */
@@ -64,15 +99,93 @@ typedef struct {
     UT_hash_handle hh;
 } symdir_t;
 
-symdir_t *symhash;
+/* Everything the threads working on one search share. Searches can run in
+ * different threads at once, so none of it can be global. Each thread
+ * points cur_search at the search it's working on.
+ */
+typedef struct {
+    cli_options opts; /* Each worker starts with a copy of these */
+    FILE *out_fd;
+    int done; /* Only use search_is_done() and search_set_done() */
+    int match_found;
+
+    pthread_mutex_t print_mtx;
+    size_t total_results; /* The rest of these are protected by print_mtx */
+    int first_file_match;
+    match_t *context_prev_lines; /* print_file_matches()'s, so one ring can be reused for every file */
+    size_t context_prev_lines_size;
+
+    work_queue_shard_t *shards;
+    int shards_len;
+    int next_shard; /* Only search_dir() pushes files, so no lock needed */
+    int done_adding_files;
+
+    pattern_t pattern;
+    pattern_t *pattern_copies; /* One per node. Made by the first worker on each node to need one. */
+    int pattern_copies_len;
+    int pcre_opts;
+    int study_opts;
+    pthread_mutex_t pattern_copies_mtx;
+
+    symdir_t *symhash; /* Only search_dir() uses this */
+
+    pthread_t prefetch_thread;
+    pthread_mutex_t prefetch_mtx;
+    pthread_cond_t prefetch_wanted_cond;
+    int prefetch_wanted;
+    int prefetch_running;
+} search_t;
+
+extern __thread search_t *cur_search;
+
+typedef struct {
+    pthread_t thread;
+    int id;
+    int cpu;  /* To pin the worker to, or -1 */
+    int node; /* Which work queue shard and copy of the pattern to use */
+    search_t *search;
+} worker_t;
+
+/* Get search ready to look for pattern with this thread's opts and out_fd,
+ * and make it this thread's cur_search. The pattern is searched with, not
+ * copied, so it has to outlive the search. Returns FALSE and sets error
+ * (which the caller frees) if it can't.
+ */
+int search_init(search_t *search, const pattern_t *pattern, const int nodes, const int pcre_opts, const int study_opts, char **error);
+/* Call once the workers are done */
+void search_cleanup(search_t *search);
+
+/* What we sniffed about a file is good until it changes */
+typedef struct {
+    dev_t dev;
+    ino_t ino;
+    time_t mtime;
+    off_t size;
+} sniff_key_t;
+
+int sniffed_type_wanted(const sniff_key_t *key);
 
 void search_buf(const char *buf, const size_t buf_len,
                 const char *dir_full_path);
 void search_stream(FILE *stream, const char *path);
-void search_file(const char *file_full_path);
-
+void search_file_buf(const char *buf, const size_t f_len, const char *file_full_path, const sniff_key_t *sniff_key);
+void search_file(const char *file_full_path, const int sniff);
+
+void work_queue_push(work_queue_t *queue_item);
+void work_queue_done_adding(void);
+work_queue_t *work_queue_pop(const int wait);
+void search_queue_item(work_queue_t *queue_item);
+int work_queue_finished(void);
+/* --prefetch: a thread that hints the files at the front of the queue.
+ * prefetch_start() returns 0 or pthread_create()'s error.
+ */
+int prefetch_start(void);
+void prefetch_stop(void);
 void *search_file_worker(void *i);
 
 void search_dir(ignores *ig, const char *base_path, const char *path, const int depth, dev_t original_dev);
+void search_dir_entry(ignores *ig, const char *base_path, const char *path, const struct dirent *dir,
+                      const char *dir_full_path, const size_t dir_full_path_len, const int depth,
+                      dev_t original_dev);
 
 #endif
@@ -0,0 +1,370 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "options.h"
+#include "stats.h"
+#include "trace.h"
+#include "util.h"
+
+/* Each thread counts into its own ag_stats so that searching doesn't contend
+ * on stats_mtx. stats_mtx only protects thread_stats_list.
+ */
+static pthread_key_t stats_key;
+static ag_stats *thread_stats_list = NULL;
+static double mono_start = 0;
+
+/* Queue depth over time for --stats-json. When the buffer fills up, every
+ * other sample is dropped and the interval doubles, so memory stays bounded
+ * no matter how long we run. Protected by queue_stats_mtx, since each shard
+ * of the work queue has its own lock.
+ */
+#define STATS_QUEUE_SAMPLES 512
+typedef struct {
+    double seconds;
+    size_t depth; /* Deepest the queue got since the previous sample */
+} queue_sample_t;
+static queue_sample_t queue_samples[STATS_QUEUE_SAMPLES];
+static size_t queue_samples_len = 0;
+static double queue_sample_interval = 0.001;
+static size_t queue_depth_max = 0;
+static size_t queue_depth = 0;
+static pthread_mutex_t queue_stats_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *phase_names[STATS_PHASE_COUNT] = {
+    "walking directories (including ignores)",
+    "evaluating ignore patterns",
+    "opening and reading files",
+    "detecting binary files",
+    "decompressing",
+    "matching",
+    "printing (including lock waits)",
+    "prefetching queued files",
+    "waiting for files to search"
+};
+
+static const char *phase_json_names[STATS_PHASE_COUNT] = {
+    "walk",
+    "ignore",
+    "open",
+    "binary",
+    "decompress",
+    "match",
+    "print",
+    "prefetch",
+    "idle"
+};
+
+static const char *skip_json_names[STATS_SKIP_COUNT] = {
+    "ignored",
+    "binary",
+    "too_large",
+    "symlink",
+    "error"
+};
+
+void stats_init(void) {
+    memset(&stats, 0, sizeof(stats));
+    if (pthread_key_create(&stats_key, NULL)) {
+        die("pthread_key_create failed!");
+    }
+    if (pthread_mutex_init(&stats_mtx, NULL)) {
+        die("pthread_mutex_init failed!");
+    }
+    gettimeofday(&(stats.time_start), NULL);
+    mono_start = stats_now();
+}
+
+/* Returns the calling thread's stats, creating them on first use. */
+ag_stats *stats_thread(void) {
+    ag_stats *st = pthread_getspecific(stats_key);
+    if (st == NULL) {
+        st = ag_calloc(1, sizeof(ag_stats));
+        pthread_setspecific(stats_key, st);
+        pthread_mutex_lock(&stats_mtx);
+        st->next = thread_stats_list;
+        thread_stats_list = st;
+        pthread_mutex_unlock(&stats_mtx);
+    }
+    return st;
+}
+
+/* Monotonic time in seconds */
+double stats_now(void) {
+#ifdef HAVE_CLOCK_GETTIME
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+#endif
+}
+
+/* Pass the result to stats_phase_end(). Costs nothing if stats and tracing are off. */
+double stats_phase_start(void) {
+    if (!STATS_ENABLED && !TRACE_ENABLED) {
+        return 0;
+    }
+    return stats_now();
+}
+
+void stats_phase_end(const stats_phase_t phase, const double start) {
+    /* Ignore patterns are checked once per directory entry. Those would
+     * crowd everything else out of the walker's trace, and they're inside a
+     * walk span anyway. */
+    if (phase != STATS_PHASE_IGNORE) {
+        trace_span(phase_json_names[phase], start, NULL);
+    }
+    if (!STATS_ENABLED) {
+        return;
+    }
+    stats_thread()->phase_time[phase] += stats_now() - start;
+}
+
+void stats_skip(const stats_skip_t reason) {
+    if (!STATS_ENABLED) {
+        return;
+    }
+    stats_thread()->skipped[reason]++;
+}
+
+void stats_uring_file(void) {
+    if (!STATS_ENABLED) {
+        return;
+    }
+    stats_thread()->uring_files++;
+}
+
+static int log2_bucket(unsigned long val) {
+    int bucket = 0;
+    while (val > 1 && bucket < STATS_HIST_BUCKETS - 1) {
+        val >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+static void add_slow_file(stats_slow_file_t slowest[], const char *path, const double seconds, const long bytes) {
+    int i;
+
+    if (slowest[STATS_SLOWEST_FILES - 1].path != NULL && slowest[STATS_SLOWEST_FILES - 1].seconds >= seconds) {
+        return;
+    }
+    free(slowest[STATS_SLOWEST_FILES - 1].path);
+    for (i = STATS_SLOWEST_FILES - 1; i > 0; i--) {
+        if (slowest[i - 1].path != NULL && slowest[i - 1].seconds >= seconds) {
+            break;
+        }
+        slowest[i] = slowest[i - 1];
+    }
+    slowest[i].path = ag_strdup(path);
+    slowest[i].seconds = seconds;
+    slowest[i].bytes = bytes;
+}
+
+/* Called once a file has been opened and searched. start is from stats_phase_start(). */
+void stats_file_done(const char *path, const long bytes, const double start) {
+    ag_stats *st;
+    double seconds;
+
+    trace_span("file", start, path);
+    if (!STATS_ENABLED) {
+        return;
+    }
+    st = stats_thread();
+    seconds = stats_now() - start;
+    st->latency_hist[log2_bucket((unsigned long)(seconds * 1e6))]++;
+    st->size_hist[log2_bucket((unsigned long)bytes)]++;
+    add_slow_file(st->slowest, path, seconds, bytes);
+}
+
+void stats_queue_add(const long files) {
+    double now;
+    size_t i;
+
+    if (opts.stats_json == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&queue_stats_mtx);
+    queue_depth += files;
+    if (queue_depth > queue_depth_max) {
+        queue_depth_max = queue_depth;
+    }
+    now = stats_now() - mono_start;
+    if (queue_samples_len > 0 && now - queue_samples[queue_samples_len - 1].seconds < queue_sample_interval) {
+        pthread_mutex_unlock(&queue_stats_mtx);
+        return;
+    }
+    if (queue_samples_len == STATS_QUEUE_SAMPLES) {
+        for (i = 0; i < STATS_QUEUE_SAMPLES / 2; i++) {
+            queue_samples[i] = queue_samples[i * 2 + 1];
+        }
+        queue_samples_len = STATS_QUEUE_SAMPLES / 2;
+        queue_sample_interval *= 2;
+    }
+    queue_samples[queue_samples_len].seconds = now;
+    queue_samples[queue_samples_len].depth = queue_depth_max;
+    queue_samples_len++;
+    queue_depth_max = queue_depth;
+    pthread_mutex_unlock(&queue_stats_mtx);
+}
+
+/* Only call this once all workers have been joined. */
+void stats_merge(void) {
+    ag_stats *st;
+    int i;
+
+    gettimeofday(&(stats.time_end), NULL);
+    for (st = thread_stats_list; st != NULL; st = st->next) {
+        stats.total_bytes += st->total_bytes;
+        stats.total_files += st->total_files;
+        stats.total_matches += st->total_matches;
+        stats.total_file_matches += st->total_file_matches;
+        stats.uring_files += st->uring_files;
+        for (i = 0; i < STATS_SKIP_COUNT; i++) {
+            stats.skipped[i] += st->skipped[i];
+        }
+        for (i = 0; i < STATS_PHASE_COUNT; i++) {
+            stats.phase_time[i] += st->phase_time[i];
+        }
+        for (i = 0; i < STATS_HIST_BUCKETS; i++) {
+            stats.latency_hist[i] += st->latency_hist[i];
+            stats.size_hist[i] += st->size_hist[i];
+        }
+        for (i = 0; i < STATS_SLOWEST_FILES && st->slowest[i].path != NULL; i++) {
+            add_slow_file(stats.slowest, st->slowest[i].path, st->slowest[i].seconds, st->slowest[i].bytes);
+        }
+    }
+}
+
+static double elapsed_time(void) {
+    double time_diff = ((long)stats.time_end.tv_sec * 1000000 + stats.time_end.tv_usec) -
+                       ((long)stats.time_start.tv_sec * 1000000 + stats.time_start.tv_usec);
+    return time_diff / 1000000;
+}
+
+void stats_print(FILE *fp) {
+    long skipped = 0;
+    int i;
+
+    for (i = 0; i < STATS_SKIP_COUNT; i++) {
+        skipped += stats.skipped[i];
+    }
+
+    fprintf(fp, "%ld matches\n%ld files contained matches\n%ld files searched\n%ld bytes searched\n%f seconds\n",
+            stats.total_matches, stats.total_file_matches, stats.total_files, stats.total_bytes, elapsed_time());
+    fprintf(fp, "%ld files skipped (%ld ignored, %ld binary, %ld too large, %ld symlinks, %ld errors)\n",
+            skipped,
+            stats.skipped[STATS_SKIP_IGNORED],
+            stats.skipped[STATS_SKIP_BINARY],
+            stats.skipped[STATS_SKIP_TOO_BIG],
+            stats.skipped[STATS_SKIP_SYMLINK],
+            stats.skipped[STATS_SKIP_ERROR]);
+    fprintf(fp, "Time summed over all threads:\n");
+    for (i = 0; i < STATS_PHASE_COUNT; i++) {
+        fprintf(fp, "  %f seconds %s\n", stats.phase_time[i], phase_names[i]);
+    }
+}
+
+static void print_json_hist(FILE *fp, const char *name, const char *unit, const long hist[]) {
+    int i;
+    int first = TRUE;
+    double bucket_min = 1; /* doubles so that 2^47 doesn't overflow a 32-bit long */
+
+    fprintf(fp, "  \"%s\": [", name);
+    for (i = 0; i < STATS_HIST_BUCKETS; i++, bucket_min *= 2) {
+        if (hist[i] == 0) {
+            continue;
+        }
+        fprintf(fp, "%s\n    { \"min_%s\": %.0f, \"max_%s\": %.0f, \"files\": %ld }",
+                first ? "" : ",",
+                unit, i == 0 ? 0 : bucket_min,
+                unit, bucket_min * 2 - 1,
+                hist[i]);
+        first = FALSE;
+    }
+    fprintf(fp, "%s],\n", first ? "" : "\n  ");
+}
+
+/* Everything stats_print() has, plus histograms, the slowest files, queue
+ * depth over time and per-thread numbers. */
+void stats_print_json(FILE *fp) {
+    ag_stats *st;
+    int i;
+    size_t j;
+
+    fprintf(fp, "{\n");
+    fprintf(fp, "  \"seconds\": %f,\n", elapsed_time());
+    fprintf(fp, "  \"matches\": %ld,\n", stats.total_matches);
+    fprintf(fp, "  \"files_with_matches\": %ld,\n", stats.total_file_matches);
+    fprintf(fp, "  \"files_searched\": %ld,\n", stats.total_files);
+    fprintf(fp, "  \"bytes_searched\": %ld,\n", stats.total_bytes);
+    fprintf(fp, "  \"files_read_with_io_uring\": %ld,\n", stats.uring_files);
+
+    fprintf(fp, "  \"files_skipped\": {");
+    for (i = 0; i < STATS_SKIP_COUNT; i++) {
+        fprintf(fp, "%s \"%s\": %ld", i == 0 ? "" : ",", skip_json_names[i], stats.skipped[i]);
+    }
+    fprintf(fp, " },\n");
+
+    fprintf(fp, "  \"phase_seconds\": {");
+    for (i = 0; i < STATS_PHASE_COUNT; i++) {
+        fprintf(fp, "%s \"%s\": %f", i == 0 ? "" : ",", phase_json_names[i], stats.phase_time[i]);
+    }
+    fprintf(fp, " },\n");
+
+    print_json_hist(fp, "file_latency_histogram", "us", stats.latency_hist);
+    print_json_hist(fp, "file_size_histogram", "bytes", stats.size_hist);
+
+    fprintf(fp, "  \"slowest_files\": [");
+    for (i = 0; i < STATS_SLOWEST_FILES && stats.slowest[i].path != NULL; i++) {
+        fprintf(fp, "%s\n    { \"path\": ", i == 0 ? "" : ",");
+        print_json_string(fp, stats.slowest[i].path);
+        fprintf(fp, ", \"seconds\": %f, \"bytes\": %ld }", stats.slowest[i].seconds, stats.slowest[i].bytes);
+    }
+    fprintf(fp, "%s],\n", i == 0 ? "" : "\n  ");
+
+    fprintf(fp, "  \"queue_depth\": [");
+    for (j = 0; j < queue_samples_len; j++) {
+        fprintf(fp, "%s\n    { \"seconds\": %f, \"depth\": %lu }", j == 0 ? "" : ",",
+                queue_samples[j].seconds, (unsigned long)queue_samples[j].depth);
+    }
+    fprintf(fp, "%s],\n", j == 0 ? "" : "\n  ");
+
+    fprintf(fp, "  \"threads\": [");
+    for (st = thread_stats_list; st != NULL; st = st->next) {
+        fprintf(fp, "%s\n    { \"files_searched\": %ld, \"bytes_searched\": %ld, \"busy_seconds\": %f, \"idle_seconds\": %f }",
+                st == thread_stats_list ? "" : ",",
+                st->total_files, st->total_bytes,
+                st->phase_time[STATS_PHASE_OPEN] + st->phase_time[STATS_PHASE_BINARY] + st->phase_time[STATS_PHASE_DECOMPRESS] +
+                    st->phase_time[STATS_PHASE_MATCH] + st->phase_time[STATS_PHASE_PRINT],
+                st->phase_time[STATS_PHASE_IDLE]);
+    }
+    fprintf(fp, "%s]\n", thread_stats_list == NULL ? "" : "\n  ");
+    fprintf(fp, "}\n");
+}
+
+static void free_slowest(stats_slow_file_t slowest[]) {
+    int i;
+    for (i = 0; i < STATS_SLOWEST_FILES; i++) {
+        free(slowest[i].path);
+    }
+}
+
+void stats_cleanup(void) {
+    ag_stats *st = thread_stats_list;
+    ag_stats *next;
+
+    while (st != NULL) {
+        next = st->next;
+        free_slowest(st->slowest);
+        free(st);
+        st = next;
+    }
+    thread_stats_list = NULL;
+    free_slowest(stats.slowest);
+    pthread_key_delete(stats_key);
+    pthread_mutex_destroy(&stats_mtx);
+}
@@ -0,0 +1,88 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include <sys/time.h>
+
+#include "config.h"
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#include "options.h"
+
+/* True if we're collecting stats for --stats or --stats-json */
+#define STATS_ENABLED (opts.stats || opts.stats_json != NULL)
+
+/* Where the time goes. Summed over all threads. */
+typedef enum {
+    STATS_PHASE_WALK,   /* Reading directories. Includes STATS_PHASE_IGNORE */
+    STATS_PHASE_IGNORE, /* Evaluating ignore patterns in filename_filter() */
+    STATS_PHASE_OPEN,   /* open(), fstat() and read() or mmap() */
+    STATS_PHASE_BINARY, /* is_binary() */
+    STATS_PHASE_DECOMPRESS,
+    STATS_PHASE_MATCH,
+    STATS_PHASE_PRINT,    /* Includes waiting for print_mtx */
+    STATS_PHASE_PREFETCH, /* Hinting upcoming files with --prefetch */
+    STATS_PHASE_IDLE,     /* Workers waiting for the walker to queue files */
+    STATS_PHASE_COUNT
+} stats_phase_t;
+
+/* Why files didn't get searched */
+typedef enum {
+    STATS_SKIP_IGNORED,
+    STATS_SKIP_BINARY,
+    STATS_SKIP_TOO_BIG,
+    STATS_SKIP_SYMLINK,
+    STATS_SKIP_ERROR,
+    STATS_SKIP_COUNT
+} stats_skip_t;
+
+/* Histogram bucket i counts values in [2^i, 2^(i+1)). Bucket 0 also gets 0. */
+#define STATS_HIST_BUCKETS 48
+#define STATS_SLOWEST_FILES 10
+
+typedef struct {
+    char *path;
+    double seconds;
+    long bytes;
+} stats_slow_file_t;
+
+struct ag_stats {
+    long total_bytes;
+    long total_files;
+    long total_matches;
+    long total_file_matches;
+    long skipped[STATS_SKIP_COUNT];
+    long uring_files; /* Files read with io_uring */
+    double phase_time[STATS_PHASE_COUNT]; /* In seconds */
+    long latency_hist[STATS_HIST_BUCKETS]; /* Microseconds to open and search a file */
+    long size_hist[STATS_HIST_BUCKETS];    /* File sizes in bytes */
+    stats_slow_file_t slowest[STATS_SLOWEST_FILES]; /* Sorted, slowest first */
+    struct timeval time_start;
+    struct timeval time_end;
+    struct ag_stats *next; /* Every thread's stats are kept in a list so they can be merged at exit */
+};
+typedef struct ag_stats ag_stats;
+
+/* Totals. Only valid after stats_merge() */
+ag_stats stats;
+pthread_mutex_t stats_mtx;
+
+void stats_init(void);
+ag_stats *stats_thread(void);
+double stats_now(void);
+double stats_phase_start(void);
+void stats_phase_end(const stats_phase_t phase, const double start);
+void stats_skip(const stats_skip_t reason);
+void stats_uring_file(void);
+void stats_file_done(const char *path, const long bytes, const double start);
+/* Files were added to (or taken off, if negative) the work queue */
+void stats_queue_add(const long files);
+void stats_merge(void);
+void stats_print(FILE *fp);
+void stats_print_json(FILE *fp);
+void stats_cleanup(void);
+
+#endif
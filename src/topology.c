@@ -0,0 +1,309 @@
+#include <dirent.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+#include "config.h"
+
+#if defined(HAVE_SCHED_GETAFFINITY) && defined(USE_CPU_SET)
+#include <sched.h>
+#endif
+
+#include "log.h"
+#include "topology.h"
+#include "util.h"
+
+/* All of this comes from /sys and /proc. Elsewhere, reading them fails and
+ * we fall back to assuming nothing.
+ */
+#define SYS_CPU_DIR "/sys/devices/system/cpu"
+#define CGROUP_DIR "/sys/fs/cgroup"
+
+/* Where a CPU is, as numbered by the kernel */
+typedef struct {
+    int package;
+    int core;
+    int node;
+} core_key_t;
+
+static int read_long_file(const char *path, long *val) {
+    FILE *fp = fopen(path, "r");
+    int rv;
+
+    if (fp == NULL) {
+        return FALSE;
+    }
+    rv = fscanf(fp, "%ld", val) == 1;
+    fclose(fp);
+    return rv;
+}
+
+static int read_cpu_long(const int cpu, const char *name, long *val) {
+    char path[128];
+
+    snprintf(path, sizeof(path), SYS_CPU_DIR "/cpu%i/topology/%s", cpu, name);
+    return read_long_file(path, val);
+}
+
+/* The nodeN link in a CPU's sysfs directory says which NUMA node it's on */
+static int cpu_node(const int cpu) {
+    char path[128];
+    DIR *dir;
+    struct dirent *entry;
+    int node = 0;
+
+    snprintf(path, sizeof(path), SYS_CPU_DIR "/cpu%i", cpu);
+    dir = opendir(path);
+    if (dir == NULL) {
+        return 0;
+    }
+    while ((entry = readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, "node", 4) == 0 && entry->d_name[4] >= '0' && entry->d_name[4] <= '9') {
+            node = atoi(entry->d_name + 4);
+            break;
+        }
+    }
+    closedir(dir);
+    return node;
+}
+
+/* cpu.max is "max 100000" without a quota or "400000 100000" for 4 CPUs */
+static double cgroup2_quota(const char *dir) {
+    char path[PATH_MAX + 32];
+    char quota_str[32];
+    long period;
+    FILE *fp;
+    double quota = 0;
+
+    snprintf(path, sizeof(path), "%s/cpu.max", dir);
+    fp = fopen(path, "r");
+    if (fp == NULL) {
+        return 0;
+    }
+    if (fscanf(fp, "%31s %ld", quota_str, &period) == 2 && strcmp(quota_str, "max") != 0 && period > 0) {
+        quota = (double)atol(quota_str) / period;
+    }
+    fclose(fp);
+    return quota;
+}
+
+static double cgroup1_quota(const char *dir) {
+    char path[PATH_MAX + 32];
+    long quota_us;
+    long period_us;
+
+    snprintf(path, sizeof(path), "%s/cpu.cfs_quota_us", dir);
+    if (!read_long_file(path, &quota_us) || quota_us <= 0) {
+        return 0;
+    }
+    snprintf(path, sizeof(path), "%s/cpu.cfs_period_us", dir);
+    if (!read_long_file(path, &period_us) || period_us <= 0) {
+        return 0;
+    }
+    return (double)quota_us / period_us;
+}
+
+/* Whether a comma-separated list of cgroup v1 controllers includes cpu */
+static int has_cpu_controller(const char *controllers) {
+    const char *pos = controllers;
+    size_t len;
+
+    while (*pos != '\0') {
+        len = strcspn(pos, ",");
+        if (len == 3 && strncmp(pos, "cpu", 3) == 0) {
+            return TRUE;
+        }
+        pos += len;
+        if (*pos == ',') {
+            pos++;
+        }
+    }
+    return FALSE;
+}
+
+/* The tightest quota on our cgroup or any of its parents. 0 if there's none. */
+static double cgroup_quota(void) {
+    FILE *fp = fopen("/proc/self/cgroup", "r");
+    char *line = NULL;
+    size_t line_cap = 0;
+    char dir[PATH_MAX];
+    double quota = 0;
+    double q;
+
+    if (fp == NULL) {
+        return 0;
+    }
+    while (getline(&line, &line_cap, fp) > 0) {
+        /* "0::/path" for cgroup v2, "4:cpu,cpuacct:/path" for v1 */
+        char *controllers = strchr(line, ':');
+        char *cg_path;
+        char *slash;
+        int v2;
+        if (controllers == NULL || (cg_path = strchr(++controllers, ':')) == NULL) {
+            continue;
+        }
+        *cg_path++ = '\0';
+        cg_path[strcspn(cg_path, "\n")] = '\0';
+        v2 = *controllers == '\0';
+        if (!v2 && !has_cpu_controller(controllers)) {
+            continue;
+        }
+        if (strcmp(cg_path, "/") == 0) {
+            cg_path[0] = '\0';
+        }
+        if (v2) {
+            snprintf(dir, sizeof(dir), CGROUP_DIR "%s", cg_path);
+        } else {
+            snprintf(dir, sizeof(dir), CGROUP_DIR "/%s%s", controllers, cg_path);
+        }
+        /* Quotas on parent cgroups apply to us too. Inside a container the
+         * path we're given usually doesn't exist, but our cgroup is the root.
+         */
+        for (;;) {
+            q = v2 ? cgroup2_quota(dir) : cgroup1_quota(dir);
+            if (q > 0 && (quota == 0 || q < quota)) {
+                quota = q;
+            }
+            slash = strrchr(dir, '/');
+            if (slash == NULL || (size_t)(slash - dir) < strlen(CGROUP_DIR)) {
+                break;
+            }
+            *slash = '\0';
+        }
+    }
+    free(line);
+    fclose(fp);
+    return quota;
+}
+
+static int online_cpus(void) {
+#ifdef _WIN32
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    return si.dwNumberOfProcessors;
+#else
+    return (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+}
+
+static int compare_cpus(const void *a, const void *b) {
+    const cpu_info_t *x = (const cpu_info_t *)a;
+    const cpu_info_t *y = (const cpu_info_t *)b;
+
+    /* One worker per physical core before doubling up on SMT siblings, and
+     * take turns between nodes so they share the memory bandwidth.
+     */
+    if (x->sibling_rank != y->sibling_rank) {
+        return x->sibling_rank - y->sibling_rank;
+    }
+    if (x->core_rank != y->core_rank) {
+        return x->core_rank - y->core_rank;
+    }
+    if (x->node != y->node) {
+        return x->node - y->node;
+    }
+    return x->cpu - y->cpu;
+}
+
+void topology_detect(cpu_topology_t *topo) {
+    core_key_t *cores;
+    int num_cpus = online_cpus();
+    int i, j;
+    long val;
+
+    if (num_cpus < 1) {
+        num_cpus = 1;
+    }
+    memset(topo, 0, sizeof(cpu_topology_t));
+
+#if defined(HAVE_SCHED_GETAFFINITY) && defined(USE_CPU_SET)
+    {
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0 && CPU_COUNT(&allowed) > 0) {
+            topo->cpus = ag_calloc(CPU_COUNT(&allowed), sizeof(cpu_info_t));
+            for (i = 0; i < CPU_SETSIZE; i++) {
+                if (CPU_ISSET(i, &allowed)) {
+                    topo->cpus[topo->cpus_len++].cpu = i;
+                }
+            }
+        }
+    }
+#endif
+    if (topo->cpus == NULL) {
+        topo->cpus = ag_calloc(num_cpus, sizeof(cpu_info_t));
+        for (i = 0; i < num_cpus; i++) {
+            topo->cpus[topo->cpus_len++].cpu = i;
+        }
+    }
+
+    cores = ag_malloc(topo->cpus_len * sizeof(core_key_t));
+    for (i = 0; i < topo->cpus_len; i++) {
+        cpu_info_t *info = &topo->cpus[i];
+        cores[i].package = read_cpu_long(info->cpu, "physical_package_id", &val) ? (int)val : 0;
+        cores[i].core = read_cpu_long(info->cpu, "core_id", &val) ? (int)val : info->cpu;
+        cores[i].node = cpu_node(info->cpu);
+    }
+
+    /* cpus is in CPU order here, so earlier siblings and cores come first */
+    for (i = 0; i < topo->cpus_len; i++) {
+        cpu_info_t *info = &topo->cpus[i];
+        int new_node = TRUE;
+        for (j = 0; j < i; j++) {
+            if (cores[j].node == cores[i].node) {
+                new_node = FALSE;
+                info->node = topo->cpus[j].node;
+            }
+            if (cores[j].package == cores[i].package && cores[j].core == cores[i].core) {
+                info->sibling_rank++;
+            } else if (cores[j].node == cores[i].node && topo->cpus[j].sibling_rank == 0) {
+                info->core_rank++;
+            }
+        }
+        if (info->sibling_rank == 0) {
+            topo->cores++;
+        } else {
+            /* Siblings are numbered by their core's first CPU */
+            for (j = 0; j < i; j++) {
+                if (cores[j].package == cores[i].package && cores[j].core == cores[i].core) {
+                    info->core_rank = topo->cpus[j].core_rank;
+                    break;
+                }
+            }
+        }
+        if (new_node) {
+            info->node = topo->nodes++;
+        }
+    }
+    free(cores);
+
+    qsort(topo->cpus, topo->cpus_len, sizeof(cpu_info_t), &compare_cpus);
+    topo->quota = cgroup_quota();
+
+    log_debug("%i CPUs online, %i allowed, %i cores, %i NUMA nodes, CPU quota %.2f",
+              num_cpus, topo->cpus_len, topo->cores, topo->nodes, topo->quota);
+}
+
+int topology_usable_cpus(const cpu_topology_t *topo) {
+    int usable = topo->cpus_len;
+
+    if (topo->quota > 0 && topo->quota < usable) {
+        /* A quota of 2.5 CPUs can keep 3 busy part of the time */
+        usable = (int)topo->quota;
+        if (usable < topo->quota) {
+            usable++;
+        }
+    }
+    return usable;
+}
+
+void topology_cleanup(cpu_topology_t *topo) {
+    free(topo->cpus);
+    topo->cpus = NULL;
+    topo->cpus_len = 0;
+}
@@ -0,0 +1,29 @@
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+
+typedef struct {
+    int cpu;
+    int node;         /* NUMA node, numbered from 0 to nodes - 1 (which may not be what the kernel calls it) */
+    int sibling_rank; /* 0 for the first CPU we're allowed on in its core, 1 for its SMT sibling, etc. */
+    int core_rank;    /* Which of the allowed cores in its node this CPU's core is */
+} cpu_info_t;
+
+typedef struct {
+    cpu_info_t *cpus; /* CPUs we're allowed to run on, in the order workers should use them */
+    int cpus_len;
+    int cores; /* Physical cores among them */
+    int nodes; /* NUMA nodes among them */
+    double quota; /* cgroup CPU quota in CPUs. 0 if there isn't one. */
+} cpu_topology_t;
+
+/* Find the CPUs we can run on and how they're laid out. Never fails: if we
+ * can't tell, every CPU online is assumed to be a core of its own on node 0.
+ */
+void topology_detect(cpu_topology_t *topo);
+
+/* How many CPUs' worth of time we can actually use */
+int topology_usable_cpus(const cpu_topology_t *topo);
+
+void topology_cleanup(cpu_topology_t *topo);
+
+#endif
@@ -0,0 +1,135 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "stats.h"
+#include "trace.h"
+#include "util.h"
+
+/* Every thread records into its own ring, so tracing takes no locks after a
+ * thread's first span. trace_mtx only protects thread_traces.
+ */
+typedef struct thread_trace {
+    int tid;
+    char name[32];
+    trace_event_t *events; /* TRACE_RING_EVENTS of them */
+    size_t next;           /* Where the next event goes */
+    size_t recorded;       /* Total events ever recorded, including overwritten ones */
+    struct thread_trace *list_next;
+} thread_trace_t;
+
+static pthread_key_t trace_key;
+static pthread_mutex_t trace_mtx = PTHREAD_MUTEX_INITIALIZER;
+static thread_trace_t *thread_traces = NULL;
+static int threads_len = 0;
+static double trace_start = 0;
+
+void trace_init(void) {
+    if (pthread_key_create(&trace_key, NULL)) {
+        die("pthread_key_create failed!");
+    }
+    trace_start = stats_now();
+}
+
+static thread_trace_t *trace_thread(void) {
+    thread_trace_t *tt = pthread_getspecific(trace_key);
+    if (tt == NULL) {
+        tt = ag_calloc(1, sizeof(thread_trace_t));
+        tt->events = ag_calloc(TRACE_RING_EVENTS, sizeof(trace_event_t));
+        pthread_setspecific(trace_key, tt);
+        pthread_mutex_lock(&trace_mtx);
+        tt->tid = ++threads_len;
+        snprintf(tt->name, sizeof(tt->name), "thread %i", tt->tid);
+        tt->list_next = thread_traces;
+        thread_traces = tt;
+        pthread_mutex_unlock(&trace_mtx);
+    }
+    return tt;
+}
+
+void trace_thread_name(const char *name, const int id) {
+    thread_trace_t *tt;
+
+    if (!TRACE_ENABLED) {
+        return;
+    }
+    tt = trace_thread();
+    if (id < 0) {
+        snprintf(tt->name, sizeof(tt->name), "%s", name);
+    } else {
+        snprintf(tt->name, sizeof(tt->name), "%s %i", name, id);
+    }
+}
+
+void trace_span(const char *name, const double start, const char *path) {
+    thread_trace_t *tt;
+    trace_event_t *event;
+
+    if (!TRACE_ENABLED) {
+        return;
+    }
+    tt = trace_thread();
+    event = &tt->events[tt->next];
+    free(event->path);
+    event->name = name;
+    event->path = path ? ag_strdup(path) : NULL;
+    event->start = start;
+    event->end = stats_now();
+    tt->next = (tt->next + 1) % TRACE_RING_EVENTS;
+    tt->recorded++;
+}
+
+/* Write the trace in Chrome's trace event format. Load it in
+ * chrome://tracing or https://ui.perfetto.dev
+ */
+void trace_write(FILE *fp) {
+    thread_trace_t *tt;
+    trace_event_t *event;
+    size_t dropped = 0;
+    size_t i;
+    int first = TRUE;
+
+    fprintf(fp, "{\"traceEvents\":[\n");
+    for (tt = thread_traces; tt != NULL; tt = tt->list_next) {
+        fprintf(fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%i,\"args\":{\"name\":", first ? "" : ",\n", tt->tid);
+        print_json_string(fp, tt->name);
+        fprintf(fp, "}},\n{\"name\":\"thread_sort_index\",\"ph\":\"M\",\"pid\":1,\"tid\":%i,\"args\":{\"sort_index\":%i}}", tt->tid, tt->tid);
+        first = FALSE;
+        if (tt->recorded > TRACE_RING_EVENTS) {
+            dropped += tt->recorded - TRACE_RING_EVENTS;
+        }
+        /* Oldest first. Before the ring wraps, the slots after next are empty. */
+        for (i = 0; i < TRACE_RING_EVENTS; i++) {
+            event = &tt->events[(tt->next + i) % TRACE_RING_EVENTS];
+            if (event->name == NULL) {
+                continue;
+            }
+            fprintf(fp, ",\n{\"name\":\"%s\",\"cat\":\"ag\",\"ph\":\"X\",\"pid\":1,\"tid\":%i,\"ts\":%.3f,\"dur\":%.3f",
+                    event->name, tt->tid, (event->start - trace_start) * 1e6, (event->end - event->start) * 1e6);
+            if (event->path) {
+                fprintf(fp, ",\"args\":{\"path\":");
+                print_json_string(fp, event->path);
+                fprintf(fp, "}");
+            }
+            fprintf(fp, "}");
+        }
+    }
+    fprintf(fp, "\n],\n\"displayTimeUnit\":\"ms\",\n\"otherData\":{\"dropped_events\":%lu}}\n", (unsigned long)dropped);
+}
+
+void trace_cleanup(void) {
+    thread_trace_t *tt = thread_traces;
+    thread_trace_t *next;
+    size_t i;
+
+    while (tt != NULL) {
+        next = tt->list_next;
+        for (i = 0; i < TRACE_RING_EVENTS; i++) {
+            free(tt->events[i].path);
+        }
+        free(tt->events);
+        free(tt);
+        tt = next;
+    }
+    thread_traces = NULL;
+    pthread_key_delete(trace_key);
+}
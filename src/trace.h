@@ -0,0 +1,33 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+
+#include "options.h"
+
+/* True if we're recording a timeline for --trace */
+#define TRACE_ENABLED (opts.trace != NULL)
+
+/* Each thread keeps its last TRACE_RING_EVENTS spans. Older ones are
+ * overwritten, so a long search only shows how it ended.
+ */
+#define TRACE_RING_EVENTS 65536
+
+typedef struct {
+    const char *name; /* Always a string literal */
+    char *path;       /* The file the span was about, or NULL */
+    double start;     /* From stats_now() */
+    double end;
+} trace_event_t;
+
+void trace_init(void);
+/* Name the calling thread in the timeline. id is appended unless it's negative. */
+void trace_thread_name(const char *name, const int id);
+/* Record a span from start (from stats_phase_start()) until now. Does nothing
+ * unless tracing. */
+void trace_span(const char *name, const double start, const char *path);
+/* Only call this once all workers have been joined. */
+void trace_write(FILE *fp);
+void trace_cleanup(void);
+
+#endif
@@ -0,0 +1,580 @@
+#include "config.h"
+
+#ifdef USE_IO_URING
+
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+
+#include "search.h"
+#include "uring.h"
+
+/* We talk to the kernel directly instead of linking against liburing. All
+ * we need is a handful of opcodes and the ring bookkeeping below.
+ */
+typedef struct {
+    int fd;
+    unsigned sq_entries;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_local_tail; /* Filled in but not yet handed to the kernel */
+    unsigned to_submit;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    unsigned in_flight;
+} ag_ring_t;
+
+typedef enum {
+    SLOT_FREE,
+    SLOT_OPENING, /* Waiting on openat and statx */
+    SLOT_READING,
+    SLOT_READY /* Loaded and waiting to be searched */
+} slot_state_t;
+
+typedef struct {
+    slot_state_t state;
+    work_queue_t *item;
+    int pending; /* Requests for this slot the kernel hasn't completed */
+    int fd;
+    int open_res;
+    int statx_res;
+    struct statx stx;
+    sniff_key_t sniff_key;
+    int sniff; /* Whether to sniff the file's type once it's read */
+    char *buf;
+    size_t buf_size;
+    size_t bytes_read;
+    double start;
+} uring_slot_t;
+
+/* The low bits of user_data say which request completed, the rest say for which slot */
+#define OP_OPEN 0
+#define OP_STATX 1
+#define OP_READ 2
+#define OP_CLOSE 3
+#define OP_BITS 2
+#define OP_MASK ((1 << OP_BITS) - 1)
+
+/* Don't hang on to huge buffers after reading a pathological file */
+#define MAX_SLOT_BUF (16 * 1024 * 1024)
+
+static int ring_init(ag_ring_t *ring, const unsigned entries) {
+    struct io_uring_params p;
+    char *sq;
+    char *cq;
+
+    memset(ring, 0, sizeof(ag_ring_t));
+    memset(&p, 0, sizeof(p));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (ring->fd < 0) {
+        return -1;
+    }
+
+    ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size) {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    ring->sq_ring = mmap(0, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        close(ring->fd);
+        return -1;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(0, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            munmap(ring->sq_ring, ring->sq_ring_size);
+            close(ring->fd);
+            return -1;
+        }
+    }
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(0, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        if (ring->cq_ring != ring->sq_ring) {
+            munmap(ring->cq_ring, ring->cq_ring_size);
+        }
+        munmap(ring->sq_ring, ring->sq_ring_size);
+        close(ring->fd);
+        return -1;
+    }
+
+    sq = ring->sq_ring;
+    cq = ring->cq_ring;
+    ring->sq_entries = p.sq_entries;
+    ring->sq_head = (unsigned *)(sq + p.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    ring->sq_local_tail = *ring->sq_tail;
+    return 0;
+}
+
+static void ring_cleanup(ag_ring_t *ring) {
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+}
+
+/* Hand queued requests to the kernel. If wait is set, also block until at
+ * least one request has completed. Returns -1 and sets errno on failure.
+ */
+static int ring_enter(ag_ring_t *ring, const int wait) {
+    int rv;
+    unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+    do {
+        rv = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, wait ? 1 : 0, flags, NULL, 0);
+    } while (rv < 0 && errno == EINTR);
+    if (rv < 0) {
+        return -1;
+    }
+    ring->to_submit -= rv;
+    return 0;
+}
+
+/* Each slot has at most three requests outstanding (openat, statx and the
+ * close of its last file), and the ring has room for four per slot, so
+ * there's always a free entry.
+ */
+static struct io_uring_sqe *ring_get_sqe(ag_ring_t *ring, const size_t slot, const int op) {
+    struct io_uring_sqe *sqe;
+    unsigned idx;
+
+    idx = ring->sq_local_tail & *ring->sq_mask;
+    sqe = &ring->sqes[idx];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->user_data = ((__u64)slot << OP_BITS) | op;
+    ring->sq_array[idx] = idx;
+    ring->sq_local_tail++;
+    ring->to_submit++;
+    ring->in_flight++;
+    return sqe;
+}
+
+static void queue_open(ag_ring_t *ring, uring_slot_t *slots, const size_t i) {
+    uring_slot_t *slot = &slots[i];
+    struct io_uring_sqe *sqe;
+
+    sqe = ring_get_sqe(ring, i, OP_OPEN);
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (__u64)(uintptr_t)slot->item->path;
+    sqe->open_flags = O_RDONLY;
+
+    sqe = ring_get_sqe(ring, i, OP_STATX);
+    sqe->opcode = IORING_OP_STATX;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (__u64)(uintptr_t)slot->item->path;
+    sqe->len = STATX_TYPE | STATX_MODE | STATX_INO | STATX_SIZE | STATX_MTIME;
+    sqe->off = (__u64)(uintptr_t)&slot->stx;
+
+    slot->state = SLOT_OPENING;
+    slot->pending = 2;
+    slot->fd = -1;
+}
+
+static void queue_read(ag_ring_t *ring, uring_slot_t *slots, const size_t i) {
+    uring_slot_t *slot = &slots[i];
+    struct io_uring_sqe *sqe;
+
+    sqe = ring_get_sqe(ring, i, OP_READ);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = slot->fd;
+    sqe->addr = (__u64)(uintptr_t)(slot->buf + slot->bytes_read);
+    sqe->len = slot->stx.stx_size - slot->bytes_read;
+    sqe->off = slot->bytes_read;
+
+    slot->state = SLOT_READING;
+    slot->pending = 1;
+}
+
+static void queue_close(ag_ring_t *ring, uring_slot_t *slots, const size_t i) {
+    uring_slot_t *slot = &slots[i];
+    struct io_uring_sqe *sqe;
+
+    if (slot->fd < 0) {
+        return;
+    }
+    sqe = ring_get_sqe(ring, i, OP_CLOSE);
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = slot->fd;
+    slot->fd = -1;
+}
+
+static void slot_done(uring_slot_t *slot) {
+    free(slot->item);
+    slot->item = NULL;
+    slot->state = SLOT_FREE;
+    if (slot->buf_size > MAX_SLOT_BUF) {
+        free(slot->buf);
+        slot->buf = NULL;
+        slot->buf_size = 0;
+    }
+}
+
+static int unsupported(const int res) {
+    return res == -EINVAL || res == -EOPNOTSUPP || res == -ENOSYS;
+}
+
+/* openat and statx have both completed. Decide whether to read the file
+ * ourselves or hand it to search_file(). Returns FALSE if the slot is done.
+ */
+static int slot_opened(ag_ring_t *ring, uring_slot_t *slots, const size_t i) {
+    uring_slot_t *slot = &slots[i];
+    const char *path = slot->item->path;
+    off_t f_len;
+    int wanted;
+
+    if (search_is_done()) {
+        queue_close(ring, slots, i);
+        return FALSE;
+    }
+
+    if (slot->open_res < 0 || slot->statx_res < 0) {
+        queue_close(ring, slots, i);
+        if (unsupported(slot->open_res) || unsupported(slot->statx_res)) {
+            /* Old kernel. Do it the old way. */
+            search_file(path, slot->item->sniff);
+        } else if (slot->open_res < 0) {
+            /* XXXX: strerror is not thread-safe */
+            log_err("Skipping %s: Error opening file: %s", path, strerror(-slot->open_res));
+            stats_skip(STATS_SKIP_ERROR);
+        } else {
+            log_err("Skipping %s: Error fstat()ing file.", path);
+            stats_skip(STATS_SKIP_ERROR);
+        }
+        return FALSE;
+    }
+
+    if (opts.stdout_inode != 0 && opts.stdout_inode == slot->stx.stx_ino) {
+        log_debug("Skipping %s: stdout is redirected to it", path);
+        queue_close(ring, slots, i);
+        return FALSE;
+    }
+
+    slot->sniff = FALSE;
+    if (slot->item->sniff && S_ISREG(slot->stx.stx_mode)) {
+        memset(&slot->sniff_key, 0, sizeof(sniff_key_t));
+        slot->sniff_key.dev = makedev(slot->stx.stx_dev_major, slot->stx.stx_dev_minor);
+        slot->sniff_key.ino = slot->stx.stx_ino;
+        slot->sniff_key.mtime = slot->stx.stx_mtime.tv_sec;
+        slot->sniff_key.size = slot->stx.stx_size;
+        wanted = sniffed_type_wanted(&slot->sniff_key);
+        if (wanted == FALSE) {
+            log_debug("Skipping %s: not one of the file types searched.", path);
+            queue_close(ring, slots, i);
+            return FALSE;
+        }
+        slot->sniff = wanted == -1;
+    }
+
+    f_len = slot->stx.stx_size;
+    if (!S_ISREG(slot->stx.stx_mode) || f_len > INT_MAX ||
+        (opts.mmap_threshold >= 0 && f_len >= opts.mmap_threshold)) {
+        /* Named pipes get stream searched and big files get mmapped */
+        queue_close(ring, slots, i);
+        search_file(path, slot->item->sniff);
+        return FALSE;
+    }
+
+    if (f_len == 0) {
+        log_debug("Skipping %s: file is empty.", path);
+        queue_close(ring, slots, i);
+        return FALSE;
+    }
+
+    if (slot->buf_size < (size_t)f_len + 1) {
+        free(slot->buf);
+        slot->buf_size = (size_t)f_len + 1;
+        slot->buf = ag_malloc(slot->buf_size);
+    }
+    slot->bytes_read = 0;
+    queue_read(ring, slots, i);
+    return TRUE;
+}
+
+/* Returns FALSE if the slot is done */
+static int slot_read(ag_ring_t *ring, uring_slot_t *slots, const size_t i, const int res) {
+    uring_slot_t *slot = &slots[i];
+
+    if (res < 0) {
+        log_err("File %s failed to load: %s.", slot->item->path, strerror(-res));
+        stats_skip(STATS_SKIP_ERROR);
+        queue_close(ring, slots, i);
+        return FALSE;
+    }
+    slot->bytes_read += res;
+    if (res > 0 && slot->bytes_read < slot->stx.stx_size && !search_is_done()) {
+        queue_read(ring, slots, i);
+        return TRUE;
+    }
+    queue_close(ring, slots, i);
+    if (slot->bytes_read == 0 || search_is_done()) {
+        return FALSE;
+    }
+    slot->buf[slot->bytes_read] = '\0';
+    slot->state = SLOT_READY;
+    stats_uring_file();
+    return TRUE;
+}
+
+/* Handle every completion the kernel has posted. Returns how many files finished. */
+static size_t reap(ag_ring_t *ring, uring_slot_t *slots) {
+    struct io_uring_cqe *cqe;
+    unsigned head = *ring->cq_head;
+    size_t done = 0;
+    uring_slot_t *slot;
+    size_t i;
+    int op;
+    int res;
+    int busy;
+
+    while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        cqe = &ring->cqes[head & *ring->cq_mask];
+        i = cqe->user_data >> OP_BITS;
+        op = cqe->user_data & OP_MASK;
+        res = cqe->res;
+        head++;
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+        ring->in_flight--;
+
+        slot = &slots[i];
+        busy = TRUE;
+        switch (op) {
+            case OP_OPEN:
+                slot->open_res = res;
+                if (res >= 0) {
+                    slot->fd = res;
+                }
+                if (--slot->pending == 0) {
+                    busy = slot_opened(ring, slots, i);
+                }
+                break;
+            case OP_STATX:
+                slot->statx_res = res;
+                if (--slot->pending == 0) {
+                    busy = slot_opened(ring, slots, i);
+                }
+                break;
+            case OP_READ:
+                slot->pending--;
+                busy = slot_read(ring, slots, i, res);
+                break;
+            case OP_CLOSE:
+                /* Nothing to be done if this fails */
+                break;
+        }
+        if (!busy) {
+            slot_done(slot);
+            done++;
+        }
+    }
+    return done;
+}
+
+/* io_uring_enter() failed, so search the files in the slots without it.
+ * Requests the kernel already has may still write to the slots.
+ */
+static void slots_fall_back(uring_slot_t *slots, const size_t depth) {
+    size_t i;
+
+    for (i = 0; i < depth; i++) {
+        if (slots[i].state == SLOT_FREE) {
+            continue;
+        }
+        if (slots[i].state == SLOT_READY) {
+            search_file_buf(slots[i].buf, slots[i].bytes_read, slots[i].item->path,
+                            slots[i].sniff ? &slots[i].sniff_key : NULL);
+            stats_file_done(slots[i].item->path, (long)slots[i].bytes_read, slots[i].start);
+        } else {
+            if (slots[i].fd >= 0) {
+                close(slots[i].fd);
+                slots[i].fd = -1;
+            }
+            if (!search_is_done()) {
+                search_file(slots[i].item->path, slots[i].item->sniff);
+            }
+        }
+        free(slots[i].item);
+        slots[i].item = NULL;
+        slots[i].state = SLOT_FREE;
+    }
+}
+
+/* Wait for what the kernel has of a ring that's being given up on, without
+ * starting anything new. Returns -1 if that fails too.
+ */
+static int ring_abandon(ag_ring_t *ring) {
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    unsigned head;
+
+    /* Requests that never got to the kernel won't complete. Closes among them are up to us. */
+    for (head = ring->sq_local_tail - ring->to_submit; head != ring->sq_local_tail; head++) {
+        sqe = &ring->sqes[head & *ring->sq_mask];
+        if (sqe->opcode == IORING_OP_CLOSE) {
+            close(sqe->fd);
+        }
+    }
+    ring->in_flight -= ring->to_submit;
+    ring->to_submit = 0;
+    while (ring->in_flight > 0) {
+        if (ring_enter(ring, TRUE) != 0) {
+            return -1;
+        }
+        head = *ring->cq_head;
+        while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+            cqe = &ring->cqes[head & *ring->cq_mask];
+            if ((cqe->user_data & OP_MASK) == OP_OPEN && cqe->res >= 0) {
+                close(cqe->res);
+            }
+            head++;
+            ring->in_flight--;
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+int search_files_uring(const int worker_id) {
+    ag_ring_t ring;
+    uring_slot_t *slots;
+    const size_t depth = opts.io_uring_depth;
+    size_t slots_used = 0;
+    size_t ready;
+    size_t i;
+    int queue_finished = FALSE;
+    int failed = FALSE;
+    work_queue_t *queue_item;
+    double phase_start;
+
+    /* Two requests per file while opening, plus a close that may still be
+     * outstanding from the file the slot had before.
+     */
+    if (ring_init(&ring, depth * 4) != 0) {
+        log_err("Worker %i couldn't set up io_uring: %s. Reading files normally.", worker_id, strerror(errno));
+        return -1;
+    }
+    log_debug("Worker %i using io_uring with %lu files in flight", worker_id, (unsigned long)depth);
+    slots = ag_calloc(depth, sizeof(uring_slot_t));
+
+    while (TRUE) {
+        /* Keep the window full. Only block on the queue if we've nothing else to do. */
+        for (i = 0; i < depth && !queue_finished && !search_is_done(); i++) {
+            if (slots[i].state != SLOT_FREE) {
+                continue;
+            }
+            queue_item = work_queue_pop(slots_used == 0);
+            while (queue_item != NULL && queue_item->split != NULL) {
+                /* Help search a big file, then look for a file of our own */
+                search_queue_item(queue_item);
+                queue_item = work_queue_pop(slots_used == 0);
+            }
+            if (queue_item == NULL) {
+                queue_finished = slots_used == 0 || work_queue_finished();
+                break;
+            }
+            memset(&slots[i].stx, 0, sizeof(slots[i].stx));
+            slots[i].item = queue_item;
+            slots[i].start = stats_phase_start();
+            queue_open(&ring, slots, i);
+            slots_used++;
+        }
+
+        if (slots_used == 0 && (queue_finished || search_is_done())) {
+            break;
+        }
+
+        ready = 0;
+        for (i = 0; i < depth; i++) {
+            if (slots[i].state == SLOT_READY) {
+                ready++;
+            }
+        }
+
+        phase_start = stats_phase_start();
+        if (ring_enter(&ring, ready == 0 && ring.in_flight > 0) != 0) {
+            failed = TRUE;
+            break;
+        }
+        slots_used -= reap(&ring, slots);
+        /* Reads and closes for what just completed. Get them going before we search. */
+        if (ring.to_submit > 0 && ring_enter(&ring, FALSE) != 0) {
+            failed = TRUE;
+            break;
+        }
+        stats_phase_end(STATS_PHASE_OPEN, phase_start);
+
+        for (i = 0; i < depth; i++) {
+            if (slots[i].state != SLOT_READY) {
+                continue;
+            }
+            search_file_buf(slots[i].buf, slots[i].bytes_read, slots[i].item->path,
+                            slots[i].sniff ? &slots[i].sniff_key : NULL);
+            stats_file_done(slots[i].item->path, (long)slots[i].bytes_read, slots[i].start);
+            slot_done(&slots[i]);
+            slots_used--;
+        }
+    }
+
+    /* The kernel may still be closing files. Don't tear down the ring under it. */
+    while (!failed && ring.in_flight > 0) {
+        if (ring_enter(&ring, TRUE) != 0) {
+            failed = TRUE;
+            break;
+        }
+        slots_used -= reap(&ring, slots);
+    }
+
+    if (failed) {
+        log_err("Worker %i: io_uring_enter() failed: %s. Reading files normally.", worker_id, strerror(errno));
+        slots_fall_back(slots, depth);
+    }
+
+    /* Search whatever's left the normal way. Once the search is done, this
+     * just drains the queue.
+     */
+    while ((queue_item = work_queue_pop(TRUE)) != NULL) {
+        search_queue_item(queue_item);
+    }
+
+    if (failed && ring_abandon(&ring) != 0) {
+        /* The kernel might still read into the slots' buffers, so leave them be */
+        ring_cleanup(&ring);
+        return 0;
+    }
+    ring_cleanup(&ring);
+    for (i = 0; i < depth; i++) {
+        free(slots[i].buf);
+    }
+    free(slots);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,14 @@
+#ifndef URING_H
+#define URING_H
+
+#include "config.h"
+
+#ifdef USE_IO_URING
+/* Search files from the work queue until it's drained, keeping up to
+ * opts.io_uring_depth of them in flight at once. Returns -1 without taking
+ * anything off the queue if io_uring isn't usable, 0 otherwise.
+ */
+int search_files_uring(const int worker_id);
+#endif
+
+#endif
@@ -6,6 +6,11 @@
 #include <sys/stat.h>
 
 #include "config.h"
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
 #include "util.h"
 
 #ifdef _WIN32
@@ -15,6 +20,8 @@
 #define getc_unlocked(x) getc(x)
 #endif
 
+__thread FILE *out_fd = NULL;
+
 #define CHECK_AND_RETURN(ptr)             \
     if (ptr == NULL) {                    \
         die("Memory allocation failed."); \
@@ -226,6 +233,9 @@ size_t invert_matches(const char *buf, const size_t buf_len, match_t matches[],
 
             if (match_read_index < matches_len) {
                 next_match = matches[match_read_index];
+            } else {
+                /* An empty match at 0 would otherwise be found again */
+                next_match.start = buf_len + 1;
             }
 
             if (in_inverted_match && last_line_end > inverted_match_start) {
@@ -268,20 +278,23 @@ void realloc_matches(match_t **matches, size_t *matches_size, size_t matches_len
     *matches = ag_realloc(*matches, *matches_size * sizeof(match_t));
 }
 
-void compile_study(pcre **re, pcre_extra **re_extra, char *q, const int pcre_opts, const int study_opts) {
+int compile_study(pcre **re, pcre_extra **re_extra, const char *q, const int pcre_opts, const int study_opts, char **error) {
     const char *pcre_err = NULL;
     int pcre_err_offset = 0;
 
     *re = pcre_compile(q, pcre_opts, &pcre_err, &pcre_err_offset, NULL);
     if (*re == NULL) {
-        die("Bad regex! pcre_compile() failed at position %i: %s\nIf you meant to search for a literal string, run ag with -Q",
-            pcre_err_offset,
-            pcre_err);
+        ag_asprintf(error, "Bad regex! pcre_compile() failed at position %i: %s\nIf you meant to search for a literal string, run ag with -Q",
+                    pcre_err_offset,
+                    pcre_err);
+        *re_extra = NULL;
+        return FALSE;
     }
     *re_extra = pcre_study(*re, study_opts, &pcre_err);
     if (*re_extra == NULL) {
         log_debug("pcre_study returned nothing useful. Error: %s", pcre_err);
     }
+    return TRUE;
 }
 
 /* This function is very hot. It's called on every file. */
@@ -393,8 +406,9 @@ int binary_search(const char *needle, char **haystack, int start, int end) {
 }
 
 static int wordchar_table[256];
+static pthread_once_t wordchar_table_once = PTHREAD_ONCE_INIT;
 
-void init_wordchar_table(void) {
+static void fill_wordchar_table(void) {
     int i;
     for (i = 0; i < 256; ++i) {
         char ch = (char)i;
@@ -406,6 +420,10 @@ void init_wordchar_table(void) {
     }
 }
 
+void init_wordchar_table(void) {
+    pthread_once(&wordchar_table_once, &fill_wordchar_table);
+}
+
 int is_wordchar(char ch) {
     return wordchar_table[(unsigned char)ch];
 }
@@ -487,6 +505,208 @@ int is_named_pipe(const char *path, const struct dirent *d) {
     return S_ISFIFO(s.st_mode);
 }
 
+/* Write s as a quoted JSON string */
+void print_json_string(FILE *fp, const char *s) {
+    const unsigned char *c;
+
+    fputc('"', fp);
+    for (c = (const unsigned char *)s; *c != '\0'; c++) {
+        if (*c == '"' || *c == '\\') {
+            fputc('\\', fp);
+            fputc(*c, fp);
+        } else if (*c < 0x20) {
+            fprintf(fp, "\\u%04x", *c);
+        } else {
+            fputc(*c, fp);
+        }
+    }
+    fputc('"', fp);
+}
+
+void strbuf_grow(strbuf_t *sb, const size_t len) {
+    if (sb->len + len <= sb->size) {
+        return;
+    }
+    sb->size = ag_max(sb->size * 2, sb->len + len);
+    sb->data = ag_realloc(sb->data, sb->size);
+}
+
+void strbuf_append(strbuf_t *sb, const char *s, const size_t len) {
+    strbuf_grow(sb, len);
+    memcpy(sb->data + sb->len, s, len);
+    sb->len += len;
+}
+
+void strbuf_append_num(strbuf_t *sb, size_t n) {
+    char digits[24];
+    size_t i = sizeof(digits);
+
+    do {
+        digits[--i] = '0' + n % 10;
+        n /= 10;
+    } while (n > 0);
+    strbuf_append(sb, digits + i, sizeof(digits) - i);
+}
+
+/* LEB128: 7 bits per byte, low bits first, high bit set on all but the last byte */
+size_t varint_len(size_t n) {
+    size_t len = 1;
+
+    while (n >= 0x80) {
+        n >>= 7;
+        len++;
+    }
+    return len;
+}
+
+void strbuf_append_varint(strbuf_t *sb, size_t n) {
+    strbuf_grow(sb, 10);
+    while (n >= 0x80) {
+        sb->data[sb->len++] = (char)(n | 0x80);
+        n >>= 7;
+    }
+    sb->data[sb->len++] = (char)n;
+}
+
+/* What each byte turns into in a JSON string: 0 if it's copied as is, else
+ * the character after the backslash ('u' for \u00XX). 'x' starts a UTF-8
+ * sequence, which is copied as is if it's valid.
+ */
+static const char json_escapes[256] = {
+    'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'b', 't', 'n', 'u', 'f', 'r', 'u', 'u',
+    'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+    0, 0, '"', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, '\\', 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 'u',
+    'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x',
+    'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x',
+    'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x',
+    'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x',
+    'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x',
+    'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x',
+    'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x',
+    'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x'
+};
+
+/* How long the UTF-8 sequence at c is, or 0 if it's cut short, overlong, a
+ * surrogate or past U+10FFFF.
+ */
+static size_t utf8_seq_len(const unsigned char *c, const unsigned char *end) {
+    unsigned int code_point;
+    size_t len;
+    size_t i;
+
+    if (*c < 0xc2) {
+        return 0;
+    } else if (*c < 0xe0) {
+        len = 2;
+        code_point = *c & 0x1f;
+    } else if (*c < 0xf0) {
+        len = 3;
+        code_point = *c & 0x0f;
+    } else if (*c < 0xf5) {
+        len = 4;
+        code_point = *c & 0x07;
+    } else {
+        return 0;
+    }
+    if ((size_t)(end - c) < len) {
+        return 0;
+    }
+    for (i = 1; i < len; i++) {
+        if ((c[i] & 0xc0) != 0x80) {
+            return 0;
+        }
+        code_point = (code_point << 6) | (c[i] & 0x3f);
+    }
+    if (len == 3 && (code_point < 0x800 || (code_point >= 0xd800 && code_point <= 0xdfff))) {
+        return 0;
+    }
+    if (len == 4 && (code_point < 0x10000 || code_point > 0x10ffff)) {
+        return 0;
+    }
+    return len;
+}
+
+/* Append s as a quoted JSON string. Returns FALSE if s isn't valid UTF-8,
+ * which a JSON string can't hold. What was appended by then is garbage.
+ */
+int strbuf_append_json(strbuf_t *sb, const char *s, const size_t len) {
+    static const char hex[] = "0123456789abcdef";
+    const unsigned char *c = (const unsigned char *)s;
+    const unsigned char *end = c + len;
+    const unsigned char *run;
+    char esc[6] = { '\\', 'u', '0', '0', 0, 0 };
+    size_t seq_len;
+
+    strbuf_append(sb, "\"", 1);
+    while (c < end) {
+        /* Copy everything up to the next byte that needs escaping in one go */
+        for (run = c; c < end && json_escapes[*c] == 0; c++) {
+        }
+        strbuf_append(sb, (const char *)run, c - run);
+        if (c == end) {
+            break;
+        }
+        if (json_escapes[*c] == 'x') {
+            seq_len = utf8_seq_len(c, end);
+            if (seq_len == 0) {
+                return FALSE;
+            }
+            strbuf_append(sb, (const char *)c, seq_len);
+            c += seq_len;
+            continue;
+        }
+        if (json_escapes[*c] == 'u') {
+            esc[1] = 'u';
+            esc[4] = hex[*c >> 4];
+            esc[5] = hex[*c & 0xf];
+            strbuf_append(sb, esc, 6);
+        } else {
+            esc[1] = json_escapes[*c];
+            strbuf_append(sb, esc, 2);
+        }
+        c++;
+    }
+    strbuf_append(sb, "\"", 1);
+    return TRUE;
+}
+
+/* Append s base64 encoded, in quotes, for bytes a JSON string can't hold */
+void strbuf_append_base64(strbuf_t *sb, const char *s, const size_t len) {
+    static const char digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    const unsigned char *c = (const unsigned char *)s;
+    char *out;
+    size_t i;
+    unsigned long n;
+
+    strbuf_grow(sb, (len + 2) / 3 * 4 + 2);
+    out = sb->data + sb->len;
+    *out++ = '"';
+    for (i = 0; i + 2 < len; i += 3) {
+        n = ((unsigned long)c[i] << 16) | ((unsigned long)c[i + 1] << 8) | c[i + 2];
+        *out++ = digits[(n >> 18) & 0x3f];
+        *out++ = digits[(n >> 12) & 0x3f];
+        *out++ = digits[(n >> 6) & 0x3f];
+        *out++ = digits[n & 0x3f];
+    }
+    if (i < len) {
+        n = (unsigned long)c[i] << 16;
+        if (i + 1 < len) {
+            n |= (unsigned long)c[i + 1] << 8;
+        }
+        *out++ = digits[(n >> 18) & 0x3f];
+        *out++ = digits[(n >> 12) & 0x3f];
+        *out++ = i + 1 < len ? digits[(n >> 6) & 0x3f] : '=';
+        *out++ = '=';
+    }
+    *out++ = '"';
+    sb->len = out - sb->data;
+}
+
 void ag_asprintf(char **ret, const char *fmt, ...) {
     va_list args;
     va_start(args, fmt);
@@ -573,6 +793,19 @@ ssize_t getline(char **lineptr, size_t *n, FILE *stream) {
 }
 #endif
 
+/* Count newlines in buf[0, len) */
+size_t count_lines(const char *buf, const size_t len) {
+    const char *pos = buf;
+    const char *end = buf + len;
+    size_t lines = 0;
+
+    while (pos < end && (pos = memchr(pos, '\n', end - pos)) != NULL) {
+        lines++;
+        pos++;
+    }
+    return lines;
+}
+
 ssize_t buf_getline(const char **line, const char *buf, const size_t buf_len, const size_t buf_offset) {
     const char *cur = buf + buf_offset;
     ssize_t i;
@@ -12,7 +12,10 @@
 #include "log.h"
 #include "options.h"
 
-FILE *out_fd;
+/* Where results go. Each thread has its own, so searches running at once
+ * can print to different places.
+ */
+extern __thread FILE *out_fd;
 
 #ifndef TRUE
 #define TRUE 1
@@ -33,18 +36,6 @@ typedef struct {
     size_t end;   /* and where it ends */
 } match_t;
 
-typedef struct {
-    long total_bytes;
-    long total_files;
-    long total_matches;
-    long total_file_matches;
-    struct timeval time_start;
-    struct timeval time_end;
-} ag_stats;
-
-
-ag_stats stats;
-
 typedef const char *(*strncmp_fp)(const char *, const char *, const size_t, const size_t, const size_t[], const size_t *);
 
 void free_strings(char **strs, const size_t strs_len);
@@ -66,7 +57,8 @@ strncmp_fp get_strstr(enum case_behavior opts);
 
 size_t invert_matches(const char *buf, const size_t buf_len, match_t matches[], size_t matches_len);
 void realloc_matches(match_t **matches, size_t *matches_size, size_t matches_len);
-void compile_study(pcre **re, pcre_extra **re_extra, char *q, const int pcre_opts, const int study_opts);
+/* Returns FALSE and sets error (which the caller frees) if q isn't a valid regex */
+int compile_study(pcre **re, pcre_extra **re_extra, const char *q, const int pcre_opts, const int study_opts, char **error);
 
 
 int is_binary(const void *buf, const size_t buf_len);
@@ -86,7 +78,26 @@ int is_named_pipe(const char *path, const struct dirent *d);
 void die(const char *fmt, ...);
 
 void ag_asprintf(char **ret, const char *fmt, ...);
+void print_json_string(FILE *fp, const char *s);
 
+/* A buffer that grows as things are appended to it */
+typedef struct {
+    char *data;
+    size_t len;
+    size_t size;
+} strbuf_t;
+
+/* Make room for len more bytes */
+void strbuf_grow(strbuf_t *sb, const size_t len);
+void strbuf_append(strbuf_t *sb, const char *s, const size_t len);
+void strbuf_append_num(strbuf_t *sb, size_t n);
+int strbuf_append_json(strbuf_t *sb, const char *s, const size_t len);
+void strbuf_append_base64(strbuf_t *sb, const char *s, const size_t len);
+/* For --packed. See packed.h. */
+size_t varint_len(size_t n);
+void strbuf_append_varint(strbuf_t *sb, size_t n);
+
+size_t count_lines(const char *buf, const size_t len);
 ssize_t buf_getline(const char **line, const char *buf, const size_t buf_len, const size_t buf_offset);
 
 #ifndef HAVE_FGETLN
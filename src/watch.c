@@ -0,0 +1,383 @@
+#include "config.h"
+
+#ifdef HAVE_SYS_INOTIFY_H
+
+#include <sys/inotify.h>
+
+#include "scandir.h"
+#include "search.h"
+#include "watch.h"
+
+#define WATCH_MASK (IN_MODIFY | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)
+/* Room for plenty of events with the longest possible name */
+#define WATCH_EVENTS_SIZE (64 * (sizeof(struct inotify_event) + NAME_MAX + 1))
+/* What's added to a file is read and searched this much at a time */
+#define WATCH_READ_SIZE (1024 * 1024)
+
+typedef struct watch_dir_t {
+    int wd;       /* -1 if it can't be watched */
+    char *path;   /* As search_dir() was given it */
+    char *prefix; /* What the paths of files in it start with */
+    ignores *ig;  /* Ours to free */
+    int named_only; /* Only follow the files in it that were named on the command line */
+    const char *base_path;
+    int depth;
+    dev_t original_dev;
+    struct watch_dir_t *next; /* Every one there is, for watch_cleanup() */
+    UT_hash_handle hh;        /* By wd */
+} watch_dir_t;
+
+typedef struct {
+    char *path;
+    dev_t dev;
+    ino_t ino;
+    off_t offset;    /* Searched up to here */
+    size_t line;     /* Line number at offset */
+    int named;       /* Named on the command line, so whatever gets that name is followed */
+    uint32_t cookie; /* Renamed. Matches the IN_MOVED_TO for its new name. */
+    UT_hash_handle hh;
+} watch_file_t;
+
+static int inotify_fd = -1;
+static int inotify_failed = FALSE;
+static watch_dir_t *dirs = NULL; /* By wd. Only search_dir() adds to this. */
+static watch_dir_t *all_dirs = NULL;
+static watch_file_t *files = NULL; /* By path */
+static watch_file_t *moved = NULL; /* Renamed, and waiting to hear what to */
+/* Workers add files. Once watch_run() starts, it's the only one using them. */
+static pthread_mutex_t files_mtx = PTHREAD_MUTEX_INITIALIZER;
+static char *read_buf = NULL;
+
+static void free_file(watch_file_t *file) {
+    if (file == NULL) {
+        return;
+    }
+    free(file->path);
+    free(file);
+}
+
+/* Call with files_mtx held */
+static watch_file_t *add_file(const char *path) {
+    watch_file_t *file;
+
+    HASH_FIND_STR(files, path, file);
+    if (file == NULL) {
+        file = ag_calloc(1, sizeof(watch_file_t));
+        file->path = ag_strdup(path);
+        HASH_ADD_KEYPTR(hh, files, file->path, strlen(file->path), file);
+    }
+    return file;
+}
+
+void watch_path(ignores *ig, const char *base_path, const char *path, const int depth, dev_t original_dev) {
+    watch_dir_t *dir = ag_calloc(1, sizeof(watch_dir_t));
+    watch_dir_t *existing;
+    watch_file_t *file;
+    const char *slash;
+    int err;
+
+    dir->ig = ig;
+    dir->base_path = base_path;
+    dir->depth = depth;
+    dir->original_dev = original_dev;
+    dir->next = all_dirs;
+    all_dirs = dir;
+
+    if (inotify_fd == -1 && !inotify_failed) {
+        inotify_fd = inotify_init1(IN_CLOEXEC);
+        if (inotify_fd == -1) {
+            log_err("Can't watch for changes: %s", strerror(errno));
+            inotify_failed = TRUE;
+        }
+    }
+
+    if (inotify_fd == -1) {
+        dir->wd = -1;
+        return;
+    }
+    dir->wd = inotify_add_watch(inotify_fd, path, WATCH_MASK | IN_ONLYDIR);
+    err = errno;
+    if (dir->wd == -1 && err == ENOTDIR) {
+        /* A file. Its directory says when it's changed, replaced or renamed. */
+        slash = strrchr(path, '/');
+        if (slash == NULL) {
+            dir->path = ag_strdup(".");
+            dir->prefix = ag_strdup("");
+        } else {
+            dir->path = slash == path ? ag_strdup("/") : ag_strndup(path, slash - path);
+            dir->prefix = ag_strndup(path, slash - path + 1);
+        }
+        dir->named_only = TRUE;
+        dir->wd = inotify_add_watch(inotify_fd, dir->path, WATCH_MASK | IN_ONLYDIR);
+        err = errno;
+        pthread_mutex_lock(&files_mtx);
+        file = add_file(path);
+        file->named = TRUE;
+        pthread_mutex_unlock(&files_mtx);
+    } else {
+        dir->path = ag_strdup(path);
+        ag_asprintf(&dir->prefix, "%s/", path);
+    }
+
+    if (dir->wd == -1) {
+        /* search_dir() complains about paths that don't exist */
+        if (err != ENOENT) {
+            log_err("Can't watch %s for changes: %s", dir->path, strerror(err));
+        }
+        return;
+    }
+    /* The same directory can be given more than once */
+    HASH_FIND_INT(dirs, &dir->wd, existing);
+    if (existing != NULL && existing->named_only && !dir->named_only) {
+        HASH_DEL(dirs, existing);
+        existing = NULL;
+    }
+    if (existing == NULL) {
+        HASH_ADD_INT(dirs, wd, dir);
+    }
+}
+
+void watch_file(const char *path, const struct stat *statbuf, const char *buf, const size_t len) {
+    watch_file_t *file;
+    /* Count while the file is still in memory, so the first append doesn't read it all again */
+    size_t line = count_lines(buf, len) + 1;
+
+    pthread_mutex_lock(&files_mtx);
+    file = add_file(path);
+    file->dev = statbuf->st_dev;
+    file->ino = statbuf->st_ino;
+    file->offset = len;
+    file->line = line;
+    pthread_mutex_unlock(&files_mtx);
+}
+
+/* Search the lines added to a file since we last looked at it */
+static void search_appended(watch_file_t *file) {
+    struct stat statbuf;
+    ssize_t rv;
+    size_t cut;
+    int fd;
+
+    fd = open(file->path, O_RDONLY);
+    if (fd == -1) {
+        log_debug("Can't open %s: %s", file->path, strerror(errno));
+        return;
+    }
+    if (fstat(fd, &statbuf) != 0 || !S_ISREG(statbuf.st_mode) ||
+        (opts.stdout_inode != 0 && opts.stdout_inode == statbuf.st_ino)) {
+        close(fd);
+        return;
+    }
+    if (statbuf.st_dev != file->dev || statbuf.st_ino != file->ino || statbuf.st_size < file->offset) {
+        log_debug("%s was replaced or truncated. Searching it from the start.", file->path);
+        file->dev = statbuf.st_dev;
+        file->ino = statbuf.st_ino;
+        file->offset = 0;
+        file->line = 1;
+    }
+
+    while (!search_is_done() && file->offset < statbuf.st_size) {
+        rv = pread(fd, read_buf,
+                   statbuf.st_size - file->offset < WATCH_READ_SIZE ? (size_t)(statbuf.st_size - file->offset) : WATCH_READ_SIZE,
+                   file->offset);
+        if (rv <= 0) {
+            break;
+        }
+        /* Search whole lines. The rest of the last one is still being written. */
+        for (cut = rv; cut > 0 && read_buf[cut - 1] != '\n'; cut--) {
+        }
+        if (cut == 0) {
+            if (rv < WATCH_READ_SIZE) {
+                break;
+            }
+            cut = rv;
+        }
+        /* Line numbers and offsets are printed from where this starts */
+        opts.stream_line_num = file->line;
+        opts.stream_offset = file->offset;
+        search_buf(read_buf, cut, file->path);
+        opts.stream_line_num = 0;
+        opts.stream_offset = 0;
+        file->line += count_lines(read_buf, cut);
+        file->offset += cut;
+    }
+    close(fd);
+}
+
+/* A file was deleted or renamed. If it was renamed, keep it in moved until we
+ * see its new name.
+ */
+static void forget_file(watch_file_t *file, const uint32_t cookie) {
+    watch_file_t *gone = NULL;
+
+    if (file->named) {
+        /* Whatever shows up under the name next is searched from the start */
+        if (cookie) {
+            gone = ag_malloc(sizeof(watch_file_t));
+            *gone = *file;
+            gone->path = ag_strdup(file->path);
+            gone->named = FALSE;
+        }
+        file->dev = 0;
+        file->ino = 0;
+        file->offset = 0;
+        file->line = 1;
+    } else {
+        HASH_DEL(files, file);
+        gone = file;
+    }
+    if (cookie) {
+        gone->cookie = cookie;
+        moved = gone;
+    } else {
+        free_file(gone);
+    }
+}
+
+/* A new file or directory. Search it like search_dir() would have. */
+static void search_new_entry(watch_dir_t *dir, const char *name, const char *path) {
+    struct dirent entry;
+    scandir_baton_t baton;
+    work_queue_t *queue_item;
+    size_t name_len = strlen(name);
+
+    if (name_len >= sizeof(entry.d_name)) {
+        return;
+    }
+    memset(&entry, 0, sizeof(entry));
+    memcpy(entry.d_name, name, name_len + 1);
+    entry.d_type = DT_UNKNOWN;
+    baton.ig = dir->ig;
+    baton.base_path = dir->base_path;
+    baton.base_path_len = dir->base_path ? strlen(dir->base_path) : 0;
+    if (!filename_filter(dir->path, &entry, &baton)) {
+        return;
+    }
+    search_dir_entry(dir->ig, dir->base_path, dir->path, &entry, path, strlen(path), dir->depth,
+                     dir->original_dev);
+    /* The workers are gone, so search what got queued ourselves */
+    while ((queue_item = work_queue_pop(FALSE)) != NULL) {
+        search_queue_item(queue_item);
+    }
+}
+
+static void handle_event(const struct inotify_event *event) {
+    watch_dir_t *dir;
+    watch_file_t *file;
+    char *path;
+
+    if (event->mask & IN_Q_OVERFLOW) {
+        log_err("Too many changes at once. Some of them weren't searched.");
+        return;
+    }
+    HASH_FIND_INT(dirs, &event->wd, dir);
+    if (dir == NULL) {
+        return;
+    }
+    if (event->mask & IN_IGNORED) {
+        /* The directory is gone */
+        HASH_DEL(dirs, dir);
+        return;
+    }
+    if (event->len == 0) {
+        return;
+    }
+
+    ag_asprintf(&path, "%s%s", dir->prefix, event->name);
+    HASH_FIND_STR(files, path, file);
+    if (moved != NULL && !((event->mask & IN_MOVED_TO) && event->cookie == moved->cookie)) {
+        /* It was renamed to somewhere we don't watch */
+        free_file(moved);
+        moved = NULL;
+    }
+
+    if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+        if (file != NULL) {
+            forget_file(file, event->mask & IN_MOVED_FROM ? event->cookie : 0);
+        }
+    } else if (moved != NULL) {
+        /* Renamed (rotated, say) within what we watch. Carry on where we were. */
+        if (file == NULL && dir->named_only) {
+            free_file(moved);
+        } else {
+            if (file != NULL) {
+                moved->named = file->named;
+                HASH_DEL(files, file);
+                free_file(file);
+            }
+            free(moved->path);
+            moved->path = path;
+            path = NULL;
+            HASH_ADD_KEYPTR(hh, files, moved->path, strlen(moved->path), moved);
+            search_appended(moved);
+        }
+        moved = NULL;
+    } else if (file != NULL) {
+        search_appended(file);
+    } else if ((event->mask & (IN_CREATE | IN_MOVED_TO)) && !dir->named_only) {
+        search_new_entry(dir, event->name, path);
+    }
+    free(path);
+}
+
+void watch_run(void) {
+    char *events;
+    char *pos;
+    ssize_t len;
+    const struct inotify_event *event;
+
+    if (inotify_fd == -1) {
+        return;
+    }
+    events = ag_malloc(WATCH_EVENTS_SIZE);
+    read_buf = ag_malloc(WATCH_READ_SIZE);
+    while (!search_is_done() && HASH_COUNT(dirs) > 0) {
+        /* Matches shouldn't sit in a buffer while we wait */
+        fflush(out_fd);
+        len = read(inotify_fd, events, WATCH_EVENTS_SIZE);
+        if (len < 0 && errno == EINTR) {
+            continue;
+        }
+        if (len <= 0) {
+            log_err("Error watching for changes: %s", strerror(errno));
+            break;
+        }
+        for (pos = events; pos < events + len && !search_is_done(); pos += sizeof(struct inotify_event) + event->len) {
+            event = (const struct inotify_event *)pos;
+            handle_event(event);
+        }
+    }
+    free(events);
+}
+
+void watch_cleanup(void) {
+    watch_dir_t *dir;
+    watch_dir_t *next;
+    watch_file_t *file;
+    watch_file_t *tmp;
+
+    HASH_CLEAR(hh, dirs);
+    for (dir = all_dirs; dir != NULL; dir = next) {
+        next = dir->next;
+        cleanup_ignore(dir->ig);
+        free(dir->path);
+        free(dir->prefix);
+        free(dir);
+    }
+    all_dirs = NULL;
+    HASH_ITER(hh, files, file, tmp) {
+        HASH_DEL(files, file);
+        free_file(file);
+    }
+    free_file(moved);
+    moved = NULL;
+    free(read_buf);
+    read_buf = NULL;
+    if (inotify_fd != -1) {
+        close(inotify_fd);
+        inotify_fd = -1;
+    }
+    inotify_failed = FALSE;
+}
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef WATCH_H
+#define WATCH_H
+
+#include <sys/stat.h>
+
+#include "config.h"
+#include "ignore.h"
+
+#ifdef HAVE_SYS_INOTIFY_H
+/* --watch: keep following the files that were searched and search what gets
+ * added to them, like tail -F. search_dir() watches each directory it
+ * searches, and search_file() records how much of each file it read.
+ */
+
+/* Watch a directory for new and changed files, or the directory of a file
+ * named on the command line for changes to just that file. Keeps ig, which
+ * files added to the directory later are checked against.
+ */
+void watch_path(ignores *ig, const char *base_path, const char *path, const int depth, dev_t original_dev);
+/* search_file() read the first len bytes of the file into buf */
+void watch_file(const char *path, const struct stat *statbuf, const char *buf, const size_t len);
+/* Search what's added from now on. Returns once nothing is left to watch or
+ * --max-total-count is reached. Call after the workers are done.
+ */
+void watch_run(void);
+void watch_cleanup(void);
+#endif
+
+#endif
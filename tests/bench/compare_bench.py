@@ -0,0 +1,129 @@
+#!/usr/bin/env python3
+
+# Compare two sets of benchmark results and fail if anything got slower.
+# Works on the JSON from run_bench.py and from ag_microbench --json, and is
+# also what run_bench.py --baseline uses.
+#
+# A scenario only counts as a regression if its median got slower by more
+# than --threshold percent AND by more than the noise in the runs allows:
+# the difference in medians has to be bigger than --sigmas times the two
+# runs' spread, measured as the median absolute deviation (MAD). With fewer
+# than MIN_SAMPLES runs on either side there's no telling noise from a real
+# change, so only the threshold applies.
+
+import argparse
+import json
+import math
+import sys
+
+MIN_SAMPLES = 3
+
+# Scale the MAD so it estimates the standard deviation of normal noise
+MAD_TO_SIGMA = 1.4826
+
+
+def median(values):
+    values = sorted(values)
+    mid = len(values) // 2
+    if len(values) % 2:
+        return values[mid]
+    return (values[mid - 1] + values[mid]) / 2.0
+
+
+def mad(values):
+    m = median(values)
+    return median([abs(v - m) for v in values])
+
+
+def load_samples(path, metric="wall"):
+    """Return {scenario: [samples]} from either kind of results file"""
+    with open(path) as fd:
+        data = json.load(fd)
+    samples = {}
+    if "scenarios" in data:
+        key = "%s_seconds" % metric
+        for name, scenario in data["scenarios"].items():
+            samples[name] = scenario[key]
+    elif "benchmarks" in data:
+        for name, bench in data["benchmarks"].items():
+            samples[name] = bench["samples"]
+    else:
+        sys.exit("%s doesn't look like benchmark results" % path)
+    return samples
+
+
+def compare_one(base, cur, threshold, sigmas):
+    base_median = median(base)
+    cur_median = median(cur)
+    delta = (cur_median - base_median) / base_median * 100 if base_median > 0 else 0.0
+    noise = MAD_TO_SIGMA * math.sqrt(mad(base) ** 2 + mad(cur) ** 2)
+    significant = len(base) < MIN_SAMPLES or len(cur) < MIN_SAMPLES or \
+        abs(cur_median - base_median) > sigmas * noise
+    if abs(delta) <= threshold:
+        status = "same"
+    elif not significant:
+        status = "noisy"
+    elif delta > 0:
+        status = "SLOWER"
+    else:
+        status = "faster"
+    return {
+        "baseline": base_median,
+        "current": cur_median,
+        "delta_percent": delta,
+        "status": status,
+    }
+
+
+def compare(baseline, current, threshold, sigmas):
+    """Compare {scenario: [samples]} dicts. Returns a list of (name, result)."""
+    results = []
+    for name in sorted(set(baseline) | set(current)):
+        if name not in current:
+            results.append((name, {"status": "missing"}))
+        elif name not in baseline:
+            results.append((name, {"status": "new"}))
+        else:
+            results.append((name, compare_one(baseline[name], current[name], threshold, sigmas)))
+    return results
+
+
+def print_report(results, fp=sys.stdout):
+    fp.write("%-52s %12s %12s %9s  %s\n" % ("scenario", "baseline", "current", "delta", "status"))
+    for name, r in results:
+        if "delta_percent" in r:
+            fp.write("%-52s %12.4f %12.4f %+8.1f%%  %s\n" % (
+                name, r["baseline"], r["current"], r["delta_percent"], r["status"]))
+        else:
+            fp.write("%-52s %12s %12s %9s  %s\n" % (name, "", "", "", r["status"]))
+    regressions = [name for name, r in results if r["status"] == "SLOWER"]
+    if regressions:
+        fp.write("%d of %d scenarios got slower\n" % (len(regressions), len(results)))
+    else:
+        fp.write("No regressions\n")
+    return len(regressions)
+
+
+def add_arguments(parser):
+    parser.add_argument("--threshold", type=float, default=5.0,
+                        help="percent slower a scenario can get before it fails (default: 5)")
+    parser.add_argument("--sigmas", type=float, default=3.0,
+                        help="how far outside the noise a change has to be to count (default: 3)")
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Compare benchmark results against a baseline")
+    parser.add_argument("baseline", help="results to compare against")
+    parser.add_argument("current", help="results to check")
+    parser.add_argument("--metric", choices=["wall", "cpu"], default="wall",
+                        help="which time to compare for run_bench.py results (default: wall)")
+    add_arguments(parser)
+    args = parser.parse_args()
+
+    results = compare(load_samples(args.baseline, args.metric), load_samples(args.current, args.metric),
+                      args.threshold, args.sigmas)
+    sys.exit(1 if print_report(results) else 0)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,213 @@
+#!/usr/bin/env python3
+
+# Generate the corpora that run_bench.py searches. The same seed and scale
+# always give byte-for-byte the same files, so numbers from different
+# machines and different versions of ag can be compared.
+#
+#   deep/     a tree nested 10 levels deep, a few files in every directory
+#   flat/     one huge directory
+#   tiny/     lots of files of a few hundred bytes
+#   giant/    a few files of hundreds of megabytes
+#   ignores/  a tree where a big .gitignore hides most of the files
+#   gzip/     a mix of gzipped and plain files
+#
+# Every corpus contains the needles run_bench.py looks for: "needle" (also
+# as "Needle" and inside other words), "begin_block ... end_block" spanning
+# lines, and some Python files for the type filter scenarios.
+
+import argparse
+import gzip
+import json
+import os
+import random
+import shutil
+import sys
+
+VERSION = 1
+
+WORDS = (
+    "int char void static const return if else for while struct typedef "
+    "buffer length offset path file match search query result error value "
+    "index count size start end next prev node list queue worker thread "
+    "lock unlock free malloc realloc memcpy strlen printf debug option"
+).split()
+
+
+class Writer(object):
+    def __init__(self, rng):
+        self.rng = rng
+
+    def line(self):
+        rng = self.rng
+        roll = rng.random()
+        if roll < 0.002:
+            return "    /* needle found here */\n"
+        if roll < 0.003:
+            return "    Needle = findNeedleInHaystack(haystack);\n"
+        if roll < 0.0035:
+            return "    begin_block\n        %s;\n    end_block\n" % rng.choice(WORDS)
+        words = [rng.choice(WORDS) for _ in range(rng.randint(2, 10))]
+        indent = "    " * rng.randint(0, 3)
+        return "%s%s(%s);\n" % (indent, words[0], ", ".join(words[1:]))
+
+    def text(self, size):
+        out = []
+        total = 0
+        while total < size:
+            line = self.line()
+            out.append(line)
+            total += len(line)
+        return "".join(out)
+
+
+def write_file(path, data):
+    with open(path, "wb") as fd:
+        fd.write(data.encode("ascii") if isinstance(data, str) else data)
+
+
+def gen_deep(root, rng, scale):
+    writer = Writer(rng)
+
+    def fill(path, depth):
+        os.makedirs(path)
+        for i in range(3):
+            ext = rng.choice([".c", ".h", ".py", ".txt", ".js"])
+            size = rng.randint(500, 20000)
+            write_file(os.path.join(path, "file%d%s" % (i, ext)), writer.text(int(size * min(scale, 1.0))))
+        if depth < 10:
+            for i in range(2 if depth > 2 else 3):
+                fill(os.path.join(path, "dir%d" % i), depth + 1)
+
+    fill(root, 0)
+    # Scale up by adding more top-level trees instead of making them deeper
+    for extra in range(1, int(scale)):
+        fill(os.path.join(root, "more%d" % extra), 3)
+
+
+def gen_flat(root, rng, scale):
+    writer = Writer(rng)
+    os.makedirs(root)
+    for i in range(int(20000 * scale)):
+        write_file(os.path.join(root, "f%06d.c" % i), writer.text(rng.randint(200, 4000)))
+
+
+def gen_tiny(root, rng, scale):
+    writer = Writer(rng)
+    os.makedirs(root)
+    for d in range(100):
+        sub = os.path.join(root, "d%02d" % d)
+        os.makedirs(sub)
+        for i in range(int(500 * scale)):
+            write_file(os.path.join(sub, "t%d.py" % i), writer.text(rng.randint(50, 500)))
+
+
+def gen_giant(root, rng, scale):
+    writer = Writer(rng)
+    os.makedirs(root)
+    # Generating hundreds of megabytes line by line is slow, so repeat one
+    # big random block with a few unique needles sprinkled in.
+    block = writer.text(4 * 1024 * 1024)
+    for i in range(3):
+        size = int(128 * 1024 * 1024 * scale)
+        with open(os.path.join(root, "giant%d.log" % i), "w") as fd:
+            written = 0
+            n = 0
+            while written < size:
+                fd.write(block)
+                fd.write("needle_unique_%d_%d\n" % (i, n))
+                written += len(block) + 20
+                n += 1
+
+
+def gen_ignores(root, rng, scale):
+    writer = Writer(rng)
+    os.makedirs(root)
+    patterns = []
+    for i in range(500):
+        kind = i % 4
+        if kind == 0:
+            patterns.append("*.gen%d" % i)
+        elif kind == 1:
+            patterns.append("build%d/" % i)
+        elif kind == 2:
+            patterns.append("/src%d/out" % i)
+        else:
+            patterns.append("cache%d_*.tmp" % i)
+    patterns.append("*.o")
+    write_file(os.path.join(root, ".gitignore"), "\n".join(patterns) + "\n")
+    for d in range(int(200 * scale)):
+        sub = os.path.join(root, "src%d" % d)
+        os.makedirs(os.path.join(sub, "out"))
+        os.makedirs(os.path.join(sub, "build%d" % (d * 4 + 1)))
+        for i in range(10):
+            text = writer.text(rng.randint(500, 5000))
+            write_file(os.path.join(sub, "keep%d.c" % i), text)
+            write_file(os.path.join(sub, "skip%d.o" % i), text)
+            write_file(os.path.join(sub, "out", "skip%d.c" % i), text)
+            write_file(os.path.join(sub, "build%d" % (d * 4 + 1), "skip%d.c" % i), text)
+
+
+def gen_gzip(root, rng, scale):
+    writer = Writer(rng)
+    os.makedirs(root)
+    for i in range(int(2000 * scale)):
+        text = writer.text(rng.randint(1000, 50000)).encode("ascii")
+        if i % 2:
+            # mtime=0 keeps the output the same from run to run
+            with open(os.path.join(root, "g%05d.txt.gz" % i), "wb") as raw:
+                with gzip.GzipFile(fileobj=raw, mode="wb", mtime=0) as fd:
+                    fd.write(text)
+        else:
+            write_file(os.path.join(root, "g%05d.txt" % i), text)
+
+
+CORPORA = [
+    ("deep", gen_deep),
+    ("flat", gen_flat),
+    ("tiny", gen_tiny),
+    ("giant", gen_giant),
+    ("ignores", gen_ignores),
+    ("gzip", gen_gzip),
+]
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Generate benchmark corpora for ag")
+    parser.add_argument("dir", help="where to put the corpora")
+    parser.add_argument("--seed", type=int, default=1, help="random seed (default: 1)")
+    parser.add_argument("--scale", type=float, default=1.0, help="multiply file counts and sizes (default: 1.0)")
+    parser.add_argument("--only", help="comma-separated corpora to generate (default: all)")
+    args = parser.parse_args()
+
+    wanted = args.only.split(",") if args.only else [name for name, _ in CORPORA]
+    for name in wanted:
+        if name not in dict(CORPORA):
+            sys.exit("Unknown corpus %s" % name)
+
+    if not os.path.isdir(args.dir):
+        os.makedirs(args.dir)
+    for name, gen in CORPORA:
+        if name not in wanted:
+            continue
+        path = os.path.join(args.dir, name)
+        stamp_path = os.path.join(args.dir, name + ".json")
+        stamp = {"version": VERSION, "seed": args.seed, "scale": args.scale}
+        try:
+            with open(stamp_path) as fd:
+                if json.load(fd) == stamp and os.path.isdir(path):
+                    print("%s: up to date" % name)
+                    continue
+        except (IOError, ValueError):
+            pass
+        print("%s: generating" % name)
+        if os.path.exists(path):
+            shutil.rmtree(path)
+        # Each corpus gets its own generator so that generating one doesn't
+        # change the others
+        gen(path, random.Random("%d-%s" % (args.seed, name)), args.scale)
+        with open(stamp_path, "w") as fd:
+            json.dump(stamp, fd)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,586 @@
+/* Time ag's hot functions on their own, so a change to one of them can be
+ * judged by how much faster (or slower) it makes it.
+ *
+ * Each benchmark is calibrated to run in batches of at least
+ * MIN_BATCH_SECONDS, warmed up for WARMUP_SECONDS, then timed for a number
+ * of batches. The median batch is reported, in ns per byte searched or ns
+ * per call. All inputs are generated from a fixed seed.
+ */
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+
+#include "decompress.h"
+#include "ignore.h"
+#include "log.h"
+#include "options.h"
+#include "print.h"
+#include "scandir.h"
+#include "stats.h"
+#include "util.h"
+
+#define MIN_BATCH_SECONDS 0.01
+#define WARMUP_SECONDS 0.05
+#define DEFAULT_SAMPLES 15
+#define MAX_SAMPLES 1000
+
+typedef enum {
+    UNIT_BYTE,
+    UNIT_CALL
+} bench_unit_t;
+
+typedef struct {
+    char name[128];
+    bench_unit_t unit;
+    double units_per_call; /* Bytes per call for UNIT_BYTE */
+    void (*fn)(void *ctx);
+    void *ctx;
+} bench_t;
+
+/* Results go here so the compiler can't throw the work away */
+static volatile size_t sink;
+
+static int samples_len = DEFAULT_SAMPLES;
+static const char *filter = NULL;
+static FILE *json_fp = NULL;
+static int json_count = 0;
+
+static unsigned long rng_state = 1;
+
+static unsigned long rng(void) {
+    rng_state = rng_state * 6364136223846793005UL + 1442695040888963407UL;
+    return rng_state >> 33;
+}
+
+static const char *words[] = {
+    "int", "char", "void", "static", "const", "return", "buffer", "length",
+    "offset", "path", "file", "match", "search", "query", "result", "error",
+    "value", "index", "count", "size", "start", "end", "next", "node", "list",
+    "queue", "worker", "thread", "lock", "free", "malloc", "Realloc", "Debug"
+};
+
+/* Source-code-looking text. Never contains '#', so needles ending in '#'
+ * are never found and every search scans the whole buffer.
+ */
+static char *make_text(const size_t len) {
+    char *buf = ag_malloc(len + 1);
+    size_t pos = 0;
+
+    while (pos < len) {
+        const char *word = words[rng() % (sizeof(words) / sizeof(words[0]))];
+        size_t word_len = strlen(word);
+        char sep = rng() % 8 == 0 ? '\n' : ' ';
+        if (pos + word_len + 1 > len) {
+            memset(buf + pos, 'x', len - pos);
+            pos = len;
+            break;
+        }
+        memcpy(buf + pos, word, word_len);
+        pos += word_len;
+        buf[pos++] = sep;
+    }
+    buf[len] = '\0';
+    return buf;
+}
+
+static double run_batch(const bench_t *b, const size_t iters) {
+    double start = stats_now();
+    size_t i;
+
+    for (i = 0; i < iters; i++) {
+        b->fn(b->ctx);
+    }
+    return stats_now() - start;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void run_bench(const bench_t *b) {
+    double samples[MAX_SAMPLES];
+    double per_unit;
+    double start;
+    size_t iters = 1;
+    int i;
+
+    if (filter != NULL && strstr(b->name, filter) == NULL) {
+        return;
+    }
+
+    while (run_batch(b, iters) < MIN_BATCH_SECONDS) {
+        iters *= 2;
+    }
+    start = stats_now();
+    while (stats_now() - start < WARMUP_SECONDS) {
+        run_batch(b, iters);
+    }
+    for (i = 0; i < samples_len; i++) {
+        samples[i] = run_batch(b, iters) * 1e9 / (iters * b->units_per_call);
+    }
+    qsort(samples, samples_len, sizeof(double), &compare_doubles);
+    per_unit = samples[samples_len / 2];
+
+    printf("%-52s %12.4f %s (min %.4f)\n", b->name, per_unit,
+           b->unit == UNIT_BYTE ? "ns/byte" : "ns/call", samples[0]);
+    fflush(stdout);
+
+    if (json_fp != NULL) {
+        fprintf(json_fp, "%s\n    \"%s\": { \"unit\": \"%s\", \"median\": %f, \"samples\": [",
+                json_count++ == 0 ? "" : ",", b->name, b->unit == UNIT_BYTE ? "ns/byte" : "ns/call", per_unit);
+        for (i = 0; i < samples_len; i++) {
+            fprintf(json_fp, "%s%f", i == 0 ? "" : ", ", samples[i]);
+        }
+        fprintf(json_fp, "] }");
+    }
+}
+
+/* boyer_moore_strnstr() and boyer_moore_strncasestr() */
+
+typedef struct {
+    const char *buf;
+    size_t buf_len;
+    char *needle;
+    size_t needle_len;
+    size_t alpha_skip[256];
+    size_t *find_skip;
+    strncmp_fp strnstr_fp;
+} strnstr_ctx_t;
+
+static void bench_strnstr(void *ptr) {
+    strnstr_ctx_t *ctx = ptr;
+    sink += (size_t)ctx->strnstr_fp(ctx->buf, ctx->needle, ctx->buf_len, ctx->needle_len, ctx->alpha_skip, ctx->find_skip);
+}
+
+static void strnstr_benches(const char *text, const int case_sensitive) {
+    const size_t needle_lens[] = { 3, 8, 16, 64 };
+    const size_t buf_lens[] = { 4096, 1024 * 1024 };
+    strnstr_ctx_t ctx;
+    bench_t b;
+    size_t i, j, k;
+
+    for (i = 0; i < sizeof(needle_lens) / sizeof(needle_lens[0]); i++) {
+        for (j = 0; j < sizeof(buf_lens) / sizeof(buf_lens[0]); j++) {
+            memset(&ctx, 0, sizeof(ctx));
+            ctx.buf = text;
+            ctx.buf_len = buf_lens[j];
+            ctx.needle_len = needle_lens[i];
+            /* Start like the text does so there are plenty of partial matches */
+            ctx.needle = ag_malloc(ctx.needle_len + 1);
+            memcpy(ctx.needle, text + 100, ctx.needle_len - 1);
+            ctx.needle[ctx.needle_len - 1] = '#';
+            ctx.needle[ctx.needle_len] = '\0';
+            if (!case_sensitive) {
+                /* ag lowercases case-insensitive queries */
+                for (k = 0; k < ctx.needle_len; k++) {
+                    ctx.needle[k] = tolower((unsigned char)ctx.needle[k]);
+                }
+            }
+            generate_alpha_skip(ctx.needle, ctx.needle_len, ctx.alpha_skip, case_sensitive);
+            generate_find_skip(ctx.needle, ctx.needle_len, &ctx.find_skip, case_sensitive);
+            ctx.strnstr_fp = case_sensitive ? &boyer_moore_strnstr : &boyer_moore_strncasestr;
+
+            snprintf(b.name, sizeof(b.name), "%s/needle=%lu/buf=%lu",
+                     case_sensitive ? "boyer_moore_strnstr" : "boyer_moore_strncasestr",
+                     (unsigned long)ctx.needle_len, (unsigned long)ctx.buf_len);
+            b.unit = UNIT_BYTE;
+            b.units_per_call = ctx.buf_len;
+            b.fn = &bench_strnstr;
+            b.ctx = &ctx;
+            run_bench(&b);
+            free(ctx.needle);
+            free(ctx.find_skip);
+        }
+    }
+}
+
+/* is_binary() */
+
+typedef struct {
+    char *buf;
+    size_t buf_len;
+} buf_ctx_t;
+
+static void bench_is_binary(void *ptr) {
+    buf_ctx_t *ctx = ptr;
+    sink += is_binary(ctx->buf, ctx->buf_len);
+}
+
+static void is_binary_benches(const char *text) {
+    const char *kinds[] = { "text", "utf8", "binary" };
+    const size_t buf_lens[] = { 128, 512, 64 * 1024 };
+    buf_ctx_t ctx;
+    bench_t b;
+    size_t i, j, k;
+
+    for (i = 0; i < sizeof(kinds) / sizeof(kinds[0]); i++) {
+        for (j = 0; j < sizeof(buf_lens) / sizeof(buf_lens[0]); j++) {
+            ctx.buf_len = buf_lens[j];
+            ctx.buf = ag_malloc(ctx.buf_len);
+            memcpy(ctx.buf, text, ctx.buf_len);
+            for (k = 0; k + 2 < ctx.buf_len; k += 16) {
+                if (i == 1) {
+                    /* é */
+                    ctx.buf[k] = (char)0xc3;
+                    ctx.buf[k + 1] = (char)0xa9;
+                } else if (i == 2) {
+                    /* Suspicious, but no NUL to give it away right away */
+                    ctx.buf[k] = (char)(rng() % 31 + 1);
+                }
+            }
+            snprintf(b.name, sizeof(b.name), "is_binary/%s/buf=%lu", kinds[i], (unsigned long)ctx.buf_len);
+            b.unit = UNIT_CALL;
+            b.units_per_call = 1;
+            b.fn = &bench_is_binary;
+            b.ctx = &ctx;
+            run_bench(&b);
+            free(ctx.buf);
+        }
+    }
+}
+
+/* buf_getline() over every line of a buffer */
+
+static void bench_buf_getline(void *ptr) {
+    buf_ctx_t *ctx = ptr;
+    const char *line;
+    size_t offset = 0;
+    ssize_t line_len;
+
+    while (offset < ctx->buf_len) {
+        line_len = buf_getline(&line, ctx->buf, ctx->buf_len, offset);
+        offset += line_len + 1;
+        sink += line_len;
+    }
+}
+
+static void buf_getline_benches(char *text) {
+    const size_t buf_lens[] = { 4096, 1024 * 1024 };
+    buf_ctx_t ctx;
+    bench_t b;
+    size_t i;
+
+    for (i = 0; i < sizeof(buf_lens) / sizeof(buf_lens[0]); i++) {
+        ctx.buf = text;
+        ctx.buf_len = buf_lens[i];
+        snprintf(b.name, sizeof(b.name), "buf_getline/buf=%lu", (unsigned long)ctx.buf_len);
+        b.unit = UNIT_BYTE;
+        b.units_per_call = ctx.buf_len;
+        b.fn = &bench_buf_getline;
+        b.ctx = &ctx;
+        run_bench(&b);
+    }
+}
+
+/* invert_matches(). It works in place, so each call starts from a copy. */
+
+typedef struct {
+    const char *buf;
+    size_t buf_len;
+    match_t *orig;
+    match_t *matches;
+    size_t matches_len;
+} invert_ctx_t;
+
+static void bench_invert_matches(void *ptr) {
+    invert_ctx_t *ctx = ptr;
+    memcpy(ctx->matches, ctx->orig, (ctx->matches_len + 1) * sizeof(match_t));
+    sink += invert_matches(ctx->buf, ctx->buf_len, ctx->matches, ctx->matches_len);
+}
+
+static void invert_matches_benches(const char *text) {
+    const size_t matches_lens[] = { 1, 100, 10000 };
+    invert_ctx_t ctx;
+    bench_t b;
+    size_t i, j;
+    size_t pos;
+    const char *nl;
+
+    ctx.buf = text;
+    ctx.buf_len = 1024 * 1024;
+    for (i = 0; i < sizeof(matches_lens) / sizeof(matches_lens[0]); i++) {
+        ctx.matches_len = matches_lens[i];
+        ctx.orig = ag_calloc(ctx.matches_len + 1, sizeof(match_t));
+        ctx.matches = ag_calloc(ctx.matches_len + 1, sizeof(match_t));
+        /* Spread the matches out evenly, each a few bytes into a line */
+        for (j = 0; j < ctx.matches_len; j++) {
+            pos = ctx.buf_len / ctx.matches_len * j;
+            nl = memchr(text + pos, '\n', ctx.buf_len - pos);
+            pos = nl == NULL ? pos : (size_t)(nl - text) + 1;
+            ctx.orig[j].start = pos;
+            ctx.orig[j].end = pos + 3;
+        }
+        snprintf(b.name, sizeof(b.name), "invert_matches/matches=%lu/buf=%lu",
+                 (unsigned long)ctx.matches_len, (unsigned long)ctx.buf_len);
+        b.unit = UNIT_BYTE;
+        b.units_per_call = ctx.buf_len;
+        b.fn = &bench_invert_matches;
+        b.ctx = &ctx;
+        run_bench(&b);
+        free(ctx.orig);
+        free(ctx.matches);
+    }
+}
+
+/* Printing a file's matches as --vimgrep text or --json or --packed records, to /dev/null */
+
+typedef struct {
+    const char *buf;
+    size_t buf_len;
+    match_t *matches;
+    size_t matches_len;
+    strbuf_t records;
+} print_ctx_t;
+
+static void bench_print_vimgrep(void *ptr) {
+    print_ctx_t *ctx = ptr;
+    print_file_matches("dir/file.c", ctx->buf, ctx->buf_len, ctx->matches, ctx->matches_len);
+}
+
+static void bench_print_records(void *ptr) {
+    print_ctx_t *ctx = ptr;
+    ctx->records.len = 0;
+    print_records_file_matches(&ctx->records, "dir/file.c", NULL, ctx->buf, ctx->buf_len, ctx->matches, ctx->matches_len, FALSE);
+    fwrite(ctx->records.data, 1, ctx->records.len, out_fd);
+}
+
+static void print_benches(const char *text) {
+    const size_t matches_lens[] = { 100, 10000 };
+    print_ctx_t ctx;
+    bench_t b;
+    FILE *stdout_fd = out_fd;
+    size_t i, j;
+    size_t pos;
+    const char *nl;
+
+    out_fd = fopen("/dev/null", "w");
+    if (out_fd == NULL) {
+        die("Failed to open /dev/null: %s", strerror(errno));
+    }
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.buf = text;
+    ctx.buf_len = 1024 * 1024;
+    opts.print_path = PATH_PRINT_NOTHING;
+    opts.print_line_numbers = TRUE;
+    opts.print_break = FALSE;
+    for (i = 0; i < sizeof(matches_lens) / sizeof(matches_lens[0]); i++) {
+        ctx.matches_len = matches_lens[i];
+        ctx.matches = ag_calloc(ctx.matches_len, sizeof(match_t));
+        for (j = 0; j < ctx.matches_len; j++) {
+            pos = ctx.buf_len / ctx.matches_len * j;
+            nl = memchr(text + pos, '\n', ctx.buf_len - pos);
+            pos = nl == NULL ? pos : (size_t)(nl - text) + 1;
+            ctx.matches[j].start = pos;
+            ctx.matches[j].end = pos + 3;
+        }
+        b.unit = UNIT_BYTE;
+        b.units_per_call = ctx.buf_len;
+        b.ctx = &ctx;
+        snprintf(b.name, sizeof(b.name), "print/vimgrep/matches=%lu", (unsigned long)ctx.matches_len);
+        opts.vimgrep = TRUE;
+        b.fn = &bench_print_vimgrep;
+        run_bench(&b);
+        opts.vimgrep = FALSE;
+        snprintf(b.name, sizeof(b.name), "print/json/matches=%lu", (unsigned long)ctx.matches_len);
+        b.fn = &bench_print_records;
+        run_bench(&b);
+        snprintf(b.name, sizeof(b.name), "print/packed/matches=%lu", (unsigned long)ctx.matches_len);
+        opts.packed = TRUE;
+        opts.packed_lines = TRUE;
+        run_bench(&b);
+        opts.packed = FALSE;
+        free(ctx.matches);
+    }
+    free(ctx.records.data);
+    print_packed_cleanup();
+    fclose(out_fd);
+    out_fd = stdout_fd;
+}
+
+/* filename_filter(), which is mostly path_ignore_search() */
+
+#define FILTER_NAMES 64
+
+typedef struct {
+    scandir_baton_t baton;
+    struct dirent dirents[FILTER_NAMES];
+} filter_ctx_t;
+
+static void bench_filename_filter(void *ptr) {
+    filter_ctx_t *ctx = ptr;
+    int i;
+
+    for (i = 0; i < FILTER_NAMES; i++) {
+        sink += filename_filter("./src/sub", &ctx->dirents[i], &ctx->baton);
+    }
+}
+
+static void filename_filter_benches(void) {
+    const size_t pattern_counts[] = { 10, 100, 1000 };
+    filter_ctx_t ctx;
+    ignores *ig;
+    bench_t b;
+    char pattern[64];
+    size_t i, j;
+
+    for (i = 0; i < sizeof(pattern_counts) / sizeof(pattern_counts[0]); i++) {
+        ig = init_ignore(NULL, "", 0);
+        /* The same mix of extensions, names, globs and paths as a big .gitignore */
+        for (j = 0; j < pattern_counts[i]; j++) {
+            switch (j % 5) {
+                case 0:
+                    snprintf(pattern, sizeof(pattern), "*.gen%lu", (unsigned long)j);
+                    break;
+                case 1:
+                    snprintf(pattern, sizeof(pattern), "build%lu", (unsigned long)j);
+                    break;
+                case 2:
+                    snprintf(pattern, sizeof(pattern), "cache%lu_*.tmp", (unsigned long)j);
+                    break;
+                case 3:
+                    snprintf(pattern, sizeof(pattern), "/src/out%lu", (unsigned long)j);
+                    break;
+                default:
+                    snprintf(pattern, sizeof(pattern), "src/sub/gen%lu/*", (unsigned long)j);
+                    break;
+            }
+            add_ignore_pattern(ig, pattern);
+        }
+        memset(&ctx, 0, sizeof(ctx));
+        ctx.baton.ig = ig;
+        ctx.baton.base_path = "./";
+        ctx.baton.base_path_len = 2;
+        for (j = 0; j < FILTER_NAMES; j++) {
+            /* A quarter of them are ignored */
+            switch (j % 4) {
+                case 0:
+                    snprintf(ctx.dirents[j].d_name, sizeof(ctx.dirents[j].d_name), "file%lu.gen%lu",
+                             (unsigned long)j, (unsigned long)(j * 5 % pattern_counts[i]));
+                    break;
+                case 1:
+                    snprintf(ctx.dirents[j].d_name, sizeof(ctx.dirents[j].d_name), "search%lu.c", (unsigned long)j);
+                    break;
+                case 2:
+                    snprintf(ctx.dirents[j].d_name, sizeof(ctx.dirents[j].d_name), "README%lu", (unsigned long)j);
+                    break;
+                default:
+                    snprintf(ctx.dirents[j].d_name, sizeof(ctx.dirents[j].d_name), "util%lu.h", (unsigned long)j);
+                    break;
+            }
+#ifdef HAVE_DIRENT_DTYPE
+            /* Keep is_symlink() from calling lstat() */
+            ctx.dirents[j].d_type = DT_REG;
+#endif
+#ifdef HAVE_DIRENT_DNAMLEN
+            ctx.dirents[j].d_namlen = strlen(ctx.dirents[j].d_name);
+#endif
+        }
+        snprintf(b.name, sizeof(b.name), "filename_filter/patterns=%lu", (unsigned long)pattern_counts[i]);
+        b.unit = UNIT_CALL;
+        b.units_per_call = FILTER_NAMES;
+        b.fn = &bench_filename_filter;
+        b.ctx = &ctx;
+        run_bench(&b);
+        cleanup_ignore(ig);
+    }
+}
+
+/* is_zipped() */
+
+static void bench_is_zipped(void *ptr) {
+    buf_ctx_t *ctx = ptr;
+    sink += is_zipped(ctx->buf, ctx->buf_len);
+}
+
+static void is_zipped_benches(const char *text) {
+    const char *kinds[] = { "text", "gzip", "xz" };
+    const unsigned char gzip_magic[] = { 0x1f, 0x8b, 0x08 };
+    const unsigned char xz_magic[] = { 0xfd, '7', 'z', 'X', 'Z', 0x00 };
+    buf_ctx_t ctx;
+    bench_t b;
+    size_t i;
+
+    for (i = 0; i < sizeof(kinds) / sizeof(kinds[0]); i++) {
+        ctx.buf_len = 4096;
+        ctx.buf = ag_malloc(ctx.buf_len);
+        memcpy(ctx.buf, text, ctx.buf_len);
+        if (i == 1) {
+            memcpy(ctx.buf, gzip_magic, sizeof(gzip_magic));
+        } else if (i == 2) {
+            memcpy(ctx.buf, xz_magic, sizeof(xz_magic));
+        }
+        snprintf(b.name, sizeof(b.name), "is_zipped/%s", kinds[i]);
+        b.unit = UNIT_CALL;
+        b.units_per_call = 1;
+        b.fn = &bench_is_zipped;
+        b.ctx = &ctx;
+        run_bench(&b);
+        free(ctx.buf);
+    }
+}
+
+static void microbench_usage(void) {
+    printf("Usage: ag_microbench [--samples NUM] [--filter STRING] [--json FILE]\n\
+\n\
+  --samples NUM     Time NUM batches of each benchmark (Default: %i)\n\
+  --filter STRING   Only run benchmarks whose names contain STRING\n\
+  --json FILE       Also write the results to FILE as JSON\n",
+           DEFAULT_SAMPLES);
+}
+
+int main(int argc, char **argv) {
+    char *text;
+    int i;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--samples") == 0 && i + 1 < argc) {
+            samples_len = atoi(argv[++i]);
+            if (samples_len < 1 || samples_len > MAX_SAMPLES) {
+                die("Invalid sample count. Must be between 1 and %i\n", MAX_SAMPLES);
+            }
+        } else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+            filter = argv[++i];
+        } else if (strcmp(argv[i], "--json") == 0 && i + 1 < argc) {
+            json_fp = strcmp(argv[++i], "-") == 0 ? stdout : fopen(argv[i], "w");
+            if (json_fp == NULL) {
+                die("Failed to open %s: %s", argv[i], strerror(errno));
+            }
+        } else {
+            microbench_usage();
+            return strcmp(argv[i], "--help") == 0 ? 0 : 1;
+        }
+    }
+
+    set_log_level(LOG_LEVEL_WARN);
+    init_options();
+    out_fd = stdout;
+    text = make_text(1024 * 1024);
+
+    if (json_fp != NULL) {
+        fprintf(json_fp, "{\n  \"samples\": %i,\n  \"benchmarks\": {", samples_len);
+    }
+    strnstr_benches(text, TRUE);
+    strnstr_benches(text, FALSE);
+    is_binary_benches(text);
+    buf_getline_benches(text);
+    invert_matches_benches(text);
+    print_benches(text);
+    filename_filter_benches();
+    is_zipped_benches(text);
+    if (json_fp != NULL) {
+        fprintf(json_fp, "\n  }\n}\n");
+        if (json_fp != stdout) {
+            fclose(json_fp);
+        }
+    }
+
+    free(text);
+    cleanup_options();
+    return 0;
+}
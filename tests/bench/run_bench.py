@@ -0,0 +1,187 @@
+#!/usr/bin/env python3
+
+# Search the corpora from gen_corpus.py with a matrix of queries and write
+# what each scenario took as JSON. Every scenario is run --runs times after
+# one untimed warmup run, and the median is reported.
+#
+# Files and bytes searched come from ag's own --stats-json, so files/s and
+# GB/s count what ag actually read (not what it ignored or skipped).
+#
+# With --baseline, the results are compared against an earlier run's JSON
+# (see compare_bench.py) and the exit status is 1 if anything got slower.
+
+import argparse
+import json
+import os
+import platform
+import re
+import resource
+import subprocess
+import sys
+import tempfile
+import time
+
+import compare_bench
+
+# Query types, run against the deep corpus. Each one is a list of arguments.
+QUERIES = [
+    ("literal", ["-Q", "needle"]),
+    ("ignore_case", ["-i", "needle"]),
+    ("word", ["-w", "needle"]),
+    ("regex", ["find[A-Z]\\w+\\("]),
+    ("multiline", ["begin_block\\s+\\w+;\\s+end_block"]),
+    ("invert", ["-v", "-c", "needle"]),
+    ("files_with_matches", ["-l", "needle"]),
+    ("type_filter", ["--python", "needle"]),
+]
+
+# The other corpora each stress one thing, so a literal and a regex search
+# is enough for them. gzip only means something with -z.
+CORPUS_QUERIES = {
+    "flat": ["literal", "regex"],
+    "tiny": ["literal", "regex"],
+    "giant": ["literal", "regex"],
+    "ignores": ["literal", "regex"],
+    "gzip": ["literal", "regex"],
+}
+CORPUS_ARGS = {
+    "gzip": ["-z"],
+}
+
+
+def scenarios(corpus_dir):
+    queries = dict(QUERIES)
+    result = []
+    for name, args in QUERIES:
+        result.append(("deep/" + name, args, os.path.join(corpus_dir, "deep")))
+    for corpus in sorted(CORPUS_QUERIES):
+        for name in CORPUS_QUERIES[corpus]:
+            args = CORPUS_ARGS.get(corpus, []) + queries[name]
+            result.append(("%s/%s" % (corpus, name), args, os.path.join(corpus_dir, corpus)))
+    return result
+
+
+def run_once(ag, args, path, stats_path):
+    cmd = [ag, "--nocolor", "--stats-json", stats_path] + args + [path]
+    before = resource.getrusage(resource.RUSAGE_CHILDREN)
+    start = time.perf_counter()
+    with open(os.devnull, "w") as devnull:
+        rv = subprocess.call(cmd, stdout=devnull)
+    wall = time.perf_counter() - start
+    after = resource.getrusage(resource.RUSAGE_CHILDREN)
+    if rv not in (0, 1):
+        sys.exit("%s exited with %d" % (" ".join(cmd), rv))
+    cpu = (after.ru_utime - before.ru_utime) + (after.ru_stime - before.ru_stime)
+    with open(stats_path) as fd:
+        stats = json.load(fd)
+    return wall, cpu, stats
+
+
+def run_scenario(ag, args, path, runs, stats_path):
+    run_once(ag, args, path, stats_path)  # Warm the page cache
+    walls = []
+    cpus = []
+    stats = None
+    for _ in range(runs):
+        wall, cpu, stats = run_once(ag, args, path, stats_path)
+        walls.append(wall)
+        cpus.append(cpu)
+    wall = compare_bench.median(walls)
+    return {
+        "args": args,
+        "wall_seconds": walls,
+        "cpu_seconds": cpus,
+        "wall_median": wall,
+        "wall_mad": compare_bench.mad(walls),
+        "cpu_median": compare_bench.median(cpus),
+        "cpu_mad": compare_bench.mad(cpus),
+        "files": stats["files_searched"],
+        "bytes": stats["bytes_searched"],
+        "files_per_second": stats["files_searched"] / wall if wall > 0 else 0,
+        "gb_per_second": stats["bytes_searched"] / wall / 1e9 if wall > 0 else 0,
+    }
+
+
+def ag_version(ag):
+    out = subprocess.check_output([ag, "--version"]).decode("utf-8", "replace")
+    return out.splitlines()[0] if out else ""
+
+
+def corpus_info(corpus_dir):
+    info = {}
+    for name in sorted(os.listdir(corpus_dir)):
+        if name.endswith(".json"):
+            with open(os.path.join(corpus_dir, name)) as fd:
+                info[name[:-5]] = json.load(fd)
+    return info
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Benchmark ag on the corpora from gen_corpus.py")
+    parser.add_argument("--ag", default="./ag", help="ag binary to benchmark (default: ./ag)")
+    parser.add_argument("--corpus", required=True, help="directory gen_corpus.py wrote to")
+    parser.add_argument("--output", help="write results to this JSON file")
+    parser.add_argument("--runs", type=int, default=5, help="timed runs per scenario (default: 5)")
+    parser.add_argument("--filter", help="only run scenarios matching this regex")
+    parser.add_argument("--ag-args", default="", help="extra arguments for every ag run, e.g. '--workers 4'")
+    parser.add_argument("--baseline", help="compare against results from an earlier run and exit 1 on a regression")
+    parser.add_argument("--metric", choices=["wall", "cpu"], default="wall",
+                        help="which time to compare against the baseline (default: wall)")
+    compare_bench.add_arguments(parser)
+    args = parser.parse_args()
+
+    if args.runs < 1:
+        sys.exit("--runs must be at least 1")
+    if args.baseline:
+        # Fail now rather than after the whole suite has run
+        baseline = compare_bench.load_samples(args.baseline, args.metric)
+    extra = args.ag_args.split()
+    results = {
+        "ag_version": ag_version(args.ag),
+        "ag_args": extra,
+        "machine": {
+            "platform": platform.platform(),
+            "cpus": os.cpu_count(),
+        },
+        "corpus": corpus_info(args.corpus),
+        "runs": args.runs,
+        "scenarios": {},
+    }
+
+    fd, stats_path = tempfile.mkstemp(suffix=".json")
+    os.close(fd)
+    try:
+        print("%-28s %10s %10s %12s %8s" % ("scenario", "wall s", "cpu s", "files/s", "GB/s"))
+        for name, ag_args, path in scenarios(args.corpus):
+            if args.filter and not re.search(args.filter, name):
+                continue
+            if not os.path.isdir(path):
+                print("%-28s skipped: %s doesn't exist" % (name, path))
+                continue
+            r = run_scenario(args.ag, extra + ag_args, path, args.runs, stats_path)
+            results["scenarios"][name] = r
+            print("%-28s %10.4f %10.4f %12.0f %8.3f" % (
+                name, r["wall_median"], r["cpu_median"], r["files_per_second"], r["gb_per_second"]))
+            sys.stdout.flush()
+    finally:
+        os.unlink(stats_path)
+
+    if args.output:
+        with open(args.output, "w") as fd:
+            json.dump(results, fd, indent=2, sort_keys=True)
+            fd.write("\n")
+        print("Wrote %s" % args.output)
+
+    if args.baseline:
+        key = "%s_seconds" % args.metric
+        current = dict((name, r[key]) for name, r in results["scenarios"].items())
+        if args.filter:
+            baseline = dict((name, s) for name, s in baseline.items() if re.search(args.filter, name))
+        print("")
+        compared = compare_bench.compare(baseline, current, args.threshold, args.sigmas)
+        if compare_bench.print_report(compared):
+            sys.exit(1)
+
+
+if __name__ == "__main__":
+    main()
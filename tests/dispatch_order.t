@@ -0,0 +1,38 @@
+Setup:
+
+  $ . $TESTDIR/setup.sh
+  $ mkdir -p dispatch_dir
+  $ for i in e b d a c; do printf "foo\n" > dispatch_dir/$i.txt; done
+
+Inode order:
+
+  $ ag --dispatch-order inode -l foo dispatch_dir > got
+  $ ls -i dispatch_dir | sort -n | awk '{ print "dispatch_dir/" $2 }' > want
+  $ diff want got
+
+Extent order searches the same files:
+
+  $ ag --dispatch-order extent -l foo dispatch_dir | sort
+  dispatch_dir/a.txt
+  dispatch_dir/b.txt
+  dispatch_dir/c.txt
+  dispatch_dir/d.txt
+  dispatch_dir/e.txt
+
+Invalid order:
+
+  $ ag --dispatch-order random foo dispatch_dir
+  ERR: Invalid dispatch order 'random'. Must be readdir, inode, size or extent.
+  
+  [2]
+
+Biggest files first:
+
+  $ mkdir -p size_dir
+  $ printf "foo\n" > size_dir/small.txt
+  $ printf "foo\nfoo foo foo\n" > size_dir/big.txt
+  $ printf "foo\nfoo\n" > size_dir/medium.txt
+  $ ag --dispatch-order size -l foo size_dir
+  size_dir/big.txt
+  size_dir/medium.txt
+  size_dir/small.txt
@@ -13,3 +13,48 @@ Match only top file type:
   $ TEST_FILETYPE_OPTION=`ag --list-file-types | grep -E '^[ \t]+--.+' | head -n 1 | awk '{ print $1 }'`
   $ ag 'This is filetype test' --nofilename $TEST_FILETYPE_OPTION $TEST_FILETYPE_DIR
   This is filetype test1.
+
+Combine file types with each other and with -G:
+
+  $ mkdir types
+  $ printf "needle\n" > types/a.c
+  $ printf "needle\n" > types/b.h
+  $ printf "needle\n" > types/c.py
+  $ printf "needle\n" > types/d.C
+  $ printf "needle\n" > types/e.c.txt
+  $ ag -l needle --cc --python types | sort
+  types/a.c
+  types/b.h
+  types/c.py
+  $ ag -l needle --cc -G 'a\.' types
+  types/a.c
+
+Sniff the types of extensionless files from their first line:
+
+  $ mkdir bin
+  $ printf '#!/usr/bin/env python3\nneedle\n' > bin/tool
+  $ printf '#!/bin/bash\nneedle\n' > bin/run
+  $ printf '# -*- mode: python; coding: utf-8 -*-\nneedle\n' > bin/emacs
+  $ printf '# vim: set ft=ruby:\nneedle\n' > bin/vim
+  $ printf 'needle\n' > bin/plain
+  $ printf '#!/usr/bin/python\nneedle\n' > bin/tool.txt
+  $ ag -l needle --python bin
+  [1]
+  $ ag -l needle --python --sniff-types bin | sort
+  bin/emacs
+  bin/tool
+  $ ag -l needle --shell --ruby --sniff-types bin | sort
+  bin/run
+  bin/vim
+
+Each file is sniffed once, and other paths to it get the same answer:
+
+  $ ln bin/tool bin/tool2
+  $ ln bin/run bin/run2
+  $ ag -l needle --python --sniff-types bin | sort
+  bin/emacs
+  bin/tool
+  bin/tool2
+  $ ag -l needle --shell --sniff-types bin | sort
+  bin/run
+  bin/run2
@@ -0,0 +1,54 @@
+Setup:
+
+  $ . $TESTDIR/setup.sh
+  $ mkdir -p io_uring_dir/sub
+  $ printf "foo\nbar\n" > io_uring_dir/a.txt
+  $ printf "bar\nfoo bar\n" > io_uring_dir/sub/b.txt
+  $ touch io_uring_dir/empty.txt
+  $ printf "%0100d\nfoo\n" 0 > io_uring_dir/big.txt
+
+Skip if this build or kernel can't use io_uring:
+
+  $ if ! ag --version | grep -q '+io_uring' ||
+  >    ag --io-uring foo io_uring_dir 2>&1 >/dev/null | grep -q 'io_uring'; then
+  >   echo "io_uring isn't available. Skipping test."
+  >   exit 80
+  > fi
+
+--stats-json says how many files io_uring read, so a silent fallback fails:
+
+  $ alias uring_files="grep files_read_with_io_uring"
+
+Same results as without io_uring:
+
+  $ ag --io-uring foo io_uring_dir | sort
+  io_uring_dir/a.txt:1:foo
+  io_uring_dir/big.txt:2:foo
+  io_uring_dir/sub/b.txt:2:foo bar
+  $ ag --io-uring --stats-json - foo io_uring_dir | uring_files
+    "files_read_with_io_uring": 3,
+
+Files over the mmap threshold are still mmapped:
+
+  $ ag --io-uring-depth 1 --mmap-threshold 50 foo io_uring_dir | sort
+  io_uring_dir/a.txt:1:foo
+  io_uring_dir/big.txt:2:foo
+  io_uring_dir/sub/b.txt:2:foo bar
+  $ ag --io-uring-depth 1 --mmap-threshold 50 --stats-json - foo io_uring_dir | uring_files
+    "files_read_with_io_uring": 2,
+
+  $ ag --io-uring --nommap -c bar io_uring_dir | sort
+  io_uring_dir/a.txt:1
+  io_uring_dir/sub/b.txt:2
+
+Without --io-uring, it isn't used:
+
+  $ ag --stats-json - foo io_uring_dir | uring_files
+    "files_read_with_io_uring": 0,
+
+Invalid depth:
+
+  $ ag --io-uring-depth 0 foo io_uring_dir
+  ERR: Invalid io_uring depth
+  
+  [2]
@@ -0,0 +1,74 @@
+Setup:
+
+  $ . $TESTDIR/setup.sh
+  $ printf 'one\nfoo two foo\nthree\nfour\nfive foo\nsix\n' > a.txt
+  $ printf 'tab\there "quoted" back\\slash foo\n' > b.txt
+
+Every match gets a record, and each file a begin and an end:
+
+  $ ag --json foo a.txt
+  {"type":"begin","path":"a.txt"}
+  {"type":"match","path":"a.txt","line_number":2,"offset":4,"lines":"foo two foo","submatches":[{"start":0,"end":3},{"start":8,"end":11}]}
+  {"type":"match","path":"a.txt","line_number":5,"offset":27,"lines":"five foo","submatches":[{"start":5,"end":8}]}
+  {"type":"end","path":"a.txt","matches":3,"bytes":40}
+
+Context lines:
+
+  $ ag --json -C1 foo a.txt
+  {"type":"begin","path":"a.txt"}
+  {"type":"context","path":"a.txt","line_number":1,"offset":0,"lines":"one"}
+  {"type":"match","path":"a.txt","line_number":2,"offset":4,"lines":"foo two foo","submatches":[{"start":0,"end":3},{"start":8,"end":11}]}
+  {"type":"context","path":"a.txt","line_number":3,"offset":16,"lines":"three"}
+  {"type":"context","path":"a.txt","line_number":4,"offset":22,"lines":"four"}
+  {"type":"match","path":"a.txt","line_number":5,"offset":27,"lines":"five foo","submatches":[{"start":5,"end":8}]}
+  {"type":"context","path":"a.txt","line_number":6,"offset":36,"lines":"six"}
+  {"type":"end","path":"a.txt","matches":3,"bytes":40}
+
+A match over several lines is one record:
+
+  $ ag --json 'two foo\nthree' a.txt
+  {"type":"begin","path":"a.txt"}
+  {"type":"match","path":"a.txt","line_number":2,"offset":4,"lines":"foo two foo\nthree","submatches":[{"start":4,"end":17}]}
+  {"type":"end","path":"a.txt","matches":1,"bytes":40}
+
+Escaping:
+
+  $ ag --json foo b.txt
+  {"type":"begin","path":"b.txt"}
+  {"type":"match","path":"b.txt","line_number":1,"offset":0,"lines":"tab\there \"quoted\" back\\slash foo","submatches":[{"start":29,"end":32}]}
+  {"type":"end","path":"b.txt","matches":1,"bytes":33}
+
+Inverted matches are one record per line, and each line counts as a match:
+
+  $ ag --json -v 'o|i' a.txt
+  {"type":"begin","path":"a.txt"}
+  {"type":"match","path":"a.txt","line_number":3,"offset":16,"lines":"three","submatches":[{"start":0,"end":5}]}
+  {"type":"end","path":"a.txt","matches":1,"bytes":40}
+  $ ag --json -v foo a.txt
+  {"type":"begin","path":"a.txt"}
+  {"type":"match","path":"a.txt","line_number":1,"offset":0,"lines":"one","submatches":[{"start":0,"end":3}]}
+  {"type":"match","path":"a.txt","line_number":3,"offset":16,"lines":"three","submatches":[{"start":0,"end":5}]}
+  {"type":"match","path":"a.txt","line_number":4,"offset":22,"lines":"four","submatches":[{"start":0,"end":4}]}
+  {"type":"match","path":"a.txt","line_number":6,"offset":36,"lines":"six","submatches":[{"start":0,"end":3}]}
+  {"type":"end","path":"a.txt","matches":4,"bytes":40}
+
+Lines and paths that aren't UTF-8 are base64 instead:
+
+  $ printf 'caf\351 foo\nna\303\257ve foo\n' > latin1.txt
+  $ ag --json caf latin1.txt
+  {"type":"begin","path":"latin1.txt"}
+  {"type":"match","path":"latin1.txt","line_number":1,"offset":0,"lines_base64":"Y2Fm6SBmb28=","submatches":[{"start":0,"end":3}]}
+  {"type":"end","path":"latin1.txt","matches":1,"bytes":20}
+  $ ag --json foo latin1.txt | python3 -c 'import sys, json; print(ascii([json.loads(l).get("lines") for l in sys.stdin][1:3]))'
+  [None, 'na\xefve foo']
+  $ mkdir names && printf 'foo\n' > "names/$(printf 'caf\351')"
+  $ ag --json -l foo names
+  {"type":"file","path_base64":"bmFtZXMvY2Fm6Q==","matches":1}
+
+Files only:
+
+  $ ag --json -c foo a.txt b.txt
+  {"type":"file","path":"a.txt","matches":3}
+  {"type":"file","path":"b.txt","matches":1}
+  $ ag --json -g a.txt
+  {"type":"file","path":"a.txt","matches":1}
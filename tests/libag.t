@@ -0,0 +1,62 @@
+Setup:
+
+  $ . $TESTDIR/setup.sh
+  $ alias libag_search="$TESTDIR/../libag_search"
+  $ mkdir libag_dir
+  $ printf "foo bar\nbaz\nfoo foo\n" > libag_dir/a.txt
+  $ printf "nothing\n" > libag_dir/b.txt
+
+Results come with their line and where the match is in it:
+
+  $ libag_search --workers 1 -- foo libag_dir
+  libag_dir/a.txt:1:0-3:foo bar
+  libag_dir/a.txt:3:0-3:foo foo
+  libag_dir/a.txt:3:4-7:foo foo
+
+Options work the same as for ag:
+
+  $ libag_search --workers 1 -i -w -- BAZ libag_dir/a.txt
+  libag_dir/a.txt:2:0-3:baz
+  $ libag_search --workers 1 -v -- foo libag_dir/a.txt
+  libag_dir/a.txt:2:0-3:baz
+  $ libag_search --workers 1 -c -- foo libag_dir/a.txt
+  libag_dir/a.txt:3
+
+Including --io-uring, which reads files normally if io_uring fails:
+
+  $ libag_search --workers 1 --io-uring -- foo libag_dir 2> /dev/null
+  libag_dir/a.txt:1:0-3:foo bar
+  libag_dir/a.txt:3:0-3:foo foo
+  libag_dir/a.txt:3:4-7:foo foo
+
+Regexes, including ones that span lines:
+
+  $ libag_search --workers 1 -- 'ba[rz]\nba' libag_dir/a.txt
+  libag_dir/a.txt:1:4-10:foo bar
+
+An invalid regex is an error instead of exiting:
+
+  $ libag_search -- 'foo(' libag_dir | head -n 1 | cut -d: -f1
+  Bad regex! pcre_compile() failed at position 4
+  $ libag_search -- 'foo(' libag_dir > /dev/null
+  [1]
+
+So are invalid options, and options only ag itself can use:
+
+  $ libag_search --no-such-option -- foo libag_dir
+  Unknown option or missing argument: --no-such-option
+  [1]
+  $ libag_search --max-total-count lots -- foo libag_dir
+  Invalid max total count
+  [1]
+  $ libag_search --help -- foo libag_dir
+  --help, --version and --list-file-types only work from the command line
+  [1]
+  $ libag_search --watch -- foo libag_dir
+  --watch only works from the command line
+  [1]
+
+No matches:
+
+  $ libag_search -- qux libag_dir
+  [1]
@@ -0,0 +1,151 @@
+/* Search with libag, for tests/libag.t:
+ *
+ *   libag_search [OPTION]... -- PATTERN PATH...
+ *
+ * OPTIONs are ag's. The same search runs in two threads at once, each with
+ * its own context and query, and both have to find the same results. Those
+ * are printed sorted, as PATH:LINE:START-END:LINE_TEXT, or PATH:MATCHES for
+ * results about a whole file. Errors are printed instead.
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libag.h"
+
+typedef struct {
+    int argc;
+    char **argv;
+    const char *pattern;
+    char **paths;
+    int paths_len;
+    char *out; /* What was found */
+    size_t out_len;
+    int matched;
+} search_t;
+
+static void append(search_t *search, const char *s, const size_t len) {
+    search->out = realloc(search->out, search->out_len + len + 1);
+    memcpy(search->out + search->out_len, s, len);
+    search->out_len += len;
+    search->out[search->out_len] = '\0';
+}
+
+static void got_result(const ag_result_t *result, void *baton) {
+    search_t *search = baton;
+    char buf[256];
+
+    append(search, result->path, strlen(result->path));
+    if (result->line_number == 0) {
+        snprintf(buf, sizeof(buf), ":%lu\n", (unsigned long)result->matches);
+        append(search, buf, strlen(buf));
+        return;
+    }
+    snprintf(buf, sizeof(buf), ":%lu:%lu-%lu:", (unsigned long)result->line_number,
+             (unsigned long)result->match_start, (unsigned long)result->match_end);
+    append(search, buf, strlen(buf));
+    append(search, result->line, result->line_len);
+    append(search, "\n", 1);
+}
+
+static int compare_lines(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* Workers find things in any order */
+static void sort_lines(search_t *search) {
+    char **lines = NULL;
+    size_t lines_len = 0;
+    char *sorted = malloc(search->out_len + 1);
+    char *line;
+    char *saveptr = NULL;
+    size_t pos = 0;
+    size_t i;
+
+    for (line = strtok_r(search->out, "\n", &saveptr); line != NULL; line = strtok_r(NULL, "\n", &saveptr)) {
+        lines = realloc(lines, (lines_len + 1) * sizeof(char *));
+        lines[lines_len++] = line;
+    }
+    qsort(lines, lines_len, sizeof(char *), &compare_lines);
+    for (i = 0; i < lines_len; i++) {
+        pos += sprintf(sorted + pos, "%s\n", lines[i]);
+    }
+    sorted[pos] = '\0';
+    free(lines);
+    free(search->out);
+    search->out = sorted;
+}
+
+static void append_error(search_t *search, char *error) {
+    append(search, error, strlen(error));
+    append(search, "\n", 1);
+    free(error);
+}
+
+static void *run_search(void *ptr) {
+    search_t *search = ptr;
+    ag_context_t *ctx;
+    ag_query_t *query;
+    char *error = NULL;
+
+    ctx = ag_context_new(search->argc, search->argv, &error);
+    if (ctx == NULL) {
+        append_error(search, error);
+        sort_lines(search);
+        return NULL;
+    }
+    ag_context_set_callback(ctx, &got_result, search);
+    query = ag_query_compile(ctx, search->pattern, &error);
+    if (query == NULL) {
+        append_error(search, error);
+    } else {
+        search->matched = ag_search(ctx, query, search->paths, search->paths_len, &error);
+        if (search->matched < 0) {
+            append_error(search, error);
+            search->matched = 0;
+        }
+        ag_query_free(query);
+    }
+    ag_context_free(ctx);
+    sort_lines(search);
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    search_t searches[2];
+    pthread_t threads[2];
+    int sep;
+    int i;
+
+    for (sep = 1; sep < argc && strcmp(argv[sep], "--") != 0; sep++) {
+    }
+    if (sep + 1 >= argc) {
+        fprintf(stderr, "Usage: libag_search [OPTION]... -- PATTERN PATH...\n");
+        return 2;
+    }
+
+    for (i = 0; i < 2; i++) {
+        memset(&searches[i], 0, sizeof(search_t));
+        searches[i].argc = sep;
+        searches[i].argv = argv;
+        searches[i].pattern = argv[sep + 1];
+        searches[i].paths = argv + sep + 2;
+        searches[i].paths_len = argc - sep - 2;
+        append(&searches[i], "", 0);
+        pthread_create(&threads[i], NULL, &run_search, &searches[i]);
+    }
+    for (i = 0; i < 2; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    if (strcmp(searches[0].out, searches[1].out) != 0 || searches[0].matched != searches[1].matched) {
+        fprintf(stderr, "Concurrent searches disagree:\n%s---\n%s", searches[0].out, searches[1].out);
+        return 2;
+    }
+    fputs(searches[0].out, stdout);
+    for (i = 0; i < 2; i++) {
+        free(searches[i].out);
+    }
+    return !searches[0].matched;
+}
@@ -0,0 +1,61 @@
+Setup:
+
+  $ . $TESTDIR/setup.sh
+  $ printf "blah\n" > blah.txt
+  $ printf "blah2\n" >> blah.txt
+  $ printf "blah3\n" >> blah.txt
+  $ printf "blah4\n" > blah2.txt
+  $ printf "blah5\n" >> blah2.txt
+
+Stop in the middle of a file:
+
+  $ ag --max-total-count 2 blah blah.txt
+  1:blah
+  2:blah2
+
+Stop after the first file:
+
+  $ ag --max-total-count 3 blah blah.txt blah2.txt
+  blah.txt:1:blah
+  blah.txt:2:blah2
+  blah.txt:3:blah3
+
+Carry the remaining budget into the next file:
+
+  $ ag --max-total-count 4 blah blah.txt blah2.txt
+  blah.txt:1:blah
+  blah.txt:2:blah2
+  blah.txt:3:blah3
+  blah2.txt:1:blah4
+
+Count files, not matches, with -l:
+
+  $ ag -l --max-total-count 1 blah blah.txt blah2.txt
+  blah.txt
+
+Each count is for the whole file with -c:
+
+  $ ag -c --max-total-count 1 blah blah.txt blah2.txt
+  blah.txt:3
+
+Regexes stop too:
+
+  $ ag --max-total-count 1 'blah[0-9]' blah.txt blah2.txt
+  blah.txt:2:blah2
+
+No limit is the default:
+
+  $ ag --max-total-count 0 blah blah2.txt
+  1:blah4
+  2:blah5
+
+Anything else is an error, not no limit:
+
+  $ ag --max-total-count -3 blah blah2.txt
+  ERR: Invalid max total count
+  
+  [2]
+  $ ag --max-total-count 2x blah blah2.txt
+  ERR: Invalid max total count
+  
+  [2]
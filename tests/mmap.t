@@ -0,0 +1,38 @@
+Setup:
+
+  $ . $TESTDIR/setup.sh
+  $ printf "foo\n" > mmap_test.txt
+  $ printf "bar\n" >> mmap_test.txt
+  $ printf "foo bar" >> mmap_test.txt
+
+Read small files by default:
+
+  $ ag foo mmap_test.txt
+  1:foo
+  3:foo bar
+
+Always mmap:
+
+  $ ag --mmap bar mmap_test.txt
+  2:bar
+  3:foo bar
+
+Never mmap:
+
+  $ ag --nommap bar mmap_test.txt
+  2:bar
+  3:foo bar
+  $ ag --no-mmap -v foo mmap_test.txt
+  2:bar
+
+Threshold:
+
+  $ ag --mmap-threshold 8 'foo$' mmap_test.txt
+  1:foo
+  $ ag --mmap-threshold 1000 'bar$' mmap_test.txt
+  2:bar
+  3:foo bar
+  $ ag --mmap-threshold nope foo mmap_test.txt
+  ERR: Invalid mmap threshold
+  
+  [2]
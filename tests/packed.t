@@ -0,0 +1,72 @@
+Setup:
+
+  $ . $TESTDIR/setup.sh
+  $ alias packed_dump="$TESTDIR/../packed_dump"
+  $ mkdir dir
+  $ printf 'one\nfoo two foo\nthree\nfour\nfive foo\nsix\n' > dir/a.txt
+  $ printf 'bar foo\nfoo\n' > dir/b.txt
+  $ printf 'foo\0bar\n' > dir/bin.dat
+
+The stream starts with a header:
+
+  $ ag --packed foo dir/a.txt | head -c 6
+  AGPK\x01\x01 (no-eol) (esc)
+
+Decoding it gives back what --vimgrep prints:
+
+  $ ag --packed foo dir | packed_dump | grep -v ' bytes' | sort > packed.txt
+  $ ag --vimgrep foo dir | sort > vimgrep.txt
+  $ diff packed.txt vimgrep.txt
+  $ cat packed.txt
+  dir/a.txt:2:1:foo two foo
+  dir/a.txt:2:9:foo two foo
+  dir/a.txt:5:6:five foo
+  dir/b.txt:1:5:bar foo
+  dir/b.txt:2:1:foo
+
+Context, and the end of each file:
+
+  $ ag --packed -C1 foo dir/a.txt | packed_dump
+  dir/a.txt-1-one
+  dir/a.txt:2:1:foo two foo
+  dir/a.txt:2:9:foo two foo
+  dir/a.txt-3-three
+  dir/a.txt-4-four
+  dir/a.txt:5:6:five foo
+  dir/a.txt-6-six
+  dir/a.txt: 3 matches, 40 bytes
+
+Without the lines, matches are offsets:
+
+  $ ag --packed-nolines foo dir/a.txt | packed_dump
+  dir/a.txt:2:@4+0-3
+  dir/a.txt:2:@4+8-11
+  dir/a.txt:5:@27+5-8
+  dir/a.txt: 3 matches, 40 bytes
+
+Multiline and inverted matches:
+
+  $ ag --packed 'two foo\nthree' dir/a.txt | packed_dump
+  dir/a.txt:2:5:foo two foo
+  dir/a.txt: 1 matches, 40 bytes
+  $ ag --packed -v 'o|i' dir/a.txt | packed_dump
+  dir/a.txt:3:1:three
+  dir/a.txt: 1 matches, 40 bytes
+
+Binary files and files only:
+
+  $ ag --packed --search-binary foo dir/bin.dat | packed_dump
+  dir/bin.dat: 1 matches, 0 bytes, binary
+  $ ag --packed -c foo dir/a.txt dir/b.txt | packed_dump
+  dir/a.txt:3
+  dir/b.txt:2
+  $ ag --packed -g 'b\.txt' dir | packed_dump
+  dir/b.txt:1
+
+Nothing found is still a valid stream:
+
+  $ ag --packed zzz dir | packed_dump
+
+  $ ag --packed --queries queries.txt dir
+  ERR: --packed can't be used with --queries
+  [2]
@@ -0,0 +1,164 @@
+/* Decode ag --packed output, for tests/packed.t:
+ *
+ *   ag --packed PATTERN PATH... | packed_dump
+ *
+ * Each submatch is printed like --vimgrep prints it, as PATH:LINE:COLUMN:TEXT,
+ * so the two can be compared. TEXT is the line the submatch starts on. Context
+ * lines are PATH-LINE-TEXT, the end of each file is PATH: MATCHES matches,
+ * BYTES bytes, and -l, -c and -g results are PATH:MATCHES. Without lines in
+ * the stream, submatches are PATH:LINE:@OFFSET+START-END and context lines
+ * PATH-LINE-@OFFSET.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "packed.h"
+
+typedef struct {
+    const unsigned char *path;
+    size_t len;
+} path_t;
+
+static path_t *paths = NULL;
+static size_t paths_len = 0;
+
+static int bad(const char *what) {
+    fprintf(stderr, "packed_dump: %s\n", what);
+    return 1;
+}
+
+static path_t *find_path(const uint64_t id) {
+    return id < paths_len && paths[id].path ? &paths[id] : NULL;
+}
+
+/* The line in lines->line that starts at start, up to its newline */
+static void print_line_at(const packed_lines_t *lines, uint64_t start) {
+    const unsigned char *nl;
+    size_t len;
+
+    if (lines->line == NULL) {
+        printf("@%lu\n", (unsigned long)lines->offset);
+        return;
+    }
+    while (start > 0 && lines->line[start - 1] != '\n') {
+        start--;
+    }
+    len = lines->line_len - start;
+    nl = memchr(lines->line + start, '\n', len);
+    if (nl) {
+        len = nl - (lines->line + start);
+    }
+    fwrite(lines->line + start, 1, len, stdout);
+    putchar('\n');
+}
+
+int main(void) {
+    unsigned char *buf = NULL;
+    size_t buf_len = 0;
+    size_t buf_size = 0;
+    size_t n;
+    const unsigned char *pos;
+    const unsigned char *end;
+    const unsigned char *p;
+    packed_record_t rec;
+    packed_lines_t lines;
+    path_t *path;
+    uint64_t id, a, b, c, line;
+    int flags;
+    int rv;
+
+    do {
+        if (buf_len == buf_size) {
+            buf_size = buf_size ? buf_size * 2 : 65536;
+            buf = realloc(buf, buf_size);
+        }
+        n = fread(buf + buf_len, 1, buf_size - buf_len, stdin);
+        buf_len += n;
+    } while (n > 0);
+
+    pos = buf;
+    end = buf + buf_len;
+    if (packed_read_header(&pos, end, &flags) != 1) {
+        return bad("bad header");
+    }
+    while ((rv = packed_next_record(&pos, end, &rec)) == 1) {
+        p = rec.data;
+        switch (rec.type) {
+            case PACKED_PATH:
+                if (packed_read_varint(&p, rec.data + rec.len, &id) != 1 || id > 1000000) {
+                    return bad("bad path record");
+                }
+                if (id >= paths_len) {
+                    paths = realloc(paths, (id + 1) * sizeof(path_t));
+                    memset(paths + paths_len, 0, (id + 1 - paths_len) * sizeof(path_t));
+                    paths_len = id + 1;
+                }
+                paths[id].path = p;
+                paths[id].len = rec.data + rec.len - p;
+                break;
+            case PACKED_MATCH:
+            case PACKED_CONTEXT:
+                if (packed_read_lines(&rec, flags, &lines) != 1 || (path = find_path(lines.path_id)) == NULL) {
+                    return bad("bad lines record");
+                }
+                if (rec.type == PACKED_CONTEXT) {
+                    fwrite(path->path, 1, path->len, stdout);
+                    printf("-%lu-", (unsigned long)lines.line_number);
+                    print_line_at(&lines, 0);
+                    break;
+                }
+                while ((rv = packed_next_submatch(&lines, &a, &b)) == 1) {
+                    if (lines.line == NULL) {
+                        fwrite(path->path, 1, path->len, stdout);
+                        printf(":%lu:@%lu+%lu-%lu\n", (unsigned long)lines.line_number, (unsigned long)lines.offset,
+                               (unsigned long)a, (unsigned long)b);
+                        continue;
+                    }
+                    /* Count the lines before the submatch */
+                    line = lines.line_number;
+                    for (c = 0; c < a && c < lines.line_len; c++) {
+                        if (lines.line[c] == '\n') {
+                            line++;
+                        }
+                    }
+                    for (c = a; c > 0 && lines.line[c - 1] != '\n'; c--) {
+                    }
+                    fwrite(path->path, 1, path->len, stdout);
+                    printf(":%lu:%lu:", (unsigned long)line, (unsigned long)(a - c + 1));
+                    print_line_at(&lines, a);
+                }
+                if (rv != 0) {
+                    return bad("bad submatch");
+                }
+                break;
+            case PACKED_END:
+                if (packed_read_varint(&p, rec.data + rec.len, &id) != 1 || (path = find_path(id)) == NULL ||
+                    packed_read_varint(&p, rec.data + rec.len, &a) != 1 ||
+                    packed_read_varint(&p, rec.data + rec.len, &b) != 1 ||
+                    packed_read_varint(&p, rec.data + rec.len, &c) != 1) {
+                    return bad("bad end record");
+                }
+                fwrite(path->path, 1, path->len, stdout);
+                printf(": %lu matches, %lu bytes%s\n", (unsigned long)a, (unsigned long)b,
+                       c & PACKED_END_BINARY ? ", binary" : "");
+                break;
+            case PACKED_FILE:
+                if (packed_read_varint(&p, rec.data + rec.len, &id) != 1 || (path = find_path(id)) == NULL ||
+                    packed_read_varint(&p, rec.data + rec.len, &a) != 1) {
+                    return bad("bad file record");
+                }
+                fwrite(path->path, 1, path->len, stdout);
+                printf(":%lu\n", (unsigned long)a);
+                break;
+            default:
+                break;
+        }
+    }
+    if (rv != 0) {
+        return bad("truncated record");
+    }
+    free(paths);
+    free(buf);
+    return 0;
+}
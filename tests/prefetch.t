@@ -0,0 +1,28 @@
+Setup:
+
+  $ . $TESTDIR/setup.sh
+  $ mkdir -p prefetch_dir
+  $ for i in 1 2 3 4 5; do printf "foo $i\nbar\n" > prefetch_dir/$i.txt; done
+
+Same results with prefetching:
+
+  $ ag --prefetch 2 foo prefetch_dir | sort
+  prefetch_dir/1.txt:1:foo 1
+  prefetch_dir/2.txt:1:foo 2
+  prefetch_dir/3.txt:1:foo 3
+  prefetch_dir/4.txt:1:foo 4
+  prefetch_dir/5.txt:1:foo 5
+
+  $ ag --prefetch 0 -c bar prefetch_dir | sort
+  prefetch_dir/1.txt:1
+  prefetch_dir/2.txt:1
+  prefetch_dir/3.txt:1
+  prefetch_dir/4.txt:1
+  prefetch_dir/5.txt:1
+
+Invalid counts:
+
+  $ ag --prefetch 1000 foo prefetch_dir
+  ERR: Invalid prefetch count. Must be between 0 and 256
+  
+  [2]
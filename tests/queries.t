@@ -0,0 +1,84 @@
+Setup:
+
+  $ . $TESTDIR/setup.sh
+  $ mkdir dir
+  $ printf "foo bar\nBAR baz\n" > dir/a.c
+  $ printf "foo\nnothing\n" > dir/b.py
+  $ cat > queries.txt << 'EOF'
+  > # Each query's options apply to it only
+  > foos foo
+  > bars -i --cc "bar"
+  > noo -v o
+  > dots -Q 'a.r'
+  > EOF
+
+Every query's results are tagged with its name:
+
+  $ ag --queries queries.txt dir | sort
+  bars:dir/a.c:1:foo bar
+  bars:dir/a.c:2:BAR baz
+  foos:dir/a.c:1:foo bar
+  foos:dir/b.py:1:foo
+  noo:dir/a.c:2:BAR baz
+
+Options that apply to every query go on the command line:
+
+  $ ag --queries queries.txt -l dir | sort
+  bars:dir/a.c
+  foos:dir/a.c
+  foos:dir/b.py
+  noo:dir/a.c
+
+Or each query gets its own file:
+
+  $ mkdir out
+  $ ag --queries queries.txt --queries-output out dir
+  $ sort out/foos
+  dir/a.c:1:foo bar
+  dir/b.py:1:foo
+  $ cat out/bars
+  dir/a.c:1:foo bar
+  dir/a.c:2:BAR baz
+  $ cat out/dots
+
+-G limits a query to some files:
+
+  $ printf "py -G py$ foo\n" > py.txt
+  $ ag --queries py.txt dir
+  py:dir/b.py:1:foo
+
+Smart case is decided by each query's own pattern:
+
+  $ printf "upper BAR\nlower bar\nsmart -S Foo\n" > case.txt
+  $ ag --queries case.txt dir | sort
+  lower:dir/a.c:1:foo bar
+  lower:dir/a.c:2:BAR baz
+  upper:dir/a.c:2:BAR baz
+  $ ag --queries case.txt -s dir | sort
+  lower:dir/a.c:1:foo bar
+  upper:dir/a.c:2:BAR baz
+
+Nothing matched:
+
+  $ printf "none zzz\n" > none.txt
+  $ ag --queries none.txt dir
+  [1]
+
+Bad queries:
+
+  $ printf "a -x foo\n" > bad.txt
+  $ ag --queries bad.txt dir
+  ERR: bad.txt:1: -x can't be used in a query
+  [2]
+  $ printf "a foo\na bar\n" > bad.txt
+  $ ag --queries bad.txt dir
+  ERR: bad.txt:2: there's already a query named a
+  [2]
+  $ printf "../a foo\n" > bad.txt
+  $ ag --queries bad.txt dir
+  ERR: bad.txt:1: query names can only have letters, numbers, '_', '-' and '.', and can't start with '.'
+  [2]
+  $ printf "a 'foo\n" > bad.txt
+  $ ag --queries bad.txt dir
+  ERR: bad.txt:1: unclosed quote
+  [2]
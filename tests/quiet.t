@@ -0,0 +1,28 @@
+Setup:
+
+  $ . $TESTDIR/setup.sh
+  $ printf "foo\n" > quiet_test.txt
+  $ printf "bar\n" >> quiet_test.txt
+
+Match prints nothing:
+
+  $ ag -q foo quiet_test.txt
+
+No match exits with 1:
+
+  $ ag --quiet zoo quiet_test.txt
+  [1]
+
+Works with -l and -v:
+
+  $ ag -q -l bar
+  $ ag -q -v "foo|bar" quiet_test.txt
+  [1]
+
+Stream search:
+
+  $ unalias ag
+  $ alias ag="$TESTDIR/../ag --noaffinity --nocolor --workers=1"
+  $ printf "foo\nbar\n" | ag -q bar
+  $ printf "foo\nbar\n" | ag -q zoo
+  [1]
@@ -0,0 +1,40 @@
+Setup:
+
+  $ . $TESTDIR/setup.sh
+  $ printf 'id=42 name=bob\nid=7 name=al\nnothing\nid=9\n' > ids.txt
+  $ printf 'a=1 b=2\n' > pairs.txt
+
+Print a capture group instead of the match:
+
+  $ ag --replace '$1' 'id=(\d+)' ids.txt
+  42
+  7
+  9
+
+Groups that didn't match are empty. $0 is the whole match and $$ is a $:
+
+  $ ag --replace '${2}:$1 ($0) $$' 'id=(\d+)(?: name=(\w+))?' ids.txt
+  bob:42 (id=42 name=bob) $
+  al:7 (id=7 name=al) $
+  :9 (id=9) $
+
+Every match on a line gets printed, with file names and line numbers like -o:
+
+  $ ag --replace '$2=$1' --nogroup '(\w)=(\d)' pairs.txt ids.txt
+  pairs.txt:1:1=a
+  pairs.txt:1:2=b
+  ids.txt:1:4=d
+  ids.txt:2:7=d
+  ids.txt:4:9=d
+  $ ag --replace '$1' --nomultiline --column '(\w)=' pairs.txt
+  1:a
+  5:b
+
+Bad templates:
+
+  $ ag --replace '$x' a ids.txt
+  ERR: Invalid --replace. Use $N or ${N} for capture group N (up to 99) and $$ for $.
+  [2]
+  $ ag --replace '${1' a ids.txt
+  ERR: Invalid --replace. Use $N or ${N} for capture group N (up to 99) and $$ for $.
+  [2]
@@ -0,0 +1,43 @@
+Setup:
+
+  $ . $TESTDIR/setup.sh
+  $ awk 'BEGIN { for (i = 1; i <= 300000; i++) print "line " i }' > split.txt
+
+Big files are searched in chunks, with the same results:
+
+  $ ag --workers 4 --split-size 1 -c line split.txt
+  300000
+  $ ag --workers 4 --split-size 1 '^line (1|150000|300000)$' split.txt
+  1:line 1
+  150000:line 150000
+  300000:line 300000
+  $ ag --workers 4 --split-size 1 -C 1 '0000$' split.txt > split_on
+  $ ag --workers 4 --split-size 0 -C 1 '0000$' split.txt > split_off
+  $ diff split_on split_off
+
+Matches spanning lines:
+
+  $ ag --workers 4 --split-size 1 -c '9\nline \d+0\n' split.txt
+  30000
+  $ ag --workers 4 --split-size 1 -v '[0-8]$' split.txt | tail -n 2
+  299989:line 299989
+  299999:line 299999
+
+A single file is split even when it's smaller than --split-size:
+
+  $ ag -D --workers 4 -c line split.txt 2>&1 | grep -c '^DEBUG: Splitting split.txt'
+  1
+  $ ag -D --workers 4 -c line split.txt . 2>&1 | grep -c '^DEBUG: Splitting'
+  0
+  [1]
+  $ ag --workers 4 -B 2 '^line 299999$' split.txt
+  299997-line 299997
+  299998-line 299998
+  299999:line 299999
+
+Invalid sizes:
+
+  $ ag --split-size big line split.txt
+  ERR: Invalid split size
+  
+  [2]
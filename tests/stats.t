@@ -0,0 +1,96 @@
+Setup:
+
+  $ . $TESTDIR/setup.sh
+  $ printf 'foo\n' > a.txt
+  $ printf 'foo\0bin' > b.bin
+  $ printf 'ign.txt\n' > .gitignore
+  $ printf 'foo\n' > ign.txt
+  $ ln -s a.txt link.txt
+  $ alias times="sed 's/^\( *\)[0-9.]* seconds/\1T seconds/'"
+
+Skipped files are counted by why they were skipped, and time by what it was
+spent on:
+
+  $ ag --stats-only foo . | times
+  1 matches
+  1 files contained matches
+  1 files searched
+  4 bytes searched
+  T seconds
+  4 files skipped (2 ignored, 1 binary, 0 too large, 1 symlinks, 0 errors)
+  Time summed over all threads:
+    T seconds walking directories (including ignores)
+    T seconds evaluating ignore patterns
+    T seconds opening and reading files
+    T seconds detecting binary files
+    T seconds decompressing
+    T seconds matching
+    T seconds printing (including lock waits)
+    T seconds prefetching queued files
+    T seconds waiting for files to search
+
+Following symlinks, a dangling one is an error:
+
+  $ ln -s missing dangling
+  $ ag --stats-only --silent -f foo . | grep skipped
+  4 files skipped (2 ignored, 1 binary, 0 too large, 0 symlinks, 1 errors)
+  $ rm dangling
+
+--stats prints the matches too:
+
+  $ ag --stats foo a.txt | times
+  1:foo
+  1 matches
+  1 files contained matches
+  1 files searched
+  4 bytes searched
+  T seconds
+  0 files skipped (0 ignored, 0 binary, 0 too large, 0 symlinks, 0 errors)
+  Time summed over all threads:
+    T seconds walking directories (including ignores)
+    T seconds evaluating ignore patterns
+    T seconds opening and reading files
+    T seconds detecting binary files
+    T seconds decompressing
+    T seconds matching
+    T seconds printing (including lock waits)
+    T seconds prefetching queued files
+    T seconds waiting for files to search
+
+--stats-json writes the same numbers and more as one JSON document:
+
+  $ ag --stats-json stats.json --workers=2 foo . > /dev/null
+  $ python3 - stats.json <<'PY'
+  > import json, sys
+  > doc = json.load(open(sys.argv[1]))
+  > print(sorted(doc))
+  > print(doc["matches"], doc["files_searched"], doc["bytes_searched"])
+  > print(doc["files_skipped"])
+  > print(sorted(doc["phase_seconds"]))
+  > print(all(v >= 0 for v in doc["phase_seconds"].values()))
+  > for name, unit in (("file_latency_histogram", "us"), ("file_size_histogram", "bytes")):
+  >     buckets = doc[name]
+  >     print(name, sum(b["files"] for b in buckets),
+  >           all(b["min_" + unit] <= b["max_" + unit] for b in buckets))
+  > print(sorted((f["path"], f["bytes"]) for f in doc["slowest_files"]))
+  > print(all(sorted(d) == ["depth", "seconds"] for d in doc["queue_depth"]), len(doc["queue_depth"]) > 0)
+  > threads = doc["threads"]
+  > print(len(threads), sum(t["files_searched"] for t in threads),
+  >       all(t["idle_seconds"] >= 0 and t["busy_seconds"] >= 0 for t in threads))
+  > PY
+  ['bytes_searched', 'file_latency_histogram', 'file_size_histogram', 'files_read_with_io_uring', 'files_searched', 'files_skipped', 'files_with_matches', 'matches', 'phase_seconds', 'queue_depth', 'seconds', 'slowest_files', 'threads']
+  1 1 4
+  {'ignored': 2, 'binary': 1, 'too_large': 0, 'symlink': 1, 'error': 0}
+  ['binary', 'decompress', 'idle', 'ignore', 'match', 'open', 'prefetch', 'print', 'walk']
+  True
+  file_latency_histogram 2 True
+  file_size_histogram 2 True
+  [('./a.txt', 4), ('./b.bin', 7)]
+  True True
+  3 1 True
+
+With - it goes to stdout, after the results:
+
+  $ ag --stats-json - foo a.txt | head -2
+  1:foo
+  {
@@ -0,0 +1,72 @@
+Setup:
+
+  $ . $TESTDIR/setup.sh
+  $ unalias ag
+  $ alias ag="$TESTDIR/../ag --noaffinity --nocolor --workers=1"
+
+Multiline matches work on streams too:
+
+  $ printf 'one\nfoo two\nbar three\nfour\n' | ag --numbers 'two\nbar'
+  2:foo two
+  3:bar three
+
+Even when the match arrives in pieces:
+
+  $ (printf 'foo\n'; sleep 0.2; printf 'bar\nbaz\n') | ag --numbers 'foo\nbar'
+  1:foo
+  2:bar
+
+Offsets are from the start of the stream:
+
+  $ printf 'a\nb foo\nc\nd foo\n' | ag --json 'fo+'
+  {"type":"match","path":"","line_number":2,"offset":2,"lines":"b foo","submatches":[{"start":2,"end":5}]}
+  {"type":"match","path":"","line_number":4,"offset":10,"lines":"d foo","submatches":[{"start":2,"end":5}]}
+
+Context around a match at the edge of the window is the same as in a file:
+
+  $ printf 'a\nb\nc\nfoo\nbar\nd\ne\nf\ng\nh\nfoo\nbar\ni\nj\n' > ctx.txt
+  $ cat ctx.txt | ag --stream-window 16 --numbers -C2 'foo\nbar'
+  2-b
+  3-c
+  4:foo
+  5:bar
+  6-d
+  7-e
+  --
+  9-g
+  10-h
+  11:foo
+  12:bar
+  13-i
+  14-j
+
+Lines longer than what's left of the window aren't cut in two:
+
+  $ printf 'needle\nhay\nfoo alpha beta\nbar\n' | ag --stream-window 12 --numbers -A1 'needle\nhay'
+  1:needle
+  2:hay
+  3-foo alpha beta
+  $ printf 'one\na long line with beta in it\nend\n' | ag --stream-window 8 --numbers 'bet+a'
+  2:a long line with beta in it
+
+Lines that match are context for inverted matches in the next window:
+
+  $ printf 'a\nfoo\nfoo\nfoo\nb\nfoo\nfoo\nfoo\nfoo\nc\n' | ag --stream-window 8 --numbers -v -C1 'fo+'
+  1:a
+  2-foo
+  --
+  4-foo
+  5:b
+  6-foo
+  --
+  9-foo
+  10:c
+
+Matches longer than --stream-window are missed, and 0 searches a line at a time:
+
+  $ printf 'foo two\nbar three\n' | ag --stream-window 8 'foo.*\nbar'
+  [1]
+  $ printf 'foo two\nbar three\n' | ag --stream-window 0 'foo.*\nbar'
+  [1]
+  $ printf 'foo two\nbar three\n' | ag --stream-window 0 --numbers 'o+'
+  1:foo two
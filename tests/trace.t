@@ -0,0 +1,32 @@
+Setup:
+
+  $ . $TESTDIR/setup.sh
+  $ mkdir trace_dir
+  $ printf "foo\n" > trace_dir/a.txt
+  $ printf "bar\n" > trace_dir/b.txt
+
+Tracing doesn't change the output:
+
+  $ ag --trace trace.json --workers 2 foo trace_dir
+  trace_dir/a.txt:1:foo
+
+Each file searched gets a span with its path:
+
+  $ grep -c '"name":"file".*"path":"trace_dir/[ab].txt"' trace.json
+  2
+  $ grep -c '"name":"match"' trace.json
+  2
+
+Only files with matches are printed:
+
+  $ grep -c '"name":"print"' trace.json
+  1
+  $ grep -c '"name":"print_wait"' trace.json
+  1
+
+Every thread is named:
+
+  $ grep -o '"args":{"name":"[a-z 0-9]*"}' trace.json | sort
+  "args":{"name":"walker"}
+  "args":{"name":"worker 0"}
+  "args":{"name":"worker 1"}
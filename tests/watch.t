@@ -0,0 +1,63 @@
+Setup:
+
+  $ . $TESTDIR/setup.sh
+  $ mkdir logs
+  $ printf 'one\nfoo a\n' > logs/a.log
+  $ if ! ag --version | grep -q '+inotify' ||
+  >    timeout 5 $TESTDIR/../ag --watch --max-total-count 1 foo logs 2>&1 >/dev/null | grep -q 'watch'; then
+  >   echo "inotify isn't available. Skipping test."
+  >   exit 80
+  > fi
+
+A missed event would leave ag waiting forever, so give up after a while:
+
+  $ alias ag="timeout 10 $TESTDIR/../ag --noaffinity --nocolor --workers=1 --parallel"
+
+Lines added to files are searched as they're added, and so are new files,
+new directories and files that replace the ones being followed:
+
+  $ ag --watch --max-total-count 6 --ignore '*.tmp' foo logs > out.txt &
+  $ sleep 1
+  $ printf 'two\nfoo b\n' >> logs/a.log
+  $ sleep 0.3
+  $ mkdir logs/sub
+  $ printf 'foo c\n' > logs/sub/new.log
+  $ printf 'foo ignored\n' > logs/skip.tmp
+  $ sleep 0.3
+  $ mv logs/a.log logs/a.log.1
+  $ printf 'foo d\n' > logs/a.log
+  $ sleep 0.3
+  $ printf 'foo e\n' >> logs/a.log.1
+  $ sleep 0.3
+  $ printf 'foo f' >> logs/a.log
+  $ sleep 0.3
+  $ printf ' f\n' >> logs/a.log
+  $ wait
+  $ cat out.txt
+  logs/a.log:2:foo a
+  logs/a.log:4:foo b
+  logs/sub/new.log:1:foo c
+  logs/a.log:1:foo d
+  logs/a.log.1:5:foo e
+  logs/a.log:2:foo f f
+
+A file named on the command line is followed through truncation:
+
+  $ printf 'foo 1\n' > one.log
+  $ ag --watch --max-total-count 2 --json foo one.log > out.txt &
+  $ sleep 1
+  $ : > one.log
+  $ sleep 0.3
+  $ printf 'foo 2\n' >> one.log
+  $ wait
+  $ cat out.txt
+  {"type":"begin","path":"one.log"}
+  {"type":"match","path":"one.log","line_number":1,"offset":0,"lines":"foo 1","submatches":[{"start":0,"end":3}]}
+  {"type":"end","path":"one.log","matches":1,"bytes":6}
+  {"type":"match","path":"one.log","line_number":1,"offset":0,"lines":"foo 2","submatches":[{"start":0,"end":3}]}
+
+Listing files doesn't make sense when they keep changing:
+
+  $ ag --watch -l foo logs
+  ERR: --watch can't be used with -c, -g, -l or -L
+  [2]
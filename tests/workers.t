@@ -0,0 +1,16 @@
+Setup:
+
+  $ . $TESTDIR/setup.sh
+  $ printf "foo\n" > workers.txt
+
+Say how many workers were picked and why:
+
+  $ ag --workers auto foo workers.txt 2>&1 >/dev/null | grep -c '^ag: using [0-9]* workers*: [0-9]* CPUs* allowed on [0-9]* cores* and [0-9]* NUMA nodes*'
+  1
+  $ ag --workers auto foo workers.txt 2>/dev/null
+  1:foo
+
+Don't with a number of workers:
+
+  $ ag --workers 2 foo workers.txt 2>&1
+  1:foo